@@ -0,0 +1,89 @@
+#include "acpi.h"
+#include "paging.h"
+#include "klog.h"
+#include "kernel.h"
+
+typedef struct {
+    char signature[8];  // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed)) acpi_rsdp_t;
+
+#define ACPI_MAX_TABLES 32
+
+static const acpi_header_t* tables[ACPI_MAX_TABLES];
+static int table_count = 0;
+
+static int acpi_checksum_ok(const void* p, uint32_t length) {
+    const uint8_t* b = p;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) sum += b[i];
+    return sum == 0;
+}
+
+static const acpi_rsdp_t* acpi_scan_rsdp(uint32_t start, uint32_t end) {
+    for (uint32_t addr = start; addr + sizeof(acpi_rsdp_t) <= end; addr += 16) {
+        const acpi_rsdp_t* rsdp = (const acpi_rsdp_t*)addr;
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && acpi_checksum_ok(rsdp, sizeof(*rsdp))) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+// Tables usually sit in reserved RAM near the top of memory, outside the
+// identity mapped low 4 MiB. The header is mapped first to learn the length.
+static const acpi_header_t* acpi_map_table(uint32_t addr) {
+    if (!addr) return NULL;
+    paging_identity_map(addr, addr + sizeof(acpi_header_t), 0);
+    const acpi_header_t* h = (const acpi_header_t*)addr;
+    if (h->length < sizeof(acpi_header_t)) return NULL;
+    paging_identity_map(addr, addr + h->length, 0);
+    return acpi_checksum_ok(h, h->length) ? h : NULL;
+}
+
+void acpi_init(void) {
+    // The EBDA's first KiB, then the BIOS area below 1 MiB. The EBDA
+    // segment is in the BIOS data area, on the page kept unmapped for NULL.
+    uint16_t ebda_seg;
+    map_page(0, 0, 0);
+    asm volatile ( "movw 0x40E, %0" : "=r"(ebda_seg) : : "memory" );
+    unmap_page(0);
+    uint32_t ebda = (uint32_t)ebda_seg << 4;
+    const acpi_rsdp_t* rsdp = NULL;
+    if (ebda >= 0x80000 && ebda < 0xA0000) rsdp = acpi_scan_rsdp(ebda, ebda + 1024);
+    if (!rsdp) rsdp = acpi_scan_rsdp(0xE0000, 0x100000);
+    if (!rsdp) {
+        klog(KLOG_WARN, "acpi: no RSDP found");
+        return;
+    }
+
+    // The 32-bit RSDT is present on every revision, the XSDT adds nothing
+    // a 32-bit kernel can reach
+    const acpi_header_t* rsdt = acpi_map_table(rsdp->rsdt_address);
+    if (!rsdt || memcmp(rsdt->signature, "RSDT", 4) != 0) {
+        klog(KLOG_WARN, "acpi: bad RSDT at 0x%08X", rsdp->rsdt_address);
+        return;
+    }
+
+    const uint32_t* entries = (const uint32_t*)(rsdt + 1);
+    uint32_t count = (rsdt->length - sizeof(acpi_header_t)) / 4;
+    for (uint32_t i = 0; i < count && table_count < ACPI_MAX_TABLES; i++) {
+        const acpi_header_t* h = acpi_map_table(entries[i]);
+        if (!h) {
+            klog(KLOG_WARN, "acpi: bad table at 0x%08X", entries[i]);
+            continue;
+        }
+        tables[table_count++] = h;
+        klog(KLOG_INFO, "acpi: %.4s at 0x%08X, %u bytes", h->signature, entries[i], h->length);
+    }
+}
+
+const acpi_header_t* acpi_find_table(const char* signature) {
+    for (int i = 0; i < table_count; i++) {
+        if (memcmp(tables[i]->signature, signature, 4) == 0) return tables[i];
+    }
+    return NULL;
+}
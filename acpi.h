@@ -0,0 +1,138 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+// Generic Address Structure
+typedef struct {
+    uint8_t space_id;    // 0 = memory, 1 = I/O port
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+} __attribute__((packed)) acpi_gas_t;
+
+typedef struct {
+    acpi_header_t header;
+    uint32_t event_timer_block_id;
+    acpi_gas_t base;
+    uint8_t hpet_number;
+    uint16_t min_tick;
+    uint8_t page_protection;
+} __attribute__((packed)) acpi_hpet_t;
+
+// FADT, only up to the fields the kernel reads
+typedef struct {
+    acpi_header_t header;
+    uint32_t firmware_ctrl;
+    uint32_t dsdt;
+    uint8_t reserved0;
+    uint8_t preferred_pm_profile;
+    uint16_t sci_int;
+    uint32_t smi_cmd;
+    uint8_t acpi_enable;
+    uint8_t acpi_disable;
+    uint8_t s4bios_req;
+    uint8_t pstate_cnt;
+    uint32_t pm1a_evt_blk;
+    uint32_t pm1b_evt_blk;
+    uint32_t pm1a_cnt_blk;
+    uint32_t pm1b_cnt_blk;
+    uint32_t pm2_cnt_blk;
+    uint32_t pm_tmr_blk;
+    uint32_t gpe0_blk;
+    uint32_t gpe1_blk;
+    uint8_t pm1_evt_len;
+    uint8_t pm1_cnt_len;
+    uint8_t pm2_cnt_len;
+    uint8_t pm_tmr_len;
+    uint8_t gpe0_blk_len;
+    uint8_t gpe1_blk_len;
+    uint8_t gpe1_base;
+    uint8_t cst_cnt;
+    uint16_t p_lvl2_lat;
+    uint16_t p_lvl3_lat;
+    uint16_t flush_size;
+    uint16_t flush_stride;
+    uint8_t duty_offset;
+    uint8_t duty_width;
+    uint8_t day_alrm;
+    uint8_t mon_alrm;
+    uint8_t century;
+    uint16_t iapc_boot_arch;
+    uint8_t reserved1;
+    uint32_t flags;
+} __attribute__((packed)) acpi_fadt_t;
+
+#define ACPI_FADT_TMR_VAL_EXT (1 << 8)  // PM timer is 32 bits wide, not 24
+
+// MADT ("APIC"): the interrupt controllers, followed by variable length
+// entries that each start with a type and a length
+typedef struct {
+    acpi_header_t header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+#define ACPI_MADT_PCAT_COMPAT 1  // Dual 8259s are present too
+
+#define ACPI_MADT_LAPIC      0
+#define ACPI_MADT_IOAPIC     1
+#define ACPI_MADT_OVERRIDE   2
+#define ACPI_MADT_LAPIC_ADDR 5
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) acpi_madt_entry_t;
+
+typedef struct {
+    acpi_madt_entry_t entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;  // Bit 0: enabled, bit 1: can be brought online
+} __attribute__((packed)) acpi_madt_lapic_t;
+
+typedef struct {
+    acpi_madt_entry_t entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed)) acpi_madt_ioapic_t;
+
+// ISA IRQ wired to a different GSI, or with non-ISA polarity/trigger
+typedef struct {
+    acpi_madt_entry_t entry;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;  // Bits 0-1 polarity, bits 2-3 trigger, 0 = bus default
+} __attribute__((packed)) acpi_madt_override_t;
+
+typedef struct {
+    acpi_madt_entry_t entry;
+    uint16_t reserved;
+    uint64_t address;
+} __attribute__((packed)) acpi_madt_lapic_addr_t;
+
+// Finds the RSDP and maps the RSDT and the tables it lists. Needs paging.
+void acpi_init(void);
+
+// Returns the first table with a valid checksum and this signature, or NULL
+const acpi_header_t* acpi_find_table(const char* signature);
+
+#endif
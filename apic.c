@@ -0,0 +1,524 @@
+#include "apic.h"
+#include "acpi.h"
+#include "paging.h"
+#include "mm.h"
+#include "cpu.h"
+#include "clock.h"
+#include "timer.h"
+#include "serial.h"
+#include "klog.h"
+#include "kernel.h"
+
+/* --- REGISTERS --- */
+
+#define IA32_APIC_BASE   0x1B
+#define APIC_BASE_ENABLE (1 << 11)
+
+#define LAPIC_ID         0x020
+#define LAPIC_VERSION    0x030
+#define LAPIC_TPR        0x080
+#define LAPIC_EOI        0x0B0
+#define LAPIC_SVR        0x0F0
+#define LAPIC_ICR_LOW    0x300
+#define LAPIC_ICR_HIGH   0x310
+#define LAPIC_LVT_TIMER  0x320
+#define LAPIC_LVT_LINT0  0x350
+#define LAPIC_LVT_ERROR  0x370
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3E0
+
+#define SVR_ENABLE (1 << 8)
+#define LVT_MASKED (1 << 16)
+#define LVT_EXTINT (7 << 8)
+
+#define ICR_INIT         (5 << 8)
+#define ICR_STARTUP      (6 << 8)
+#define ICR_PENDING      (1 << 12)
+#define ICR_ASSERT       (1 << 14)
+#define ICR_LEVEL        (1 << 15)
+#define ICR_ALL_BUT_SELF (3 << 18)
+
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+#define IOAPIC_VER    0x01
+#define IOAPIC_REDTBL 0x10  // Two registers per pin
+
+#define REDTBL_ACTIVE_LOW (1 << 13)
+#define REDTBL_LEVEL      (1 << 15)
+#define REDTBL_MASKED     (1 << 16)
+
+typedef struct {
+    volatile uint32_t* regs;
+    uint8_t id;
+    uint32_t gsi_base;
+    uint32_t pins;
+} ioapic_t;
+
+// Where an ISA IRQ ends up, identity unless the MADT overrides it
+typedef struct {
+    uint32_t gsi;
+    uint16_t flags;  // MADT polarity and trigger bits
+    uint8_t vector;  // 0 while not routed
+} isa_irq_t;
+
+static volatile uint32_t* lapic = NULL;
+static uint32_t lapic_phys = 0;
+static uint8_t bsp_id = 0;
+static uint8_t cpu_ids[MAX_CPUS];
+static int cpu_count = 0;
+static ioapic_t ioapics[APIC_MAX_IOAPICS];
+static int ioapic_count = 0;
+static isa_irq_t isa_irqs[16];
+static int active = 0;
+
+volatile uint32_t* lapic_eoi_reg = NULL;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t val) {
+    lapic[reg / 4] = val;
+}
+
+static uint32_t ioapic_read(const ioapic_t* io, uint32_t reg) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(const ioapic_t* io, uint32_t reg, uint32_t val) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WINDOW / 4] = val;
+}
+
+static const ioapic_t* ioapic_for_gsi(uint32_t gsi) {
+    for (int i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].pins) return &ioapics[i];
+    }
+    return NULL;
+}
+
+/* --- MADT --- */
+
+static void madt_parse(const acpi_madt_t* madt) {
+    lapic_phys = madt->lapic_address;
+    for (int i = 0; i < 16; i++) isa_irqs[i].gsi = i;
+
+    const uint8_t* p = (const uint8_t*)(madt + 1);
+    const uint8_t* end = (const uint8_t*)madt + madt->header.length;
+    while (p + sizeof(acpi_madt_entry_t) <= end) {
+        const acpi_madt_entry_t* e = (const acpi_madt_entry_t*)p;
+        if (e->length < sizeof(*e) || p + e->length > end) break;
+
+        switch (e->type) {
+        case ACPI_MADT_LAPIC: {
+            const acpi_madt_lapic_t* l = (const acpi_madt_lapic_t*)e;
+            if ((l->flags & 1) && cpu_count < MAX_CPUS) cpu_ids[cpu_count++] = l->apic_id;
+            break;
+        }
+        case ACPI_MADT_IOAPIC: {
+            const acpi_madt_ioapic_t* io = (const acpi_madt_ioapic_t*)e;
+            if (ioapic_count < APIC_MAX_IOAPICS) {
+                ioapics[ioapic_count].regs = (volatile uint32_t*)io->address;
+                ioapics[ioapic_count].id = io->id;
+                ioapics[ioapic_count].gsi_base = io->gsi_base;
+                ioapic_count++;
+            }
+            break;
+        }
+        case ACPI_MADT_OVERRIDE: {
+            const acpi_madt_override_t* o = (const acpi_madt_override_t*)e;
+            if (o->bus == 0 && o->source < 16) {
+                isa_irqs[o->source].gsi = o->gsi;
+                isa_irqs[o->source].flags = o->flags;
+            }
+            break;
+        }
+        case ACPI_MADT_LAPIC_ADDR: {
+            const acpi_madt_lapic_addr_t* a = (const acpi_madt_lapic_addr_t*)e;
+            if (!(a->address >> 32)) lapic_phys = (uint32_t)a->address;
+            break;
+        }
+        }
+        p += e->length;
+    }
+}
+
+/* --- I/O APIC ROUTING --- */
+
+// Fixed delivery to the boot CPU. ISA lines default to edge, active high.
+static void ioapic_route(uint8_t irq, uint8_t vector) {
+    isa_irq_t* r = &isa_irqs[irq];
+    const ioapic_t* io = ioapic_for_gsi(r->gsi);
+    uint32_t pin = r->gsi - io->gsi_base;
+
+    uint32_t low = vector;
+    if ((r->flags & 3) == 3) low |= REDTBL_ACTIVE_LOW;
+    if (((r->flags >> 2) & 3) == 3) low |= REDTBL_LEVEL;
+
+    // High half first so the entry is never live with a stale destination
+    ioapic_write(io, IOAPIC_REDTBL + pin * 2 + 1, (uint32_t)bsp_id << 24);
+    ioapic_write(io, IOAPIC_REDTBL + pin * 2, low);
+    r->vector = vector;
+}
+
+static void ioapic_mask(uint8_t irq, int masked) {
+    isa_irq_t* r = &isa_irqs[irq];
+    if (!r->vector) return;
+    const ioapic_t* io = ioapic_for_gsi(r->gsi);
+    uint32_t reg = IOAPIC_REDTBL + (r->gsi - io->gsi_base) * 2;
+    uint32_t low = ioapic_read(io, reg);
+    ioapic_write(io, reg, masked ? low | REDTBL_MASKED : low & ~REDTBL_MASKED);
+}
+
+// Edges raised while a line was masked are lost, and the keyboard and UART
+// hold their line high until serviced. Reading out a waiting scancode and
+// pushing the pending output lets both lines drop and rise again.
+static void irq_lines_rearm(void) {
+    while (inb(0x64) & 1) inb(0x60);
+    serial_flush();
+}
+
+/* --- LOCAL APIC TIMER --- */
+
+#define LAPIC_CALIBRATE_US 10000
+
+static uint32_t lapic_timer_hz = 0;
+static uint32_t lapic_ns_mult = 0;  // Counts = (ns * mult) >> 32
+
+static void lapic_timer_program(uint64_t delta_ns) {
+    uint64_t count = mul_u64_u32_shr(delta_ns, lapic_ns_mult, 32) + 1;
+    lapic_write(LAPIC_TIMER_INIT, count > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)count);
+}
+
+// max_ns is only known after calibration
+static clockevent_t lapic_clockevent = {
+    .name = "lapic",
+    .min_ns = 1000,
+    .program = lapic_timer_program,
+};
+
+static void lapic_timer_callback(registers_t* regs) {
+    (void)regs;
+    timer_interrupt();
+}
+
+// One-shot at the bus clock divided by 16, calibrated against ktime. The
+// kernel only idles with hlt, where the timer keeps counting.
+static void lapic_timer_init(void) {
+    if (!timer_tickless()) return;
+
+    lapic_write(LAPIC_TIMER_DIV, 0x3);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | APIC_TIMER_VECTOR);
+
+    uint32_t flags = irq_save();
+    uint64_t start = ktime_get_ns();
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    udelay(LAPIC_CALIBRATE_US);
+    uint32_t left = lapic_read(LAPIC_TIMER_CUR);
+    uint32_t elapsed = (uint32_t)(ktime_get_ns() - start);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    irq_restore(flags);
+
+    uint64_t hz = udiv64((uint64_t)(0xFFFFFFFF - left) * 1000000000, elapsed, 0);
+    if (hz < 1000000 || hz >= 1000000000) {
+        klog(KLOG_WARN, "apic: timer calibrated to %u Hz, staying on the pit", (uint32_t)hz);
+        timer_set_clockevent(timer_get_clockevent()); // Re-arm after the switch
+        return;
+    }
+    lapic_timer_hz = (uint32_t)hz;
+    lapic_ns_mult = (uint32_t)udiv64(hz << 32, 1000000000, 0);
+    lapic_clockevent.max_ns = udiv64(0xFFFFFFFFULL * 1000000000, lapic_timer_hz, 0);
+
+    register_interrupt_handler(APIC_TIMER_VECTOR, lapic_timer_callback);
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR);
+    klog(KLOG_INFO, "apic: timer at %u Hz", lapic_timer_hz);
+    timer_set_clockevent(&lapic_clockevent);
+}
+
+/* --- INIT --- */
+
+void apic_init(void) {
+    if (!cpu_features.apic) {
+        klog(KLOG_INFO, "apic: not supported, using the 8259");
+        return;
+    }
+    const acpi_madt_t* madt = (const acpi_madt_t*)acpi_find_table("APIC");
+    if (!madt) {
+        klog(KLOG_WARN, "apic: no MADT, using the 8259");
+        return;
+    }
+    madt_parse(madt);
+
+    if (!ioapic_count) {
+        klog(KLOG_WARN, "apic: no I/O APIC, using the 8259");
+        return;
+    }
+
+    paging_identity_map(lapic_phys, lapic_phys + PAGE_SIZE, PAGE_WRITE | PAGE_PCD);
+    lapic = (volatile uint32_t*)lapic_phys;
+    for (int i = 0; i < ioapic_count; i++) {
+        uint32_t base = (uint32_t)ioapics[i].regs;
+        paging_identity_map(base, base + PAGE_SIZE, PAGE_WRITE | PAGE_PCD);
+        ioapics[i].pins = ((ioapic_read(&ioapics[i], IOAPIC_VER) >> 16) & 0xFF) + 1;
+    }
+
+    // Timer, keyboard and serial, on their usual vectors
+    static const uint8_t routed[] = { 0, 1, 4 };
+    for (size_t i = 0; i < sizeof(routed); i++) {
+        if (!ioapic_for_gsi(isa_irqs[routed[i]].gsi)) {
+            klog(KLOG_WARN, "apic: no I/O APIC pin for IRQ%u, using the 8259", routed[i]);
+            return;
+        }
+    }
+
+    uint32_t flags = irq_save();
+    wrmsr(IA32_APIC_BASE, rdmsr(IA32_APIC_BASE) | APIC_BASE_ENABLE);
+
+    // The 8259s keep their vectors but stop raising them
+    outb(0x21, 0xFF);
+    outb(0xA1, 0xFF);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT0, LVT_MASKED | LVT_EXTINT);
+    lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    bsp_id = lapic_read(LAPIC_ID) >> 24;
+
+    // Boot CPU first
+    for (int i = 1; i < cpu_count; i++) {
+        if (cpu_ids[i] != bsp_id) continue;
+        cpu_ids[i] = cpu_ids[0];
+        cpu_ids[0] = bsp_id;
+    }
+
+    for (int i = 0; i < ioapic_count; i++) {
+        for (uint32_t pin = 0; pin < ioapics[i].pins; pin++) {
+            ioapic_write(&ioapics[i], IOAPIC_REDTBL + pin * 2, REDTBL_MASKED);
+        }
+    }
+    for (size_t i = 0; i < sizeof(routed); i++) {
+        ioapic_route(routed[i], 32 + routed[i]);
+    }
+
+    lapic_eoi_reg = &lapic[LAPIC_EOI / 4];
+    active = 1;
+    irq_lines_rearm();
+    irq_restore(flags);
+
+    klog(KLOG_INFO, "apic: lapic %u at 0x%08X, %d CPUs, %d I/O APICs, IRQ0 on GSI %u",
+         bsp_id, lapic_phys, cpu_count, ioapic_count, isa_irqs[0].gsi);
+    lapic_timer_init();
+}
+
+int apic_active(void) {
+    return active;
+}
+
+int apic_cpu_count(void) {
+    return cpu_count;
+}
+
+uint8_t apic_cpu_id(int index) {
+    return cpu_ids[index];
+}
+
+void apic_init_ap(void) {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT0, LVT_MASKED | LVT_EXTINT);
+    lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+/* --- IPIs --- */
+
+static void lapic_send(uint8_t apic_id, uint32_t icr) {
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) asm volatile ( "pause" );
+}
+
+void apic_send_init(uint8_t apic_id) {
+    lapic_send(apic_id, ICR_INIT | ICR_LEVEL | ICR_ASSERT);
+    lapic_send(apic_id, ICR_INIT | ICR_LEVEL); // Deassert, older CPUs want it
+}
+
+void apic_send_startup(uint8_t apic_id, uint8_t page) {
+    lapic_send(apic_id, ICR_STARTUP | page);
+}
+
+void apic_send_ipi_others(uint8_t vector) {
+    lapic_send(0, ICR_ALL_BUT_SELF | vector);
+}
+
+/* --- DUMP --- */
+
+void apic_dump(void) {
+    if (!active) {
+        terminal_writestring("Controller: 8259 PIC\n");
+        return;
+    }
+
+    kprintf("Controller: APIC, 8259 masked\n");
+    kprintf("Local APIC 0x%08X, id %u, version 0x%02X, CPUs:", lapic_phys, bsp_id,
+            lapic_read(LAPIC_VERSION) & 0xFF);
+    for (int i = 0; i < cpu_count; i++) kprintf(" %u", cpu_ids[i]);
+    terminal_writestring("\n");
+    for (int i = 0; i < ioapic_count; i++) {
+        kprintf("I/O APIC %u at 0x%08X, GSI %u-%u\n", ioapics[i].id, (uint32_t)ioapics[i].regs,
+                ioapics[i].gsi_base, ioapics[i].gsi_base + ioapics[i].pins - 1);
+    }
+    for (int irq = 0; irq < 16; irq++) {
+        const isa_irq_t* r = &isa_irqs[irq];
+        if (!r->vector) continue;
+        kprintf("IRQ%-2d -> GSI %-2u vector %u, %s, active %s\n", irq, r->gsi, r->vector,
+                ((r->flags >> 2) & 3) == 3 ? "level" : "edge", (r->flags & 3) == 3 ? "low" : "high");
+    }
+    if (lapic_timer_hz) {
+        uint32_t khz = lapic_timer_hz / 1000;
+        kprintf("Timer: %u.%03u MHz\n", khz / 1000, khz % 1000);
+    }
+}
+
+/* --- LATENCY --- */
+
+// PIT channel 0 in mode 0 is the one source both controllers can receive.
+// Its input clock isn't in phase with the write, so single runs jitter by
+// up to a PIT period (838 ns); the averages still compare fairly.
+#define PIT_HZ 1193182
+#define LAT_PIT_COUNT 120  // About 100 us
+#define LAT_RUNS 64
+
+typedef struct {
+    uint32_t min;  // TSC cycles past the programmed expiry
+    uint32_t avg;
+    int lost;      // Runs where the interrupt never came
+} lat_result_t;
+
+static volatile uint64_t lat_stamp;
+static volatile int lat_done;
+
+static void lat_callback(registers_t* regs) {
+    (void)regs;
+    lat_stamp = rdtsc();
+    lat_done = 1;
+}
+
+// Called and returns with interrupts off
+static void lat_measure(uint64_t expected, lat_result_t* out) {
+    // A mode write holds OUT low, then anything latched earlier drains
+    outb(0x43, 0x30);
+    irq_enable();
+    udelay(10);
+    irq_disable();
+
+    uint64_t total = 0;
+    out->min = ~0u;
+    out->lost = 0;
+    for (int i = 0; i < LAT_RUNS; i++) {
+        lat_done = 0;
+        outb(0x43, 0x30);
+        outb(0x40, LAT_PIT_COUNT & 0xFF);
+        outb(0x40, LAT_PIT_COUNT >> 8);
+        uint64_t start = rdtsc();
+        uint64_t give_up = start + expected * 100;
+        // Bare sti/cli: the irqsoff hooks would add to the latency measured
+        asm volatile ( "sti" );
+        while (!lat_done && rdtsc() < give_up) asm volatile ( "pause" );
+        asm volatile ( "cli" );
+        if (!lat_done) {
+            out->lost++;
+            continue;
+        }
+
+        uint64_t took = lat_stamp - start;
+        uint64_t late = took > expected ? took - expected : 0;
+        if (late > 0xFFFFFFFF) late = 0xFFFFFFFF;
+        total += late;
+        if (late < out->min) out->min = (uint32_t)late;
+    }
+    int got = LAT_RUNS - out->lost;
+    out->avg = got ? (uint32_t)udiv64(total, got, 0) : 0;
+    if (!got) out->min = 0;
+}
+
+static uint32_t cycles_to_ns(uint32_t cycles) {
+    uint32_t khz = tsc_khz();
+    return (uint32_t)udiv64((uint64_t)cycles * 1000000, khz, 0);
+}
+
+static void lat_print(const char* name, const lat_result_t* r) {
+    kprintf("  %-9s min %6u  avg %6u cycles  (avg %u ns)", name, r->min, r->avg, cycles_to_ns(r->avg));
+    if (r->lost) kprintf("  %d lost", r->lost);
+    terminal_writestring("\n");
+}
+
+void apic_latency(void) {
+    if (!active) {
+        terminal_writestring("The APIC is not in use, nothing to compare.\n");
+        return;
+    }
+    if (!tsc_hz()) {
+        terminal_writestring("Needs a TSC.\n");
+        return;
+    }
+
+    uint64_t expected = udiv64(tsc_hz() * LAT_PIT_COUNT, PIT_HZ, 0);
+    lat_result_t pic, ioapic;
+    uint32_t pic_eoi, lapic_eoi;
+
+    uint32_t flags = irq_save();
+    isr_t saved = get_interrupt_handler(32);
+    register_interrupt_handler(32, lat_callback);
+
+    // Only the PIT may interrupt: the other pins and the local timer go
+    // quiet, and whatever they already raised is delivered by lat_measure
+    for (int irq = 0; irq < 16; irq++) ioapic_mask(irq, 1);
+    uint32_t lvt_timer = lapic_read(LAPIC_LVT_TIMER);
+    lapic_write(LAPIC_LVT_TIMER, lvt_timer | LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    irq_enable();
+    udelay(10);
+    irq_disable();
+
+    // 8259: IRQ0 reaches the CPU through LINT0 in virtual wire mode and
+    // the stub acknowledges at the 8259
+    lapic_eoi_reg = NULL;
+    outb(0x21, 0xFE);
+    lapic_write(LAPIC_LVT_LINT0, LVT_EXTINT);
+    lat_measure(expected, &pic);
+    outb(0x21, 0xFF);
+    lapic_write(LAPIC_LVT_LINT0, LVT_MASKED | LVT_EXTINT);
+    lapic_eoi_reg = &lapic[LAPIC_EOI / 4];
+
+    ioapic_mask(0, 0);
+    lat_measure(expected, &ioapic);
+
+    // With nothing in service both EOIs are no-ops, which is just the
+    // access cost
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 256; i++) outb(0x20, 0x20);
+    pic_eoi = (uint32_t)((rdtsc() - start) >> 8);
+    start = rdtsc();
+    for (int i = 0; i < 256; i++) *lapic_eoi_reg = 0;
+    lapic_eoi = (uint32_t)((rdtsc() - start) >> 8);
+
+    register_interrupt_handler(32, saved);
+    for (int irq = 1; irq < 16; irq++) ioapic_mask(irq, 0);
+    lapic_write(LAPIC_LVT_TIMER, lvt_timer);
+    irq_lines_rearm();
+    irq_restore(flags);
+
+    // The wheel's device was stopped or borrowed
+    if (timer_tickless()) timer_set_clockevent(timer_get_clockevent());
+
+    kprintf("PIT IRQ0 to handler, %d runs, past the programmed %u us:\n", LAT_RUNS,
+            LAT_PIT_COUNT * 1000000 / PIT_HZ);
+    lat_print("8259", &pic);
+    lat_print("I/O APIC", &ioapic);
+    kprintf("EOI: 8259 port write %u cycles (%u ns), local APIC MMIO write %u cycles (%u ns)\n",
+            pic_eoi, cycles_to_ns(pic_eoi), lapic_eoi, cycles_to_ns(lapic_eoi));
+}
@@ -0,0 +1,50 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+#include "kernel.h"
+#include "cpu.h"
+
+/* Local APIC and I/O APIC. The 8259s stay remapped to vectors 32-47 and
+   take over again whenever the APIC can't be used. */
+
+#define APIC_MAX_IOAPICS 4
+
+// Vectors owned by the local APIC, above the ISA range
+#define APIC_TIMER_VECTOR 48
+#define APIC_WAKE_VECTOR 49
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+// Set while the local APIC delivers the IRQs, NULL in 8259 mode. The IRQ
+// stub writes it to acknowledge.
+extern volatile uint32_t* lapic_eoi_reg;
+
+// Parses the MADT, masks the 8259s and routes the timer, keyboard and
+// serial IRQs through the I/O APIC, then moves the timer wheel onto the
+// local APIC timer. Needs acpi_init and timer_init.
+void apic_init(void);
+int apic_active(void);
+
+// Local APIC ids from the MADT, boot CPU first
+int apic_cpu_count(void);
+uint8_t apic_cpu_id(int index);
+
+// Enables the local APIC of an application processor, all LVTs masked
+void apic_init_ap(void);
+
+// INIT assert/deassert, then a STARTUP IPI that starts the target in real
+// mode at page << 12. Both wait until the local APIC has sent them.
+void apic_send_init(uint8_t apic_id);
+void apic_send_startup(uint8_t apic_id, uint8_t page);
+
+// Fixed IPI on `vector` to every CPU but this one
+void apic_send_ipi_others(uint8_t vector);
+
+/* Prints the controllers and the IRQ routing */
+void apic_dump(void);
+
+/* Fires the PIT through the 8259 and then the I/O APIC and compares how
+   long each takes to reach the handler, plus the cost of one EOI */
+void apic_latency(void);
+
+#endif
@@ -0,0 +1,601 @@
+#include "bench.h"
+#include "kernel.h"
+#include "cpu.h"
+#include "mm.h"
+#include "smp.h"
+#include "clock.h"
+#include "serial.h"
+
+/* --- HELPERS --- */
+
+#define BENCH_MAX_SIZE (1024 * 1024)
+#define BENCH_BYTES_PER_RUN (4 * 1024 * 1024)
+#define BENCH_RUNS 3
+
+static void print_padded(const char* s, size_t width) {
+    kprintf("%*s", (int)width, s);
+}
+
+static void print_dec_padded(uint32_t n, size_t width) {
+    kprintf("%*u", (int)width, n);
+}
+
+static void print_size_padded(uint32_t size, size_t width) {
+    char buf[12];
+    if (size >= 1024 * 1024) ksnprintf(buf, sizeof(buf), "%uM", size >> 20);
+    else if (size >= 1024) ksnprintf(buf, sizeof(buf), "%uK", size >> 10);
+    else ksnprintf(buf, sizeof(buf), "%uB", size);
+    print_padded(buf, width);
+}
+
+/* --- MEMORY --- */
+
+typedef void* (*copy_fn_t)(void*, const void*, size_t);
+typedef void* (*fill_fn_t)(void*, int, size_t);
+
+typedef struct {
+    const char* name;
+    copy_fn_t copy;
+    fill_fn_t fill;
+    int needs_sse2;
+} mem_variant_t;
+
+static const mem_variant_t mem_variants[] = {
+    {"bytes", memcpy_bytes, memset_bytes, 0},
+    {"movsd", memcpy_rep, memset_rep, 0},
+    {"erms", memcpy_erms, memset_erms, 0},
+    {"sse2nt", memcpy_sse2_nt, memset_sse2_nt, 1},
+};
+
+#define MEM_VARIANTS (sizeof(mem_variants) / sizeof(mem_variants[0]))
+
+// Best of BENCH_RUNS, in cycles per call
+static uint32_t time_variant(const mem_variant_t* v, int copy, uint8_t* dst, uint8_t* src, size_t size) {
+    uint32_t iters = BENCH_BYTES_PER_RUN / size;
+    if (iters > 4096) iters = 4096;
+    uint32_t best = 0xFFFFFFFF;
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        uint32_t start = (uint32_t)rdtsc();
+        for (uint32_t i = 0; i < iters; i++) {
+            if (copy) v->copy(dst, src, size);
+            else v->fill(dst, (int)i, size);
+        }
+        uint32_t cycles = ((uint32_t)rdtsc() - start) / iters;
+        if (cycles < best) best = cycles;
+    }
+    return best;
+}
+
+static void bench_mem_table(int copy, uint8_t* dst, uint8_t* src) {
+    terminal_write_color(copy ? "memcpy" : "memset", VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring(" (cycles per call)\n");
+
+    print_padded("size", 6);
+    for (size_t v = 0; v < MEM_VARIANTS; v++) print_padded(mem_variants[v].name, 10);
+    terminal_writestring("\n");
+
+    for (uint32_t size = 1; size <= BENCH_MAX_SIZE; size <<= 2) {
+        print_size_padded(size, 6);
+        for (size_t v = 0; v < MEM_VARIANTS; v++) {
+            if (mem_variants[v].needs_sse2 && !cpu_features.sse2) {
+                print_padded("-", 10);
+                continue;
+            }
+            print_dec_padded(time_variant(&mem_variants[v], copy, dst, src, size), 10);
+        }
+        terminal_writestring("\n");
+    }
+}
+
+void bench_mem(const char* which) {
+    if (!cpu_features.tsc) {
+        terminal_writestring("TSC not available.\n");
+        return;
+    }
+
+    uint8_t* src = kmalloc(BENCH_MAX_SIZE);
+    uint8_t* dst = kmalloc(BENCH_MAX_SIZE);
+    if (!src || !dst) {
+        terminal_writestring("Out of memory.\n");
+        kfree(src);
+        kfree(dst);
+        return;
+    }
+
+    // Fault in the demand-zero pages before timing anything
+    memset(src, 0x5A, BENCH_MAX_SIZE);
+    memset(dst, 0, BENCH_MAX_SIZE);
+
+    terminal_writestring("Active: ");
+    terminal_writestring(string_impl_name());
+    terminal_writestring("\n");
+
+    if (strcmp(which, "set") != 0) bench_mem_table(1, dst, src);
+    if (strcmp(which, "copy") != 0) bench_mem_table(0, dst, src);
+
+    kfree(src);
+    kfree(dst);
+}
+
+/* --- STRINGS --- */
+
+typedef struct {
+    const char* name;
+    size_t (*strlen)(const char*);
+    int (*strcmp)(const char*, const char*);
+    void* (*memchr)(const void*, int, size_t);
+    int (*memcmp)(const void*, const void*, size_t);
+    int needs_sse2;
+} str_variant_t;
+
+static const str_variant_t str_variants[] = {
+    {"bytes", strlen_bytes, strcmp_bytes, memchr_bytes, memcmp_bytes, 0},
+    {"word", strlen_word, strcmp_word, memchr_word, memcmp_word, 0},
+    {"sse2", strlen_sse2, strcmp_sse2, memchr_sse2, memcmp_sse2, 1},
+};
+
+#define STR_VARIANTS (sizeof(str_variants) / sizeof(str_variants[0]))
+
+// Typical shell input: command words and the prompt
+static const char* const str_tokens[] = {
+    "ls", "cat", "echo", "help", "clear", "meminfo", "membench", "codetease", "user@excien:~$ ",
+};
+
+#define STR_TOKENS (sizeof(str_tokens) / sizeof(str_tokens[0]))
+#define STR_LONG_SIZE (64 * 1024)
+
+enum { OP_STRLEN, OP_STRCMP, OP_MEMCHR, OP_MEMCMP };
+
+static const char* const str_op_names[] = { "strlen", "strcmp", "memchr", "memcmp" };
+
+static volatile uint32_t str_sink;
+
+static inline void str_run(const str_variant_t* v, int op, const char* a, const char* b, size_t len) {
+    switch (op) {
+        case OP_STRLEN: str_sink += v->strlen(a); break;
+        case OP_STRCMP: str_sink += v->strcmp(a, b); break;
+        case OP_MEMCHR: str_sink += (uint32_t)v->memchr(a, '~', len); break;
+        case OP_MEMCMP: str_sink += v->memcmp(a, b, len); break;
+    }
+}
+
+// Best of BENCH_RUNS, in cycles per call
+static uint32_t time_str_short(const str_variant_t* v, int op, char copies[][16]) {
+    uint32_t iters = 256;
+    uint32_t best = 0xFFFFFFFF;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        uint32_t start = (uint32_t)rdtsc();
+        for (uint32_t i = 0; i < iters; i++) {
+            for (size_t t = 0; t < STR_TOKENS; t++) {
+                str_run(v, op, str_tokens[t], copies[t], strlen_bytes(str_tokens[t]));
+            }
+        }
+        uint32_t cycles = ((uint32_t)rdtsc() - start) / (iters * STR_TOKENS);
+        if (cycles < best) best = cycles;
+    }
+    return best;
+}
+
+static uint32_t time_str_long(const str_variant_t* v, int op, const char* a, const char* b) {
+    uint32_t iters = 16;
+    uint32_t best = 0xFFFFFFFF;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        uint32_t start = (uint32_t)rdtsc();
+        for (uint32_t i = 0; i < iters; i++) {
+            str_run(v, op, a, b, STR_LONG_SIZE - 1);
+        }
+        uint32_t cycles = ((uint32_t)rdtsc() - start) / iters;
+        if (cycles < best) best = cycles;
+    }
+    return best;
+}
+
+void bench_str(void) {
+    if (!cpu_features.tsc) {
+        terminal_writestring("TSC not available.\n");
+        return;
+    }
+
+    // Long inputs stand in for module contents: 64 KiB of text, no '~'
+    char* a = kmalloc(STR_LONG_SIZE);
+    char* b = kmalloc(STR_LONG_SIZE);
+    if (!a || !b) {
+        terminal_writestring("Out of memory.\n");
+        kfree(a);
+        kfree(b);
+        return;
+    }
+    for (size_t i = 0; i < STR_LONG_SIZE - 1; i++) {
+        a[i] = 'a' + (i % 26);
+    }
+    a[STR_LONG_SIZE - 1] = 0;
+    memcpy(b, a, STR_LONG_SIZE);
+
+    // Separate copies so that comparisons run to the end
+    char copies[STR_TOKENS][16];
+    for (size_t t = 0; t < STR_TOKENS; t++) {
+        strcpy(copies[t], str_tokens[t]);
+    }
+
+    terminal_write_color("strings", VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring(" (cycles per call, short = shell tokens, long = 64 KiB)\n");
+    print_padded("op", 14);
+    for (size_t v = 0; v < STR_VARIANTS; v++) print_padded(str_variants[v].name, 10);
+    terminal_writestring("\n");
+
+    for (int op = OP_STRLEN; op <= OP_MEMCMP; op++) {
+        for (int is_long = 0; is_long < 2; is_long++) {
+            terminal_writestring(str_op_names[op]);
+            print_padded(is_long ? "long" : "short", 8);
+            for (size_t v = 0; v < STR_VARIANTS; v++) {
+                if (str_variants[v].needs_sse2 && !cpu_features.sse2) {
+                    print_padded("-", 10);
+                    continue;
+                }
+                uint32_t cycles = is_long ? time_str_long(&str_variants[v], op, a, b)
+                                          : time_str_short(&str_variants[v], op, copies);
+                print_dec_padded(cycles, 10);
+            }
+            terminal_writestring("\n");
+        }
+    }
+
+    kfree(a);
+    kfree(b);
+}
+
+/* --- SMP --- */
+
+#define SMP_ZERO_SIZE (8 * 1024 * 1024)
+
+static void print_speedup(uint64_t one, uint64_t all) {
+    uint32_t x100 = all ? (uint32_t)udiv64(one * 100, (uint32_t)(all > 0xFFFFFFFF ? 0xFFFFFFFF : all), 0) : 0;
+    kprintf("%10u %10u  %u.%02ux\n", (uint32_t)(one >> 10), (uint32_t)(all >> 10), x100 / 100, x100 % 100);
+}
+
+static void zero_pages(uint32_t start, uint32_t end, void* arg) {
+    memset((uint8_t*)arg + start * PAGE_SIZE, 0, (end - start) * PAGE_SIZE);
+}
+
+// Each page hashes on its own (FNV-1a) and the page hashes are folded in
+// order, so the result doesn't depend on how the pages were split up
+typedef struct {
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t* hashes;
+} page_hash_t;
+
+static void hash_pages(uint32_t start, uint32_t end, void* arg) {
+    page_hash_t* job = arg;
+    for (uint32_t page = start; page < end; page++) {
+        const uint8_t* p = job->data + page * PAGE_SIZE;
+        uint32_t n = job->size - page * PAGE_SIZE;
+        if (n > PAGE_SIZE) n = PAGE_SIZE;
+        uint32_t h = 2166136261u;
+        for (uint32_t i = 0; i < n; i++) {
+            h = (h ^ p[i]) * 16777619u;
+        }
+        job->hashes[page] = h;
+    }
+}
+
+static uint32_t hash_fold(const uint32_t* hashes, uint32_t pages) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < pages; i++) {
+        h = (h ^ hashes[i]) * 16777619u;
+    }
+    return h;
+}
+
+void bench_smp(void) {
+    if (!cpu_features.tsc) {
+        terminal_writestring("TSC not available.\n");
+        return;
+    }
+
+    kprintf("%d CPUs, Kcycles on 1 CPU vs all of them\n", smp_cpu_count());
+    print_padded("job", 24);
+    print_padded("1 CPU", 11);
+    print_padded("all", 11);
+    terminal_writestring("  speedup\n");
+
+    uint8_t* buf = kmalloc(SMP_ZERO_SIZE);
+    if (buf) {
+        // Demand-zero faults are not SMP safe, commit the pages first
+        memset(buf, 0xFF, SMP_ZERO_SIZE);
+        uint32_t pages = SMP_ZERO_SIZE / PAGE_SIZE;
+
+        uint64_t start = rdtsc();
+        zero_pages(0, pages, buf);
+        uint64_t one = rdtsc() - start;
+        memset(buf, 0xFF, SMP_ZERO_SIZE);
+        start = rdtsc();
+        parallel_for(pages, zero_pages, buf);
+        uint64_t all = rdtsc() - start;
+
+        kprintf("%-24s", "zero 8 MiB");
+        print_speedup(one, all);
+        kfree(buf);
+    } else {
+        terminal_writestring("Out of memory for the zeroing buffer.\n");
+    }
+
+    if (!mb_info || !(mb_info->flags & MULTIBOOT_FLAG_MODS) || mb_info->mods_count == 0) {
+        terminal_writestring("No modules to checksum.\n");
+        return;
+    }
+    multiboot_module_t* mods = (multiboot_module_t*)mb_info->mods_addr;
+    for (uint32_t m = 0; m < mb_info->mods_count; m++) {
+        page_hash_t job;
+        job.data = (const uint8_t*)mods[m].mod_start;
+        job.size = mods[m].mod_end - mods[m].mod_start;
+        uint32_t pages = (job.size + PAGE_SIZE - 1) / PAGE_SIZE;
+        job.hashes = kmalloc(pages * sizeof(uint32_t));
+        if (!job.hashes) {
+            terminal_writestring("Out of memory.\n");
+            return;
+        }
+        memset(job.hashes, 0, pages * sizeof(uint32_t));
+
+        uint64_t start = rdtsc();
+        hash_pages(0, pages, &job);
+        uint64_t one = rdtsc() - start;
+        uint32_t sum = hash_fold(job.hashes, pages);
+        start = rdtsc();
+        parallel_for(pages, hash_pages, &job);
+        uint64_t all = rdtsc() - start;
+        if (hash_fold(job.hashes, pages) != sum) {
+            terminal_write_color("checksum mismatch between runs\n", VGA_COLOR_LIGHT_RED);
+        }
+
+        char label[25];
+        const char* name = (const char*)mods[m].string;
+        ksnprintf(label, sizeof(label), "sum %.10s %08x", name ? name : "?", sum);
+        kprintf("%-24s", label);
+        print_speedup(one, all);
+        kfree(job.hashes);
+    }
+}
+
+/* --- INTERRUPT ENTRY --- */
+
+#define BENCH_LEGACY_VECTOR 0x81  // Pushed by isr_legacy_bench
+#define IRQ_BENCH_SAMPLES 256
+
+extern void isr_legacy_bench(void);
+
+static void irq_bench_handler(registers_t* regs) {
+    (void)regs;
+}
+
+static void sort_u32(uint32_t* a, int n) {
+    for (int i = 1; i < n; i++) {
+        uint32_t v = a[i];
+        int j = i - 1;
+        while (j >= 0 && a[j] > v) {
+            a[j + 1] = a[j];
+            j--;
+        }
+        a[j + 1] = v;
+    }
+}
+
+// Round trips of a software interrupt through the stub, isr_handler and
+// an empty handler, sorted
+static void time_int(int legacy, uint32_t* samples) {
+    for (int i = 0; i < IRQ_BENCH_SAMPLES; i++) {
+        uint32_t start = (uint32_t)rdtsc();
+        if (legacy) {
+            asm volatile ( "int $0x81" : : : "memory" );
+        } else {
+            asm volatile ( "int $3" : : : "memory" );
+        }
+        samples[i] = (uint32_t)rdtsc() - start;
+    }
+    sort_u32(samples, IRQ_BENCH_SAMPLES);
+}
+
+void bench_irq_entry(void) {
+    if (!cpu_features.tsc) {
+        terminal_writestring("TSC not available.\n");
+        return;
+    }
+
+    static uint32_t samples[2][IRQ_BENCH_SAMPLES];
+    isr_t saved = get_interrupt_handler(3);
+    register_interrupt_handler(3, irq_bench_handler);
+    register_interrupt_handler(BENCH_LEGACY_VECTOR, irq_bench_handler);
+    idt_set_gate(BENCH_LEGACY_VECTOR, (uint32_t)isr_legacy_bench, 0x08, 0x8E);
+
+    for (int legacy = 1; legacy >= 0; legacy--) {
+        time_int(legacy, samples[legacy]); // Warm up
+        time_int(legacy, samples[legacy]);
+    }
+
+    idt_set_gate(BENCH_LEGACY_VECTOR, 0, 0, 0);
+    register_interrupt_handler(BENCH_LEGACY_VECTOR, 0);
+    register_interrupt_handler(3, saved);
+
+    terminal_writestring("Interrupt entry + exit, cycles (int to iret, empty handler)\n");
+    terminal_writestring("path           min  median     p99\n");
+    const char* names[2] = {"streamlined", "old"};
+    for (int legacy = 1; legacy >= 0; legacy--) {
+        uint32_t* s = samples[legacy];
+        kprintf("%-11s %6u  %6u  %6u\n", names[legacy], s[0], s[IRQ_BENCH_SAMPLES / 2],
+                s[IRQ_BENCH_SAMPLES * 99 / 100]);
+    }
+    int32_t saved_cycles = (int32_t)(samples[1][IRQ_BENCH_SAMPLES / 2] - samples[0][IRQ_BENCH_SAMPLES / 2]);
+    kprintf("Saved per interrupt: %d cycles (median)\n", saved_cycles);
+}
+
+/* --- SUITE --- */
+
+#define SUITE_SAMPLES 256
+#define SUITE_MAX 24
+#define SUITE_COPY_MAX (64 * 1024)
+#define SUITE_STR_LONG 4096
+#define SUITE_BATCH 64
+#define SUITE_LINE 80  // One screen row
+
+typedef void (*suite_fn_t)(void);
+
+typedef struct {
+    const char* name;
+    uint32_t min;
+    uint32_t median;
+    uint32_t p99;
+} suite_result_t;
+
+static suite_result_t suite_results[SUITE_MAX];
+static int suite_count;
+static uint32_t suite_samples[SUITE_SAMPLES];
+
+static uint8_t* suite_src;
+static uint8_t* suite_dst;
+static char* suite_long[2];
+static char suite_token[2][16] = {"user@excien:~$ ", "user@excien:~$ "};
+static void* suite_ptrs[SUITE_BATCH];
+static uint32_t suite_sizes[SUITE_BATCH];
+static char suite_line[SUITE_LINE];
+
+// A warm-up call, then one sample per call. ops divides each sample when a
+// call covers several operations.
+static void suite_run(const char* name, suite_fn_t fn, uint32_t ops) {
+    fn();
+    for (int i = 0; i < SUITE_SAMPLES; i++) {
+        uint32_t start = (uint32_t)rdtsc();
+        fn();
+        suite_samples[i] = ((uint32_t)rdtsc() - start) / ops;
+    }
+    sort_u32(suite_samples, SUITE_SAMPLES);
+    if (suite_count == SUITE_MAX) return;
+    suite_result_t* r = &suite_results[suite_count++];
+    r->name = name;
+    r->min = suite_samples[0];
+    r->median = suite_samples[SUITE_SAMPLES / 2];
+    r->p99 = suite_samples[SUITE_SAMPLES * 99 / 100];
+}
+
+static void suite_kmalloc_32(void) { kfree(kmalloc(32)); }
+static void suite_kmalloc_1k(void) { kfree(kmalloc(1024)); }
+static void suite_kmalloc_8k(void) { kfree(kmalloc(8192)); }
+
+// Fill up, then free in allocation order: a slab page at a time
+static void suite_kmalloc_batch(void) {
+    for (int i = 0; i < SUITE_BATCH; i++) suite_ptrs[i] = kmalloc(64);
+    for (int i = 0; i < SUITE_BATCH; i++) kfree(suite_ptrs[i]);
+}
+
+// Sizes across every slab class and the heap, freed newest first
+static void suite_kmalloc_mixed(void) {
+    for (int i = 0; i < SUITE_BATCH; i++) suite_ptrs[i] = kmalloc(suite_sizes[i]);
+    for (int i = SUITE_BATCH - 1; i >= 0; i--) kfree(suite_ptrs[i]);
+}
+
+static void suite_memcpy_64(void) { memcpy(suite_dst, suite_src, 64); }
+static void suite_memcpy_4k(void) { memcpy(suite_dst, suite_src, 4096); }
+static void suite_memcpy_64k(void) { memcpy(suite_dst, suite_src, SUITE_COPY_MAX); }
+static void suite_memset_4k(void) { memset(suite_dst, 0, 4096); }
+static void suite_memset_64k(void) { memset(suite_dst, 0, SUITE_COPY_MAX); }
+
+static void suite_strlen_short(void) { str_sink += strlen(suite_token[0]); }
+static void suite_strlen_long(void) { str_sink += strlen(suite_long[0]); }
+static void suite_strcmp_short(void) { str_sink += strcmp(suite_token[0], suite_token[1]); }
+static void suite_strcmp_long(void) { str_sink += strcmp(suite_long[0], suite_long[1]); }
+
+// A full line each, so both include one scroll
+static void suite_putchar_line(void) {
+    for (size_t i = 0; i < sizeof(suite_line); i++) terminal_putchar(suite_line[i]);
+}
+
+static void suite_write_line(void) { terminal_write(suite_line, sizeof(suite_line)); }
+
+static void suite_scroll(void) {
+    terminal_scroll();
+    terminal_flush();
+}
+
+static void suite_int3(void) { asm volatile ( "int $3" : : : "memory" ); }
+
+int bench_suite(void) {
+    if (!cpu_features.tsc) {
+        terminal_writestring("TSC not available.\n");
+        return -1;
+    }
+    int status = -1;
+
+    suite_src = kmalloc(SUITE_COPY_MAX);
+    suite_dst = kmalloc(SUITE_COPY_MAX);
+    suite_long[0] = kmalloc(SUITE_STR_LONG);
+    suite_long[1] = kmalloc(SUITE_STR_LONG);
+    if (!suite_src || !suite_dst || !suite_long[0] || !suite_long[1]) {
+        terminal_writestring("Out of memory.\n");
+        goto out;
+    }
+    memset(suite_src, 0x5A, SUITE_COPY_MAX);
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < SUITE_STR_LONG - 1; i++) suite_long[s][i] = 'a' + i % 26;
+        suite_long[s][SUITE_STR_LONG - 1] = 0;
+    }
+    // A fixed sequence, so every run allocates the same sizes
+    uint32_t seed = 12345;
+    for (int i = 0; i < SUITE_BATCH; i++) {
+        seed = seed * 1103515245 + 12345;
+        suite_sizes[i] = 16 + (seed >> 16) % 4080;
+    }
+    for (size_t i = 0; i < sizeof(suite_line) - 1; i++) suite_line[i] = '0' + i % 10;
+    suite_line[sizeof(suite_line) - 1] = '\n';
+
+    suite_count = 0;
+    suite_run("kmalloc+kfree 32B", suite_kmalloc_32, 1);
+    suite_run("kmalloc+kfree 1K", suite_kmalloc_1k, 1);
+    suite_run("kmalloc+kfree 8K (heap)", suite_kmalloc_8k, 1);
+    suite_run("kmalloc 64x64B, kfree (per op)", suite_kmalloc_batch, 2 * SUITE_BATCH);
+    suite_run("kmalloc mixed, kfree (per op)", suite_kmalloc_mixed, 2 * SUITE_BATCH);
+    suite_run("memcpy 64B", suite_memcpy_64, 1);
+    suite_run("memcpy 4K", suite_memcpy_4k, 1);
+    suite_run("memcpy 64K", suite_memcpy_64k, 1);
+    suite_run("memset 4K", suite_memset_4k, 1);
+    suite_run("memset 64K", suite_memset_64k, 1);
+    suite_run("strlen 15B", suite_strlen_short, 1);
+    suite_run("strlen 4K", suite_strlen_long, 1);
+    suite_run("strcmp 15B equal", suite_strcmp_short, 1);
+    suite_run("strcmp 4K equal", suite_strcmp_long, 1);
+
+    // The screen fills with test lines, kept off the serial console
+    int mirror = terminal_set_mirror(0);
+    suite_run("terminal_putchar x80 (line)", suite_putchar_line, 1);
+    suite_run("terminal_write 80B (line)", suite_write_line, 1);
+    suite_run("scroll + flush", suite_scroll, 1);
+    terminal_initialize();
+    terminal_set_mirror(mirror);
+
+    isr_t saved = get_interrupt_handler(3);
+    register_interrupt_handler(3, irq_bench_handler);
+    suite_run("interrupt round trip (int3)", suite_int3, 1);
+    register_interrupt_handler(3, saved);
+
+    kprintf("Benchmark suite: cycles per operation, %d samples, TSC %u MHz\n", SUITE_SAMPLES,
+            (uint32_t)udiv64(tsc_hz(), 1000000, 0));
+    terminal_writestring("benchmark                           min   median      p99\n");
+    for (int i = 0; i < suite_count; i++) {
+        suite_result_t* r = &suite_results[i];
+        kprintf("%-32s %7u  %7u  %7u\n", r->name, r->min, r->median, r->p99);
+    }
+    status = 0;
+
+out:
+    kfree(suite_src);
+    kfree(suite_dst);
+    kfree(suite_long[0]);
+    kfree(suite_long[1]);
+    return status;
+}
+
+// Writing v to the isa-debug-exit port makes QEMU exit with (v << 1) | 1.
+// Without the device the write goes nowhere and this returns.
+void bench_exit(uint8_t code) {
+    serial_flush();
+    outb(BENCH_EXIT_PORT, code);
+}
@@ -0,0 +1,31 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+/* memcpy/memset variants across sizes. which: "copy", "set" or "" for both */
+void bench_mem(const char* which);
+
+/* strlen/strcmp/memchr/memcmp variants on shell tokens and long buffers */
+void bench_str(void);
+
+/* Page zeroing and module checksums on one CPU, then through parallel_for */
+void bench_smp(void);
+
+/* One software interrupt through the old entry stub vs the current one */
+void bench_irq_entry(void);
+
+/* Min/median/p99 cycles of the hot paths: the allocator, memcpy/memset,
+   strlen/strcmp, terminal output and an interrupt round trip. Same
+   workload every run, so results can be compared across builds. -1 when
+   it could not run. */
+int bench_suite(void);
+
+// QEMU's isa-debug-exit device, as `make bench` sets it up
+#define BENCH_EXIT_PORT 0xF4
+
+// Flushes the serial port and quits QEMU; returns if not running in it
+void bench_exit(uint8_t code);
+
+#endif
@@ -21,6 +21,7 @@
 .align 16
 stack_bottom:
 .skip 16384 /* 16 KiB Stack size */
+.global stack_top
 stack_top:
 
 /* Assembly code execution starts here */
@@ -66,115 +67,137 @@ idt_load:
     lidt (%eax)
     ret
 
+/* --- Threads --- */
+
+/* switch_context(uint32_t* old_esp, uint32_t new_esp): saves the
+   callee-saved registers on this stack and resumes the other one. Always
+   called with interrupts off, so EFLAGS needs no saving. */
+.global switch_context
+.type switch_context, @function
+switch_context:
+    mov 4(%esp), %eax
+    mov 8(%esp), %edx
+    push %ebp
+    push %ebx
+    push %esi
+    push %edi
+    mov %esp, (%eax)
+    mov %edx, %esp
+    pop %edi
+    pop %esi
+    pop %ebx
+    pop %ebp
+    ret
+
 /* --- ISR & IRQ Helpers --- */
 
-/* Macro for ISR without error code */
-.macro ISR_NOERRCODE num
-    .global isr\num
-    .type isr\num, @function
-    isr\num:
-        cli
-        push $0
-        push $\num
-        jmp isr_common_stub
-.endm
+/* Every stub also appends its address to interrupt_stubs, so the table is
+   indexed by vector and isr_install/irq_install just walk it. The CPU
+   pushes an error code for 8, 10-14 and 17; the other stubs push a dummy
+   so every frame looks the same. Interrupt gates already clear IF. */
 
-/* Macro for ISR with error code */
-.macro ISR_ERRCODE num
+.pushsection .rodata
+.align 4
+.global interrupt_stubs
+interrupt_stubs:
+.popsection
+
+.macro ISR num
     .global isr\num
     .type isr\num, @function
     isr\num:
-        cli
+    .if (\num != 8) && (\num < 10 || \num > 14) && (\num != 17)
+        push $0
+    .endif
         push $\num
         jmp isr_common_stub
+    .pushsection .rodata
+        .long isr\num
+    .popsection
 .endm
 
-/* Macro for IRQ */
-.macro IRQ num, map_num
+.macro IRQ num
     .global irq\num
     .type irq\num, @function
     irq\num:
-        cli
         push $0
-        push $\map_num
+        push $(32 + \num)
         jmp irq_common_stub
+    .pushsection .rodata
+        .long irq\num
+    .popsection
 .endm
 
-ISR_NOERRCODE 0
-ISR_NOERRCODE 1
-ISR_NOERRCODE 2
-ISR_NOERRCODE 3
-ISR_NOERRCODE 4
-ISR_NOERRCODE 5
-ISR_NOERRCODE 6
-ISR_NOERRCODE 7
-ISR_ERRCODE   8
-ISR_NOERRCODE 9
-ISR_ERRCODE   10
-ISR_ERRCODE   11
-ISR_ERRCODE   12
-ISR_ERRCODE   13
-ISR_ERRCODE   14
-ISR_NOERRCODE 15
-ISR_NOERRCODE 16
-ISR_ERRCODE   17
-ISR_NOERRCODE 18
-ISR_NOERRCODE 19
-ISR_NOERRCODE 20
-ISR_NOERRCODE 21
-ISR_NOERRCODE 22
-ISR_NOERRCODE 23
-ISR_NOERRCODE 24
-ISR_NOERRCODE 25
-ISR_NOERRCODE 26
-ISR_NOERRCODE 27
-ISR_NOERRCODE 28
-ISR_NOERRCODE 29
-ISR_NOERRCODE 30
-ISR_NOERRCODE 31
-
-IRQ 0, 32
-IRQ 1, 33
-IRQ 2, 34
-IRQ 3, 35
-IRQ 4, 36
-IRQ 5, 37
-IRQ 6, 38
-IRQ 7, 39
-IRQ 8, 40
-IRQ 9, 41
-IRQ 10, 42
-IRQ 11, 43
-IRQ 12, 44
-IRQ 13, 45
-IRQ 14, 46
-IRQ 15, 47
-
-/* Common ISR Stub */
-.extern isr_handler
-isr_common_stub:
+/* Exceptions 0-31 */
+.irp num, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31
+    ISR \num
+.endr
+
+/* ISA IRQs on 32-47, then 48 for the local APIC timer and 49 for the
+   wakeup IPI between CPUs */
+.irp num, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17
+    IRQ \num
+.endr
+
+.pushsection .rodata
+.global interrupt_stubs_end
+interrupt_stubs_end:
+.popsection
+
+/* Local APIC spurious vector: nothing to acknowledge, only counted */
+.global irq_spurious
+.type irq_spurious, @function
+irq_spurious:
+    lock incl apic_spurious_count
+    iret
+
+/* Common stubs: the C handler gets a pointer to the frame. %gs is left
+   alone, it holds the per-CPU selector. Everything runs in ring 0, so the
+   data segments are nearly always the kernel's already and only reloaded
+   when %ds says otherwise (%es and %fs are never set apart from it). */
+
+.macro COMMON_STUB name, handler
+\name:
     pusha
     mov %ds, %ax
     push %eax
+    cmp $0x10, %ax
+    je 1f
     mov $0x10, %ax
     mov %ax, %ds
     mov %ax, %es
     mov %ax, %fs
-    mov %ax, %gs
-    call isr_handler
+1:  cld
+    push %esp
+    call \handler
+    add $4, %esp
     pop %eax
+    cmp $0x10, %ax
+    je 2f
     mov %ax, %ds
     mov %ax, %es
     mov %ax, %fs
-    mov %ax, %gs
-    popa
+2:  popa
     add $8, %esp
-    sti
     iret
+.endm
 
-/* Common IRQ Stub */
+.extern isr_handler
 .extern irq_handler
-irq_common_stub:
+COMMON_STUB isr_common_stub, isr_handler
+COMMON_STUB irq_common_stub, irq_handler
+
+/* --- Benchmark --- */
+
+/* The entry path as it used to be, kept so bench_irq_entry can compare:
+   cli/sti and all three data segments reloaded both ways. It reports
+   vector 0x81, BENCH_LEGACY_VECTOR in bench.c. */
+.global isr_legacy_bench
+.type isr_legacy_bench, @function
+isr_legacy_bench:
+    cli
+    push $0
+    push $0x81
     pusha
     mov %ds, %ax
     push %eax
@@ -182,16 +205,19 @@ irq_common_stub:
     mov %ax, %ds
     mov %ax, %es
     mov %ax, %fs
-    mov %ax, %gs
-    call irq_handler
+    cld
+    push %esp
+    call isr_handler
+    add $4, %esp
     pop %eax
     mov %ax, %ds
     mov %ax, %es
     mov %ax, %fs
-    mov %ax, %gs
     popa
     add $8, %esp
     sti
     iret
 
 .size _start, . - _start
+
+.section .note.GNU-stack,"",@progbits
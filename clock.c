@@ -0,0 +1,295 @@
+#include "clock.h"
+#include "acpi.h"
+#include "paging.h"
+#include "mm.h"
+#include "cpu.h"
+#include "klog.h"
+#include "kernel.h"
+
+/* --- HELPERS --- */
+
+// Shift-subtract division, only used when a source is registered
+static uint64_t div64(uint64_t n, uint64_t d) {
+    uint64_t q = 0, r = 0;
+    for (int i = 63; i >= 0; i--) {
+        r = (r << 1) | ((n >> i) & 1);
+        if (r >= d) {
+            r -= d;
+            q |= 1ULL << i;
+        }
+    }
+    return q;
+}
+
+// Largest shift that keeps mult in 32 bits, for the most precision
+static void clocksource_set_scale(clocksource_t* cs) {
+    for (uint32_t shift = 32; shift > 0; shift--) {
+        uint64_t mult = div64(1000000000ULL << shift, cs->freq_hz);
+        if (mult <= 0xFFFFFFFF) {
+            cs->mult = (uint32_t)mult;
+            cs->shift = shift;
+            return;
+        }
+    }
+}
+
+static uint64_t cyc2ns(const clocksource_t* cs, uint64_t cycles) {
+    return mul_u64_u32_shr(cycles, cs->mult, cs->shift);
+}
+
+/* --- TSC --- */
+
+static uint64_t tsc_freq = 0;
+
+static uint64_t tsc_read(void) {
+    return rdtsc();
+}
+
+#define PIT_HZ 1193182
+#define CALIBRATE_MS 10
+#define CALIBRATE_RUNS 3
+
+// Counts TSC cycles while PIT channel 2 counts down CALIBRATE_MS in
+// mode 0. Its output shows up in bit 5 of port 0x61 when it reaches zero.
+static uint64_t tsc_calibrate_once(void) {
+    uint16_t count = PIT_HZ * CALIBRATE_MS / 1000;
+
+    uint8_t port61 = inb(0x61);
+    outb(0x61, (port61 & ~0x02) | 0x01); // Speaker off, gate on
+    outb(0x43, 0xB0);                    // Channel 2, lobyte/hibyte, mode 0
+    outb(0x42, count & 0xFF);
+    outb(0x42, count >> 8);
+
+    uint64_t start = rdtsc();
+    while (!(inb(0x61) & 0x20));
+    uint64_t cycles = rdtsc() - start;
+
+    outb(0x61, port61);
+    return cycles;
+}
+
+static void tsc_calibrate(void) {
+    uint32_t flags = irq_save();
+    uint64_t best = ~0ULL;
+    for (int i = 0; i < CALIBRATE_RUNS; i++) {
+        uint64_t cycles = tsc_calibrate_once();
+        if (cycles < best) best = cycles; // SMIs only ever make a run longer
+    }
+    irq_restore(flags);
+    tsc_freq = udiv64(best * PIT_HZ, PIT_HZ * CALIBRATE_MS / 1000, 0);
+}
+
+uint64_t tsc_hz(void) {
+    return tsc_freq;
+}
+
+uint32_t percent_scaled(uint64_t part, uint64_t whole, uint32_t scale) {
+    while (whole >> 32) {
+        whole >>= 1;
+        part >>= 1;
+    }
+    return whole ? (uint32_t)udiv64(part * scale, (uint32_t)whole, 0) : 0;
+}
+
+uint64_t cycles_to_us(uint64_t cycles) {
+    uint32_t khz = tsc_khz();
+    return khz ? udiv64(cycles * 1000, khz, 0) : 0;
+}
+
+/* --- HPET --- */
+
+#define HPET_CAPS    0x000
+#define HPET_CONFIG  0x010
+#define HPET_COUNTER 0x0F0
+
+static volatile uint32_t* hpet_regs = NULL;
+
+// The low half of the main counter is enough, and one MMIO read instead of
+// the hi/lo/hi dance a 64-bit read needs on a 32-bit CPU
+static uint64_t hpet_read(void) {
+    return hpet_regs[HPET_COUNTER / 4];
+}
+
+static int hpet_probe(clocksource_t* cs) {
+    const acpi_hpet_t* table = (const acpi_hpet_t*)acpi_find_table("HPET");
+    if (!table || table->base.space_id != 0 || (table->base.address >> 32)) return 0;
+
+    uint32_t base = (uint32_t)table->base.address;
+    paging_identity_map(base, base + PAGE_SIZE, PAGE_WRITE | PAGE_PCD);
+    hpet_regs = (volatile uint32_t*)base;
+
+    uint32_t period_fs = hpet_regs[HPET_CAPS / 4 + 1];
+    if (period_fs == 0 || period_fs > 100000000) return 0; // Spec caps it at 100 ns
+
+    hpet_regs[HPET_CONFIG / 4] |= 1; // ENABLE_CNF
+
+    cs->name = "hpet";
+    cs->read = hpet_read;
+    cs->mask = 0xFFFFFFFF;
+    cs->freq_hz = div64(1000000000000000ULL, period_fs);
+    cs->rating = 250;
+    return 1;
+}
+
+/* --- ACPI PM TIMER --- */
+
+#define PM_TIMER_HZ 3579545
+
+static uint16_t pm_port = 0;
+
+static uint64_t pm_read(void) {
+    return inl(pm_port);
+}
+
+static int pm_probe(clocksource_t* cs) {
+    const acpi_fadt_t* fadt = (const acpi_fadt_t*)acpi_find_table("FACP");
+    if (!fadt || fadt->header.length < sizeof(acpi_fadt_t) || !fadt->pm_tmr_blk || fadt->pm_tmr_len != 4) {
+        return 0;
+    }
+    pm_port = fadt->pm_tmr_blk;
+
+    cs->name = "acpi_pm";
+    cs->read = pm_read;
+    cs->mask = (fadt->flags & ACPI_FADT_TMR_VAL_EXT) ? 0xFFFFFFFF : 0xFFFFFF;
+    cs->freq_hz = PM_TIMER_HZ;
+    cs->rating = 200;
+    return 1;
+}
+
+/* --- FRAMEWORK --- */
+
+static clocksource_t sources[CLOCK_MAX_SOURCES];
+static int source_count = 0;
+
+// Timekeeping state, written only with interrupts off and read under
+// the sequence count. cycle_last extends narrow counters to 64 bits.
+static volatile uint32_t seq = 0;
+static const clocksource_t* current = NULL;
+static uint64_t cycle_last = 0;  // Extended counter value at the last update
+static uint64_t cycle_base = 0;  // Extended counter value at ns_base
+static uint64_t ns_base = 0;
+
+static inline uint64_t clocksource_extend(const clocksource_t* cs, uint64_t last) {
+    return last + ((cs->read() - last) & cs->mask);
+}
+
+static void clocksource_measure(clocksource_t* cs) {
+    if (!tsc_freq) return;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < 256; i++) cs->read();
+    cs->read_cycles = (uint32_t)((rdtsc() - start) >> 8);
+}
+
+static void clocksource_register(clocksource_t* cs) {
+    clocksource_set_scale(cs);
+    clocksource_measure(cs);
+    source_count++;
+    klog(KLOG_INFO, "clock: %s at %u Hz, %u cycles per read", cs->name,
+         (uint32_t)cs->freq_hz, cs->read_cycles);
+}
+
+void clock_init(void) {
+    if (cpu_features.tsc) {
+        tsc_calibrate();
+        clocksource_t* cs = &sources[source_count];
+        cs->name = "tsc";
+        cs->read = tsc_read;
+        cs->mask = ~0ULL;
+        cs->freq_hz = tsc_freq;
+        cs->rating = 300;
+        clocksource_register(cs);
+        if (!cpu_features.invariant_tsc) {
+            klog(KLOG_WARN, "clock: TSC is not invariant");
+        }
+    }
+    if (hpet_probe(&sources[source_count])) clocksource_register(&sources[source_count]);
+    if (pm_probe(&sources[source_count])) clocksource_register(&sources[source_count]);
+
+    const clocksource_t* best = NULL;
+    for (int i = 0; i < source_count; i++) {
+        if (!best || sources[i].rating > best->rating) best = &sources[i];
+    }
+    if (best) {
+        clocksource_select(best->name);
+    } else {
+        klog(KLOG_ERR, "clock: no clocksource, ktime stays at 0");
+    }
+}
+
+uint64_t ktime_get_ns(void) {
+    uint32_t s;
+    uint64_t ns;
+    do {
+        s = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+        const clocksource_t* cs = current;
+        if (!cs) return 0;
+        uint64_t now = clocksource_extend(cs, cycle_last);
+        ns = ns_base + cyc2ns(cs, now - cycle_base);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((s & 1) || s != __atomic_load_n(&seq, __ATOMIC_RELAXED));
+    return ns;
+}
+
+void clock_tick(void) {
+    const clocksource_t* cs = current;
+    if (!cs || cs->mask == ~0ULL) return;
+
+    uint32_t flags = irq_save();
+    seq++;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    cycle_last = clocksource_extend(cs, cycle_last);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    seq++;
+    irq_restore(flags);
+}
+
+uint64_t clock_max_idle_ns(void) {
+    const clocksource_t* cs = current;
+    if (!cs || cs->mask == ~0ULL) return ~0ULL;
+    return cyc2ns(cs, cs->mask >> 1); // Half a wrap
+}
+
+int clocksource_select(const char* name) {
+    for (int i = 0; i < source_count; i++) {
+        if (strcmp(sources[i].name, name) != 0) continue;
+
+        // Keep time continuous across the switch
+        uint64_t now_ns = ktime_get_ns();
+        uint32_t flags = irq_save();
+        seq++;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        ns_base = now_ns;
+        cycle_last = sources[i].read();
+        cycle_base = cycle_last;
+        current = &sources[i];
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        seq++;
+        irq_restore(flags);
+        klog(KLOG_INFO, "clock: using %s", name);
+        return 0;
+    }
+    return -1;
+}
+
+const clocksource_t* clocksource_current(void) {
+    return current;
+}
+
+int clocksource_count(void) {
+    return source_count;
+}
+
+const clocksource_t* clocksource_get(int index) {
+    return (index >= 0 && index < source_count) ? &sources[index] : NULL;
+}
+
+void udelay(uint32_t us) {
+    if (!current) {
+        for (volatile uint32_t i = 0; i < us * 1000; i++);
+        return;
+    }
+    uint64_t end = ktime_get_ns() + (uint64_t)us * 1000;
+    while (ktime_get_ns() < end) {
+        asm volatile ( "pause" );
+    }
+}
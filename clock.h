@@ -0,0 +1,63 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+/* Clocksources: free running counters turned into nanoseconds since boot */
+
+typedef struct {
+    const char* name;
+    uint64_t (*read)(void);
+    uint64_t mask;          // Counter width
+    uint64_t freq_hz;
+    int rating;             // Highest rated source is picked at boot
+    uint32_t mult;          // ns = (cycles * mult) >> shift
+    uint32_t shift;
+    uint32_t read_cycles;   // Measured cost of one read, in TSC cycles
+} clocksource_t;
+
+#define CLOCK_MAX_SOURCES 4
+
+// Calibrates the TSC against PIT channel 2 and probes the HPET and ACPI
+// PM timer. Needs acpi_init.
+void clock_init(void);
+
+// Nanoseconds since clock_init, 0 before
+uint64_t ktime_get_ns(void);
+
+// Called from the timer interrupt so counters narrower than 64 bits are
+// seen at least once per wrap
+void clock_tick(void);
+
+// Longest time clock_tick may be left out, ~0 for 64-bit counters
+uint64_t clock_max_idle_ns(void);
+
+int clocksource_select(const char* name);
+const clocksource_t* clocksource_current(void);
+int clocksource_count(void);
+const clocksource_t* clocksource_get(int index);
+
+// TSC frequency from the boot calibration, 0 if there is no TSC
+uint64_t tsc_hz(void);
+
+// The same in kHz, what cycle counts are divided by to get ms or us
+static inline uint32_t tsc_khz(void) {
+    return (uint32_t)udiv64(tsc_hz(), 1000, 0);
+}
+
+// part as a share of whole, times scale (100 for a percentage). Both are
+// scaled down together until whole fits the 32-bit divide.
+uint32_t percent_scaled(uint64_t part, uint64_t whole, uint32_t scale);
+
+static inline uint32_t percent(uint64_t part, uint64_t whole) {
+    return percent_scaled(part, whole, 100);
+}
+
+// TSC cycles to microseconds, 0 without a calibrated TSC
+uint64_t cycles_to_us(uint64_t cycles);
+
+// Busy waits on the current clocksource
+void udelay(uint32_t us);
+
+#endif
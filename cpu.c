@@ -1,5 +1,50 @@
 #include "cpu.h"
 #include "kernel.h"
+#include "clock.h"
+#include "timer.h"
+#include "apic.h"
+#include "thread.h"
+#include "softirq.h"
+#include "irqsoff.h"
+
+/* --- CPU FEATURES --- */
+
+cpu_features_t cpu_features;
+
+void cpu_detect_features(void) {
+    uint32_t max_leaf, a, b, c, d;
+    cpuid(0, &max_leaf, &b, &c, &d);
+
+    cpuid(1, &a, &b, &c, &d);
+    cpu_features.pse = (d >> 3) & 1;
+    cpu_features.tsc = (d >> 4) & 1;
+    cpu_features.apic = (d >> 9) & 1;
+    cpu_features.sse2 = ((d >> 24) & 1) && ((d >> 25) & 1) && ((d >> 26) & 1); // FXSR, SSE, SSE2
+
+    if (max_leaf >= 7) {
+        cpuid(7, &a, &b, &c, &d);
+        cpu_features.erms = (b >> 9) & 1;
+    }
+
+    uint32_t max_ext;
+    cpuid(0x80000000, &max_ext, &b, &c, &d);
+    if (max_ext >= 0x80000007) {
+        cpuid(0x80000007, &a, &b, &c, &d);
+        cpu_features.invariant_tsc = (d >> 8) & 1;
+    }
+
+    // SSE instructions fault until the OS says it saves their state
+    if (cpu_features.sse2) {
+        uint32_t cr0, cr4;
+        asm volatile ( "mov %%cr0, %0" : "=r"(cr0) );
+        cr0 &= ~(1 << 2); // EM
+        cr0 |= (1 << 1);  // MP
+        asm volatile ( "mov %0, %%cr0" : : "r"(cr0) );
+        asm volatile ( "mov %%cr4, %0" : "=r"(cr4) );
+        cr4 |= (1 << 9) | (1 << 10); // OSFXSR, OSXMMEXCPT
+        asm volatile ( "mov %0, %%cr4" : : "r"(cr4) );
+    }
+}
 
 /* --- GDT --- */
 
@@ -17,31 +62,64 @@ struct gdt_ptr_struct {
     uint32_t base;
 } __attribute__((packed));
 
-struct gdt_entry_struct gdt[3];
-struct gdt_ptr_struct gp;
+struct tss_struct {
+    uint32_t prev_tss;
+    uint32_t esp0;
+    uint32_t ss0;
+    uint32_t unused[22];  // Ring 1/2 stacks and the saved task state
+    uint16_t trap;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+// Null, code, data, per-CPU data, TSS
+#define GDT_ENTRIES 5
+
+static struct gdt_entry_struct gdt[MAX_CPUS][GDT_ENTRIES];
+static struct gdt_ptr_struct gp[MAX_CPUS];
+static struct tss_struct tss[MAX_CPUS];
+percpu_t percpu[MAX_CPUS];
 
 extern void gdt_flush(uint32_t);
 
-void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
-    gdt[num].base_low = (base & 0xFFFF);
-    gdt[num].base_middle = (base >> 16) & 0xFF;
-    gdt[num].base_high = (base >> 24) & 0xFF;
+static void gdt_set_gate(struct gdt_entry_struct* table, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+    table[num].base_low = (base & 0xFFFF);
+    table[num].base_middle = (base >> 16) & 0xFF;
+    table[num].base_high = (base >> 24) & 0xFF;
 
-    gdt[num].limit_low = (limit & 0xFFFF);
-    gdt[num].granularity = ((limit >> 16) & 0x0F);
-    gdt[num].granularity |= (gran & 0xF0);
-    gdt[num].access = access;
+    table[num].limit_low = (limit & 0xFFFF);
+    table[num].granularity = ((limit >> 16) & 0x0F);
+    table[num].granularity |= (gran & 0xF0);
+    table[num].access = access;
 }
 
-void gdt_install() {
-    gp.limit = (sizeof(struct gdt_entry_struct) * 3) - 1;
-    gp.base = (uint32_t)&gdt;
-
-    gdt_set_gate(0, 0, 0, 0, 0); // Null descriptor
-    gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF); // Code Segment
-    gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data Segment
+// Only ring 0 runs, so the TSS just names the stack an inter-privilege
+// interrupt would switch to
+static void gdt_install_cpu(uint32_t index, uint32_t stack_top) {
+    struct gdt_entry_struct* table = gdt[index];
+    percpu_t* self = &percpu[index];
+    self->self = self;
+    self->index = index;
+
+    tss[index].ss0 = 0x10;
+    tss[index].esp0 = stack_top;
+    tss[index].iomap_base = sizeof(struct tss_struct);
+
+    gdt_set_gate(table, 0, 0, 0, 0, 0); // Null descriptor
+    gdt_set_gate(table, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF); // Code Segment
+    gdt_set_gate(table, 2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data Segment
+    gdt_set_gate(table, 3, (uint32_t)self, sizeof(percpu_t) - 1, 0x92, 0x40); // Per-CPU data
+    gdt_set_gate(table, 4, (uint32_t)&tss[index], sizeof(struct tss_struct) - 1, 0x89, 0x00); // TSS
+
+    gp[index].limit = sizeof(gdt[index]) - 1;
+    gp[index].base = (uint32_t)table;
+    gdt_flush((uint32_t)&gp[index]);
+    asm volatile ( "mov %0, %%gs" : : "r"(GDT_PERCPU_SEL) );
+    asm volatile ( "ltr %w0" : : "r"(GDT_TSS_SEL) );
+}
 
-    gdt_flush((uint32_t)&gp);
+void gdt_install() {
+    extern uint8_t stack_top[];
+    gdt_install_cpu(0, (uint32_t)stack_top);
 }
 
 /* --- IDT --- */
@@ -82,63 +160,42 @@ void idt_install() {
     idt_load((uint32_t)&idtp);
 }
 
+void cpu_init_ap(uint32_t index, uint32_t stack_top) {
+    gdt_install_cpu(index, stack_top);
+    idt_load((uint32_t)&idtp);
+}
+
 /* --- ISRs & IRQs --- */
 
-// ISRs
-extern void isr0(); extern void isr1(); extern void isr2(); extern void isr3();
-extern void isr4(); extern void isr5(); extern void isr6(); extern void isr7();
-extern void isr8(); extern void isr9(); extern void isr10(); extern void isr11();
-extern void isr12(); extern void isr13(); extern void isr14(); extern void isr15();
-extern void isr16(); extern void isr17(); extern void isr18(); extern void isr19();
-extern void isr20(); extern void isr21(); extern void isr22(); extern void isr23();
-extern void isr24(); extern void isr25(); extern void isr26(); extern void isr27();
-extern void isr28(); extern void isr29(); extern void isr30(); extern void isr31();
-
-// IRQs
-extern void irq0(); extern void irq1(); extern void irq2(); extern void irq3();
-extern void irq4(); extern void irq5(); extern void irq6(); extern void irq7();
-extern void irq8(); extern void irq9(); extern void irq10(); extern void irq11();
-extern void irq12(); extern void irq13(); extern void irq14(); extern void irq15();
+// Entry stubs from boot.s indexed by vector: the exceptions, the ISA IRQs
+// and the two local APIC vectors
+extern const uint32_t interrupt_stubs[];
+extern const uint32_t interrupt_stubs_end[];
+extern void irq_spurious();
 
 isr_t interrupt_handlers[256];
+irq_stat_t irq_stats[256];
+volatile uint32_t apic_spurious_count = 0;
+
+static inline void irq_account(uint8_t vector, uint32_t cycles) {
+    irq_stat_t* st = &irq_stats[vector];
+    st->count++;
+    st->cycles += cycles;
+    if (cycles > st->max_cycles) st->max_cycles = cycles;
+}
 
 void register_interrupt_handler(uint8_t n, isr_t handler) {
     interrupt_handlers[n] = handler;
 }
 
+isr_t get_interrupt_handler(uint8_t n) {
+    return interrupt_handlers[n];
+}
+
 void isr_install() {
-    idt_set_gate(0, (uint32_t)isr0, 0x08, 0x8E);
-    idt_set_gate(1, (uint32_t)isr1, 0x08, 0x8E);
-    idt_set_gate(2, (uint32_t)isr2, 0x08, 0x8E);
-    idt_set_gate(3, (uint32_t)isr3, 0x08, 0x8E);
-    idt_set_gate(4, (uint32_t)isr4, 0x08, 0x8E);
-    idt_set_gate(5, (uint32_t)isr5, 0x08, 0x8E);
-    idt_set_gate(6, (uint32_t)isr6, 0x08, 0x8E);
-    idt_set_gate(7, (uint32_t)isr7, 0x08, 0x8E);
-    idt_set_gate(8, (uint32_t)isr8, 0x08, 0x8E);
-    idt_set_gate(9, (uint32_t)isr9, 0x08, 0x8E);
-    idt_set_gate(10, (uint32_t)isr10, 0x08, 0x8E);
-    idt_set_gate(11, (uint32_t)isr11, 0x08, 0x8E);
-    idt_set_gate(12, (uint32_t)isr12, 0x08, 0x8E);
-    idt_set_gate(13, (uint32_t)isr13, 0x08, 0x8E);
-    idt_set_gate(14, (uint32_t)isr14, 0x08, 0x8E);
-    idt_set_gate(15, (uint32_t)isr15, 0x08, 0x8E);
-    idt_set_gate(16, (uint32_t)isr16, 0x08, 0x8E);
-    idt_set_gate(17, (uint32_t)isr17, 0x08, 0x8E);
-    idt_set_gate(18, (uint32_t)isr18, 0x08, 0x8E);
-    idt_set_gate(19, (uint32_t)isr19, 0x08, 0x8E);
-    idt_set_gate(20, (uint32_t)isr20, 0x08, 0x8E);
-    idt_set_gate(21, (uint32_t)isr21, 0x08, 0x8E);
-    idt_set_gate(22, (uint32_t)isr22, 0x08, 0x8E);
-    idt_set_gate(23, (uint32_t)isr23, 0x08, 0x8E);
-    idt_set_gate(24, (uint32_t)isr24, 0x08, 0x8E);
-    idt_set_gate(25, (uint32_t)isr25, 0x08, 0x8E);
-    idt_set_gate(26, (uint32_t)isr26, 0x08, 0x8E);
-    idt_set_gate(27, (uint32_t)isr27, 0x08, 0x8E);
-    idt_set_gate(28, (uint32_t)isr28, 0x08, 0x8E);
-    idt_set_gate(29, (uint32_t)isr29, 0x08, 0x8E);
-    idt_set_gate(30, (uint32_t)isr30, 0x08, 0x8E);
-    idt_set_gate(31, (uint32_t)isr31, 0x08, 0x8E);
+    for (int i = 0; i < 32; i++) {
+        idt_set_gate(i, interrupt_stubs[i], 0x08, 0x8E);
+    }
 }
 
 void irq_remap() {
@@ -156,22 +213,12 @@ void irq_remap() {
 
 void irq_install() {
     irq_remap();
-    idt_set_gate(32, (uint32_t)irq0, 0x08, 0x8E);
-    idt_set_gate(33, (uint32_t)irq1, 0x08, 0x8E);
-    idt_set_gate(34, (uint32_t)irq2, 0x08, 0x8E);
-    idt_set_gate(35, (uint32_t)irq3, 0x08, 0x8E);
-    idt_set_gate(36, (uint32_t)irq4, 0x08, 0x8E);
-    idt_set_gate(37, (uint32_t)irq5, 0x08, 0x8E);
-    idt_set_gate(38, (uint32_t)irq6, 0x08, 0x8E);
-    idt_set_gate(39, (uint32_t)irq7, 0x08, 0x8E);
-    idt_set_gate(40, (uint32_t)irq8, 0x08, 0x8E);
-    idt_set_gate(41, (uint32_t)irq9, 0x08, 0x8E);
-    idt_set_gate(42, (uint32_t)irq10, 0x08, 0x8E);
-    idt_set_gate(43, (uint32_t)irq11, 0x08, 0x8E);
-    idt_set_gate(44, (uint32_t)irq12, 0x08, 0x8E);
-    idt_set_gate(45, (uint32_t)irq13, 0x08, 0x8E);
-    idt_set_gate(46, (uint32_t)irq14, 0x08, 0x8E);
-    idt_set_gate(47, (uint32_t)irq15, 0x08, 0x8E);
+    // The local APIC vectors stay unused while the 8259 is in charge
+    int count = interrupt_stubs_end - interrupt_stubs;
+    for (int i = 32; i < count; i++) {
+        idt_set_gate(i, interrupt_stubs[i], 0x08, 0x8E);
+    }
+    idt_set_gate(APIC_SPURIOUS_VECTOR, (uint32_t)irq_spurious, 0x08, 0x8E);
 }
 
 const char *exception_messages[] = {
@@ -185,40 +232,158 @@ const char *exception_messages[] = {
     "Reserved", "Reserved", "Reserved", "Reserved"
 };
 
-void isr_handler(registers_t r) {
-    if (interrupt_handlers[r.int_no] != 0) {
-        isr_t handler = interrupt_handlers[r.int_no];
-        handler(&r);
+void isr_handler(registers_t* r) {
+    percpu_t* self = cpu_self();
+    irqsoff_irq_enter(r);
+    self->irq_nesting++;
+    if (interrupt_handlers[r->int_no] != 0) {
+        isr_t handler = interrupt_handlers[r->int_no];
+        uint64_t start = rdtsc();
+        handler(r);
+        irq_account(r->int_no, (uint32_t)(rdtsc() - start));
     } else {
-        if (r.int_no < 32) {
+        if (r->int_no < 32) {
              terminal_set_color(VGA_COLOR_LIGHT_RED);
              terminal_writestring("EXCEPTION: ");
-             terminal_writestring(exception_messages[r.int_no]);
+             terminal_writestring(exception_messages[r->int_no]);
              terminal_writestring("\n");
-             panic_with_regs(exception_messages[r.int_no], &r);
+             panic_with_regs(exception_messages[r->int_no], r);
+        }
+    }
+    self->irq_nesting--;
+    irqsoff_irq_exit(r);
+}
+
+// OCW3 selects the in-service register for one read, then back to IRR
+static int pic_in_service(uint8_t vector) {
+    uint16_t port = vector >= 40 ? 0xA0 : 0x20;
+    outb(port, 0x0B);
+    uint8_t isr = inb(port);
+    outb(port, 0x0A);
+    return isr & (1 << ((vector - 32) & 7));
+}
+
+void irq_handler(registers_t* r) {
+    percpu_t* self = cpu_self();
+    if (self->idle_start) {
+        // This interrupt ended a cpu_idle()
+        self->idle_cycles += rdtsc() - self->idle_start;
+        self->idle_start = 0;
+    }
+    irqsoff_irq_enter(r);
+
+    // A request the 8259 lost before the acknowledge still shows up, as
+    // IRQ7 or IRQ15 with the in-service bit clear. No handler and no EOI,
+    // except to the master for the cascade of a spurious IRQ15.
+    if ((r->int_no == 39 || r->int_no == 47) && !lapic_eoi_reg && !pic_in_service(r->int_no)) {
+        irq_stats[r->int_no].spurious++;
+        if (r->int_no == 47) outb(0x20, 0x20);
+        irqsoff_irq_exit(r);
+        return;
+    }
+
+    self->irq_nesting++;
+    registers_t* outer_regs = self->irq_regs;
+    self->irq_regs = r;
+    isr_t handler = interrupt_handlers[r->int_no];
+    uint64_t start = rdtsc();
+    if (handler) handler(r);
+    irq_account(r->int_no, (uint32_t)(rdtsc() - start));
+    self->irq_regs = outer_regs;
+    self->irq_nesting--;
+
+    // Acknowledge once the handler is done. Handlers run with interrupts
+    // off, so nothing can nest in between.
+    if (lapic_eoi_reg) {
+        *lapic_eoi_reg = 0;
+    } else {
+        if (r->int_no >= 40) {
+            outb(0xA0, 0x20); // Reset slave
         }
+        outb(0x20, 0x20); // Reset master
+    }
+
+    // Bottom halves, then preemption, on the way out of the outermost
+    // handler. The frame stays on this thread's stack until it is switched
+    // back in and irets.
+    if (self->softirq_pending && !self->irq_nesting) {
+        softirq_run();
+    }
+    if (self->need_resched && !self->irq_nesting && !self->preempt_count) {
+        schedule();
+    }
+    irqsoff_irq_exit(r);
+}
+
+static const char* vector_name(int vector) {
+    if (vector < 32) return exception_messages[vector];
+    switch (vector) {
+        case 32: return "PIT";
+        case 33: return "keyboard";
+        case 36: return "COM1";
+        case 39: return "IRQ7";
+        case 47: return "IRQ15";
+        case APIC_TIMER_VECTOR: return "LAPIC timer";
+        case APIC_WAKE_VECTOR: return "wakeup IPI";
+        default: return "";
     }
 }
 
-void irq_handler(registers_t r) {
-    if (r.int_no >= 40) {
-        outb(0xA0, 0x20); // Reset slave
+void irq_stats_dump(void) {
+    static uint64_t last_tsc = 0;
+    static uint32_t last_count[256];
+    static uint64_t last_cycles[256];
+    static uint32_t last_apic_spurious = 0;
+
+    uint64_t now = rdtsc();
+    uint64_t window = now - last_tsc;
+    uint32_t khz = tsc_khz();
+    uint32_t window_ms = khz ? (uint32_t)udiv64(window, khz, 0) : 0;
+    kprintf("Over the last %u ms:\n", window_ms);
+    terminal_writestring("vec  source              count    /s  spur  avg cyc  max cyc    cpu\n");
+
+    for (int v = 0; v < 256; v++) {
+        irq_stat_t st = irq_stats[v];
+        if (!st.count && !st.spurious) continue;
+        uint32_t delta = st.count - last_count[v];
+        uint32_t rate = window_ms ? (uint32_t)udiv64((uint64_t)delta * 1000, window_ms, 0) : 0;
+        uint32_t cpu = percent_scaled(st.cycles - last_cycles[v], window, 10000); // Hundredths
+        kprintf("%3d  %-16s %8u %5u %5u  %7u  %7u  %2u.%02u%%\n", v, vector_name(v), st.count, rate,
+                st.spurious, st.count ? (uint32_t)udiv64(st.cycles, st.count, 0) : 0, st.max_cycles,
+                cpu / 100, cpu % 100);
+        last_count[v] = st.count;
+        last_cycles[v] = st.cycles;
     }
-    outb(0x20, 0x20); // Reset master
 
-    if (interrupt_handlers[r.int_no] != 0) {
-        isr_t handler = interrupt_handlers[r.int_no];
-        handler(&r);
+    uint32_t apic_spurious = apic_spurious_count;
+    if (apic_spurious) {
+        kprintf("%3d  %-16s %8u %5u\n", APIC_SPURIOUS_VECTOR, "APIC spurious", apic_spurious,
+                window_ms ? (uint32_t)udiv64((uint64_t)(apic_spurious - last_apic_spurious) * 1000, window_ms, 0) : 0);
     }
+    last_apic_spurious = apic_spurious;
+    last_tsc = now;
 }
 
 /* --- TIMER (PIT) --- */
 
 volatile uint32_t timer_ticks = 0;
 
+// Periodic 100 Hz tick until timer_init switches to one-shot mode
 void timer_callback(registers_t* regs) {
     (void)regs;
+    if (timer_tickless()) {
+        timer_interrupt();
+        return;
+    }
+
     timer_ticks++;
+    clock_tick();
+    sched_tick();
+
+    // Keep the screen live while long commands print (50 Hz)
+    if ((timer_ticks & 1) == 0) {
+        terminal_flush_deferred();
+    }
 }
 
 void timer_install() {
@@ -234,6 +399,11 @@ void timer_install() {
 }
 
 void sleep(uint32_t ms) {
+    if (timer_tickless()) {
+        thread_sleep_ns((uint64_t)ms * 1000000);
+        return;
+    }
+
     // 100Hz = 10ms per tick
     uint32_t ticks = ms / 10; 
     if (ticks == 0) ticks = 1;
@@ -244,7 +414,11 @@ void sleep(uint32_t ms) {
     }
 }
 
+// In 10 ms ticks, whether or not the PIT still ticks
 uint32_t get_tick_count() {
+    if (timer_tickless()) {
+        return (uint32_t)udiv64(ktime_get_ns(), 10000000, 0);
+    }
     return timer_ticks;
 }
 
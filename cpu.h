@@ -4,11 +4,73 @@
 #include <stdint.h>
 #include "kernel.h"
 
+/* CPU features */
+typedef struct {
+    uint8_t pse;
+    uint8_t tsc;
+    uint8_t apic;
+    uint8_t sse2;  // Also implies SSE/FXSR, and that SSE was enabled in CR4
+    uint8_t erms;
+    uint8_t invariant_tsc;  // Constant rate in every P/C-state
+} cpu_features_t;
+
+extern cpu_features_t cpu_features;
+void cpu_detect_features(void);
+
+/* Per-CPU data, reached through %gs. Every CPU has its own GDT whose
+   GDT_PERCPU_SEL descriptor is based at its entry. */
+#define MAX_CPUS 16
+#define GDT_PERCPU_SEL 0x18
+#define GDT_TSS_SEL 0x20
+
+typedef struct percpu {
+    struct percpu* self;      // %gs:0, so cpu_self() is a single load
+    uint32_t index;           // 0 is the boot CPU
+    uint8_t apic_id;
+    volatile uint8_t online;
+    uint32_t irq_nesting;     // Non-zero while a handler runs on this CPU
+    registers_t* irq_regs;    // Frame of the innermost interrupt, NULL outside
+    uint32_t preempt_count;   // Non-zero while preemption is held off
+    volatile uint8_t need_resched;  // Switch threads at the next chance
+    uint8_t softirq_active;   // Bottom halves are running
+    volatile uint32_t softirq_pending;  // One bit per softirq id
+    uint64_t idle_start;      // TSC at hlt, 0 while busy
+    uint64_t idle_cycles;
+    uint32_t chunks;          // parallel_for chunks run here
+    uint32_t items;
+} __attribute__((aligned(64))) percpu_t;
+
+extern percpu_t percpu[MAX_CPUS];
+
+static inline percpu_t* cpu_self(void) {
+    percpu_t* self;
+    asm ( "mov %%gs:0, %0" : "=r"(self) );
+    return self;
+}
+
+// In a handler or a bottom half, either way on borrowed stack and context
+static inline int in_interrupt(void) {
+    percpu_t* self = cpu_self();
+    return self->irq_nesting != 0 || self->softirq_active;
+}
+
+// Halts until the next interrupt and counts the time as idle. Call with
+// interrupts off after checking for work; returns with them on.
+static inline void cpu_idle(void) {
+    if (irqsoff_tracking) irqsoff_end();
+    cpu_self()->idle_start = rdtsc();
+    asm volatile ( "sti; hlt" : : : "memory" );
+}
+
 /* GDT */
 void gdt_install(void);
 
+// GDT, TSS, %gs and IDT for an application processor, on its own stack
+void cpu_init_ap(uint32_t index, uint32_t stack_top);
+
 /* IDT */
 void idt_install(void);
+void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
 
 /* ISRs & IRQs */
 void isr_install(void);
@@ -16,6 +78,23 @@ void irq_install(void);
 
 typedef void (*isr_t)(registers_t*);
 void register_interrupt_handler(uint8_t n, isr_t handler);
+isr_t get_interrupt_handler(uint8_t n);
+
+// Per-vector counters, always on: two rdtsc and a few adds per interrupt.
+// Cycles are the handler's, run with interrupts off. Only the wakeup IPI
+// is taken on more than one CPU, its numbers may lose an update.
+typedef struct {
+    uint32_t count;
+    uint32_t spurious;  // 8259 IRQ7/IRQ15 with the in-service bit clear
+    uint32_t max_cycles;
+    uint64_t cycles;
+} irq_stat_t;
+
+extern irq_stat_t irq_stats[256];
+extern volatile uint32_t apic_spurious_count;  // Counted by the stub in boot.s
+
+/* Counts, rates per second and handler time since the previous call */
+void irq_stats_dump(void);
 
 /* Timer */
 void timer_install(void);
@@ -0,0 +1,196 @@
+#include "irqsoff.h"
+#include "cpu.h"
+#include "clock.h"
+#include "smp.h"
+#include "perf.h"
+#include "kernel.h"
+
+extern const uint32_t interrupt_stubs[];
+extern const uint32_t interrupt_stubs_end[];
+
+typedef struct {
+    uint32_t eip;
+    uint32_t count;
+    uint32_t max_cycles;
+    uint64_t cycles;
+} irqsoff_site_t;
+
+// Only touched by its own CPU, with interrupts off
+typedef struct {
+    uint64_t start;  // TSC when the open window began, 0 if none is
+    uint32_t eip;
+    uint32_t max_cycles;
+    uint32_t max_eip;
+    uint32_t untracked;  // Windows from sites past IRQSOFF_SITES
+    uint32_t hist[IRQSOFF_BUCKETS];
+    irqsoff_site_t sites[IRQSOFF_SITES];
+} irqsoff_cpu_t;
+
+volatile int irqsoff_tracking = 0;
+static irqsoff_cpu_t cpus[MAX_CPUS];
+
+void irqsoff_init(void) {
+    __atomic_store_n(&irqsoff_tracking, 1, __ATOMIC_RELEASE);
+}
+
+static inline void window_open(uint32_t eip) {
+    irqsoff_cpu_t* c = &cpus[cpu_self()->index];
+    c->start = rdtsc();
+    c->eip = eip;
+}
+
+void __attribute__((noinline)) irqsoff_begin(void) {
+    window_open((uint32_t)__builtin_return_address(0));
+}
+
+// Open addressing on the EIP; sites never leave the table, so the probe
+// stops at the first empty slot
+static irqsoff_site_t* site_get(irqsoff_cpu_t* c, uint32_t eip) {
+    uint32_t h = (eip * 2654435761u) >> 26;  // Top 6 bits, one per slot
+    for (int i = 0; i < IRQSOFF_SITES; i++) {
+        irqsoff_site_t* s = &c->sites[(h + i) & (IRQSOFF_SITES - 1)];
+        if (s->eip == eip) return s;
+        if (!s->eip) {
+            s->eip = eip;
+            return s;
+        }
+    }
+    return 0;
+}
+
+void irqsoff_end(void) {
+    irqsoff_cpu_t* c = &cpus[cpu_self()->index];
+    if (!c->start) return;
+    uint64_t delta = rdtsc() - c->start;
+    c->start = 0;
+    uint32_t cycles = delta > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)delta;
+
+    c->hist[cycles ? 31 - __builtin_clz(cycles) : 0]++;
+    if (cycles > c->max_cycles) {
+        c->max_cycles = cycles;
+        c->max_eip = c->eip;
+    }
+    irqsoff_site_t* s = site_get(c, c->eip);
+    if (!s) {
+        c->untracked++;
+        return;
+    }
+    s->count++;
+    s->cycles += cycles;
+    if (cycles > s->max_cycles) s->max_cycles = cycles;
+}
+
+// The gate turned interrupts off; the window belongs to the vector's stub
+void irqsoff_irq_enter(registers_t* r) {
+    if (!irqsoff_tracking || !(r->eflags & EFLAGS_IF)) return;
+    uint32_t n = interrupt_stubs_end - interrupt_stubs;
+    window_open(r->int_no < n ? interrupt_stubs[r->int_no] : r->eip);
+}
+
+// iret turns them back on
+void irqsoff_irq_exit(registers_t* r) {
+    if (irqsoff_tracking && (r->eflags & EFLAGS_IF)) irqsoff_end();
+}
+
+/* --- REPORT --- */
+
+static irqsoff_site_t merged[MAX_CPUS * IRQSOFF_SITES];
+
+static void print_site(uint32_t eip) {
+    uint32_t off;
+    const char* name = ksym_lookup(eip, &off);
+    if (name) kprintf("%s+0x%x", name, off);
+    else kprintf("0x%08x", eip);
+}
+
+// Other CPUs' tables are read without synchronisation, a torn entry only
+// skews one line
+void irqsoff_dump(int top) {
+    uint32_t hist[IRQSOFF_BUCKETS] = {0};
+    uint32_t max_cycles = 0, max_eip = 0, untracked = 0;
+    int max_cpu = 0, n = 0;
+
+    for (int cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        irqsoff_cpu_t* c = &cpus[cpu];
+        for (int b = 0; b < IRQSOFF_BUCKETS; b++) hist[b] += c->hist[b];
+        untracked += c->untracked;
+        if (c->max_cycles > max_cycles) {
+            max_cycles = c->max_cycles;
+            max_eip = c->max_eip;
+            max_cpu = cpu;
+        }
+        for (int i = 0; i < IRQSOFF_SITES; i++) {
+            irqsoff_site_t* s = &c->sites[i];
+            if (!s->count) continue;
+            int j = 0;
+            while (j < n && merged[j].eip != s->eip) j++;
+            if (j == n) {
+                merged[n++] = *s;
+                continue;
+            }
+            merged[j].count += s->count;
+            merged[j].cycles += s->cycles;
+            if (s->max_cycles > merged[j].max_cycles) merged[j].max_cycles = s->max_cycles;
+        }
+    }
+
+    if (!irqsoff_tracking || !n) {
+        terminal_writestring("No interrupts-off windows recorded.\n");
+        return;
+    }
+    kprintf("Longest window: %u cycles (%llu us) on CPU %d, from ", max_cycles,
+            cycles_to_us(max_cycles), max_cpu);
+    print_site(max_eip);
+    terminal_writestring("\n\n    max cyc   max us     count  avg cyc  site\n");
+
+    // Selection by worst window, the table is small
+    for (int shown = 0; shown < top && shown < n; shown++) {
+        int best = shown;
+        for (int j = shown + 1; j < n; j++) {
+            if (merged[j].max_cycles > merged[best].max_cycles) best = j;
+        }
+        irqsoff_site_t s = merged[best];
+        merged[best] = merged[shown];
+        merged[shown] = s;
+        kprintf("  %9u  %7llu  %8u  %7u  ", s.max_cycles, cycles_to_us(s.max_cycles), s.count,
+                (uint32_t)udiv64(s.cycles, s.count, 0));
+        print_site(s.eip);
+        terminal_writestring("\n");
+    }
+    if (untracked) kprintf("  (%u windows from sites past the table)\n", untracked);
+
+    uint32_t peak = 0;
+    int lo = IRQSOFF_BUCKETS, hi = 0;
+    for (int b = 0; b < IRQSOFF_BUCKETS; b++) {
+        if (!hist[b]) continue;
+        if (hist[b] > peak) peak = hist[b];
+        if (b < lo) lo = b;
+        hi = b;
+    }
+    terminal_writestring("\n     cycles from      windows\n");
+    for (int b = lo; b <= hi; b++) {
+        kprintf("  %10u %12u  ", 1u << b, hist[b]);
+        uint32_t bar = (uint32_t)udiv64((uint64_t)hist[b] * 40 + peak - 1, peak, 0);
+        for (uint32_t i = 0; i < bar; i++) terminal_putchar('#');
+        terminal_writestring("\n");
+    }
+}
+
+// Windows open right now still close normally and count afresh
+void irqsoff_reset(void) {
+    for (int cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        irqsoff_cpu_t* c = &cpus[cpu];
+        uint32_t flags = irq_save();
+        c->max_cycles = 0;
+        c->max_eip = 0;
+        c->untracked = 0;
+        for (int b = 0; b < IRQSOFF_BUCKETS; b++) c->hist[b] = 0;
+        for (int i = 0; i < IRQSOFF_SITES; i++) {
+            c->sites[i].eip = 0;
+            c->sites[i].count = 0;
+            c->sites[i].max_cycles = 0;
+            c->sites[i].cycles = 0;
+        }
+        irq_restore(flags);
+    }
+}
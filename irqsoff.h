@@ -0,0 +1,30 @@
+#ifndef IRQSOFF_H
+#define IRQSOFF_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+/* Interrupts-off latency tracer. irq_save/irq_restore, irq_disable/
+   irq_enable and the interrupt entry and exit paths stamp every window
+   with interrupts off on a CPU. Each one is charged to the place that
+   turned them off: the caller of irq_save or irq_disable, or the entry
+   stub of the interrupt that arrived. */
+
+#define IRQSOFF_SITES 64    // Distinct sites per CPU, more are only counted
+#define IRQSOFF_BUCKETS 32  // log2 of the window in cycles
+
+// Starts tracking once every CPU has its per-CPU data. Windows already
+// open are not counted.
+void irqsoff_init(void);
+
+// Called by the handlers with the frame of the interrupted code. A window
+// only opens and closes here if that code had interrupts on.
+void irqsoff_irq_enter(registers_t* r);
+void irqsoff_irq_exit(registers_t* r);
+
+/* Worst window, the sites with the longest ones and a histogram, summed
+   over every CPU */
+void irqsoff_dump(int top);
+void irqsoff_reset(void);
+
+#endif
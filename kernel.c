@@ -2,6 +2,21 @@
 
 #include "kernel.h"
 #include "cpu.h"
+#include "mm.h"
+#include "paging.h"
+#include "bench.h"
+#include "serial.h"
+#include "klog.h"
+#include "acpi.h"
+#include "clock.h"
+#include "timer.h"
+#include "apic.h"
+#include "smp.h"
+#include "thread.h"
+#include "softirq.h"
+#include "perf.h"
+#include "trace.h"
+#include "irqsoff.h"
 
 /* --- RANDOM NUMBER GENERATOR --- */
 static unsigned long int next_rand = 1;
@@ -15,124 +30,64 @@ void srand(unsigned int seed) {
     next_rand = seed;
 }
 
-/* --- MEMORY MANAGEMENT (Linked List Allocator) --- */
-typedef struct block_header {
-    size_t size;
-    uint8_t is_free;
-    struct block_header* next;
-} block_header_t;
-
-#define HEAP_START 0x1000000
-#define HEAP_SIZE (10 * 1024 * 1024)
-
-static block_header_t* head = NULL;
-
-void* kmalloc(size_t size) {
-    if (size == 0) return NULL;
-
-    // Align size to 4 bytes
-    if (size & 0x3) {
-        size = (size & 0xFFFFFFFC) + 4;
-    }
-
-    // Lazy init
-    if (!head) {
-        head = (block_header_t*)HEAP_START;
-        head->size = HEAP_SIZE - sizeof(block_header_t);
-        head->is_free = 1;
-        head->next = NULL;
-    }
-
-    block_header_t* current = head;
-    while (current) {
-        if (current->is_free && current->size >= size) {
-            // Found a fit
-            // Check if we should split
-            if (current->size >= size + sizeof(block_header_t) + 4) {
-                block_header_t* new_block = (block_header_t*)((uint8_t*)current + sizeof(block_header_t) + size);
-                new_block->size = current->size - size - sizeof(block_header_t);
-                new_block->is_free = 1;
-                new_block->next = current->next;
-
-                current->size = size;
-                current->next = new_block;
-            }
-            
-            current->is_free = 0;
-            return (void*)((uint8_t*)current + sizeof(block_header_t));
-        }
-        current = current->next;
-    }
-
-    return NULL; // Out of memory
-}
-
-void kfree(void* ptr) {
-    if (!ptr) return;
-
-    block_header_t* header = (block_header_t*)((uint8_t*)ptr - sizeof(block_header_t));
-    header->is_free = 1;
-
-    // Coalesce with next block if free
-    if (header->next && header->next->is_free) {
-        header->size += sizeof(block_header_t) + header->next->size;
-        header->next = header->next->next;
-    }
-}
-
-void* memcpy(void* dest, const void* src, size_t n) {
-    char* d = (char*)dest;
-    const char* s = (const char*)src;
-    while(n--) *d++ = *s++;
-    return dest;
-}
+/* --- VGA DRIVER --- */
 
-void* memset(void* s, int c, size_t n) {
-    unsigned char* p = (unsigned char*)s;
-    while(n--) *p++ = (unsigned char)c;
-    return s;
-}
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
+#define ALL_ROWS ((1u << VGA_HEIGHT) - 1)
+volatile uint16_t* vga_buffer = (uint16_t*) 0xB8000;
 
-char* strcpy(char* dest, const char* src) {
-    char* saved = dest;
-    while (*src) {
-        *dest++ = *src++;
+// Rows of the 32 KiB text window at 0xB8000. The CRTC start address pans
+// the screen down this window, so a scroll only writes the new bottom row.
+#define VRAM_ROWS (0x8000 / 2 / VGA_WIDTH)
+
+// The terminal draws into a RAM ring of lines and terminal_flush pushes
+// changed rows to VRAM. VRAM is never read back. The live screen is the
+// last VGA_HEIGHT lines of the ring, older ones are scrollback.
+#define SCROLLBACK_LINES 2048 // Power of two
+static uint16_t terminal_buffer[SCROLLBACK_LINES * VGA_WIDTH];
+static uint32_t sb_top = 0;     // Ring line shown on screen row 0
+static uint32_t sb_history = 0; // Valid lines above sb_top
+static uint32_t sb_view = 0;    // Lines the view is scrolled back by
+static uint32_t vram_top = 0;   // VRAM row panned to the top of the screen
+static volatile uint32_t terminal_dirty = 0; // One bit per screen row
+static volatile uint32_t crtc_start_dirty = 0;
+static uint16_t cursor_pos = 0;              // Last position sent to the CRTC
+static int terminal_mirror = 0;              // Copy output to the serial port
+
+static volatile int flush_armed = 0;        // A flush timer is pending
+static int flush_softirq = -1;
+
+// Copying rows into VRAM is slow, so handlers leave it to a bottom half
+void terminal_flush_deferred(void) {
+    if (flush_softirq < 0) {
+        terminal_flush();
+        return;
     }
-    *dest = 0;
-    return saved;
+    softirq_raise(flush_softirq);
 }
 
-size_t strlen(const char* str) 
-{
-    size_t len = 0;
-    while (str[len]) len++;
-    return len;
+static void terminal_flush_timer(void* arg) {
+    (void)arg;
+    flush_armed = 0;
+    terminal_flush_deferred();
 }
 
-int strcmp(const char* s1, const char* s2) {
-    while (*s1 && (*s1 == *s2)) {
-        s1++;
-        s2++;
+// Without a periodic tick, output from long commands is pushed to VRAM by
+// a one-shot timer 20 ms after the first change
+static inline void terminal_mark_dirty(uint32_t rows) {
+    __atomic_fetch_or(&terminal_dirty, rows, __ATOMIC_RELAXED);
+    if (!flush_armed && timer_tickless()) {
+        flush_armed = 1;
+        if (!timer_add(ktime_get_ns() + 20000000, terminal_flush_timer, 0)) flush_armed = 0;
     }
-    return *(const unsigned char*)s1 - *(const unsigned char*)s2;
 }
 
-int strncmp(const char* s1, const char* s2, size_t n) {
-    while (n && *s1 && (*s1 == *s2)) {
-        ++s1;
-        ++s2;
-        --n;
-    }
-    if (n == 0) return 0;
-    return *(const unsigned char*)s1 - *(const unsigned char*)s2;
+// Ring storage of live screen row y
+static inline uint16_t* terminal_line(size_t y) {
+    return terminal_buffer + ((sb_top + y) & (SCROLLBACK_LINES - 1)) * VGA_WIDTH;
 }
 
-/* --- VGA DRIVER --- */
-
-static const size_t VGA_WIDTH = 80;
-static const size_t VGA_HEIGHT = 25;
-volatile uint16_t* vga_buffer = (uint16_t*) 0xB8000;
-
 size_t terminal_row;
 size_t terminal_column;
 uint8_t terminal_color;
@@ -151,88 +106,203 @@ void terminal_set_color(uint8_t color) {
     terminal_color = color;
 }
 
+int terminal_set_mirror(int enabled) {
+    int old = terminal_mirror;
+    terminal_mirror = enabled;
+    return old;
+}
+
 void terminal_initialize(void) 
 {
     terminal_row = 0;
     terminal_column = 0;
     terminal_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
+    sb_top = 0;
+    sb_history = 0;
+    sb_view = 0;
+    vram_top = 0;
     for (size_t y = 0; y < VGA_HEIGHT; y++) {
+        uint16_t* line = terminal_line(y);
         for (size_t x = 0; x < VGA_WIDTH; x++) {
-            vga_buffer[y * VGA_WIDTH + x] = vga_entry(' ', terminal_color);
+            line[x] = vga_entry(' ', terminal_color);
         }
     }
+    crtc_start_dirty = 1;
+    terminal_mark_dirty(ALL_ROWS);
+    if (flush_softirq < 0) flush_softirq = softirq_register("vga", terminal_flush);
     
     // Move cursor to 0,0
     outb(0x3D4, 0x0F);
     outb(0x3D5, 0);
     outb(0x3D4, 0x0E);
     outb(0x3D5, 0);
+    cursor_pos = 0;
 }
 
 void terminal_update_cursor() {
-    uint16_t pos = terminal_row * VGA_WIDTH + terminal_column;
+    // The cursor address is absolute in VRAM, not relative to the start
+    // address. While browsing scrollback it is parked below the screen.
+    uint16_t pos = sb_view ? (vram_top + VGA_HEIGHT) * VGA_WIDTH
+                           : (vram_top + terminal_row) * VGA_WIDTH + terminal_column;
+    if (pos == cursor_pos) return; // Port I/O is expensive, skip no-op moves
+    cursor_pos = pos;
     outb(0x3D4, 0x0F);
     outb(0x3D5, (uint8_t)(pos & 0xFF));
     outb(0x3D4, 0x0E);
     outb(0x3D5, (uint8_t)((pos >> 8) & 0xFF));
 }
 
+// Advances the ring by one line. Rows already in VRAM stay where they are
+// and the start address moves down one row, until the window runs out and
+// the screen is repainted from the top of VRAM.
 void terminal_scroll(void)
 {
-    for (size_t y = 0; y < VGA_HEIGHT - 1; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            vga_buffer[y * VGA_WIDTH + x] = vga_buffer[(y + 1) * VGA_WIDTH + x];
-        }
+    uint32_t flags = irq_save(); // terminal_flush may run from the timer
+    sb_top = (sb_top + 1) & (SCROLLBACK_LINES - 1);
+    if (sb_history < SCROLLBACK_LINES - VGA_HEIGHT) {
+        sb_history++;
     }
+    uint16_t* line = terminal_line(VGA_HEIGHT - 1);
     for (size_t x = 0; x < VGA_WIDTH; x++) {
-        vga_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = vga_entry(' ', terminal_color);
+        line[x] = vga_entry(' ', terminal_color);
     }
+
+    if (sb_view) {
+        // Keep the browsed lines still while output continues below
+        if (sb_view < sb_history) {
+            sb_view++;
+        } else {
+            terminal_dirty = ALL_ROWS;
+        }
+    } else if (++vram_top + VGA_HEIGHT > VRAM_ROWS) {
+        vram_top = 0;
+        terminal_dirty = ALL_ROWS;
+        crtc_start_dirty = 1;
+    } else {
+        terminal_dirty = (terminal_dirty >> 1) | (1u << (VGA_HEIGHT - 1));
+        crtc_start_dirty = 1;
+    }
+    irq_restore(flags);
     terminal_row = VGA_HEIGHT - 1;
 }
 
+void terminal_scrollback(int lines)
+{
+    int view = (int)sb_view + lines;
+    if (view < 0) view = 0;
+    if (view > (int)sb_history) view = sb_history;
+    if ((uint32_t)view == sb_view) return;
+
+    sb_view = view;
+    terminal_mark_dirty(ALL_ROWS);
+    terminal_update_cursor();
+}
+
 void terminal_putentryat(char c, uint8_t color, size_t x, size_t y) 
 {
-    vga_buffer[y * VGA_WIDTH + x] = vga_entry(c, color);
+    if (y >= VGA_HEIGHT) return;
+    terminal_line(y)[x] = vga_entry(c, color);
+    terminal_mark_dirty(1u << y);
 }
 
-void terminal_putchar(char c) 
+// Copies the rows changed since the last flush to VRAM, then pans the
+// CRTC to the new start row. Safe to call from the timer interrupt: rows
+// written during the copy stay marked.
+void terminal_flush(void)
 {
-    if (c == '\n') {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_scroll();
-        }
-        terminal_update_cursor();
-        return;
+    uint32_t rows = __atomic_exchange_n(&terminal_dirty, 0, __ATOMIC_ACQ_REL);
+    uint32_t first = sb_top - sb_view;
+    while (rows) {
+        int y = __builtin_ctz(rows);
+        rows &= rows - 1;
+        uint16_t* line = terminal_buffer + ((first + y) & (SCROLLBACK_LINES - 1)) * VGA_WIDTH;
+        memcpy((uint16_t*)vga_buffer + (vram_top + y) * VGA_WIDTH, line, VGA_WIDTH * sizeof(uint16_t));
     }
-    
-    if (c == '\b') {
-         if (terminal_column > 0) {
-            terminal_column--;
-            terminal_putentryat(' ', terminal_color, terminal_column, terminal_row);
-         } else if (terminal_row > 0) { // Backspace to previous line if needed (optional)
-            terminal_row--;
-            terminal_column = VGA_WIDTH - 1;
-            terminal_putentryat(' ', terminal_color, terminal_column, terminal_row);
-         }
-         terminal_update_cursor();
-         return;
+
+    if (__atomic_exchange_n(&crtc_start_dirty, 0, __ATOMIC_ACQ_REL)) {
+        uint16_t start = vram_top * VGA_WIDTH;
+        outb(0x3D4, 0x0C);
+        outb(0x3D5, (uint8_t)(start >> 8));
+        outb(0x3D4, 0x0D);
+        outb(0x3D5, (uint8_t)(start & 0xFF));
     }
+}
 
-    terminal_putentryat(c, terminal_color, terminal_column, terminal_row);
-    if (++terminal_column == VGA_WIDTH) {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_scroll();
+// Writes a whole buffer, copying runs of printable characters straight
+// into the shadow rows. The hardware cursor moves once at the end.
+void terminal_write(const char* data, size_t size)
+{
+    preempt_disable(); // One writer at a time, lines don't interleave
+    const char* p = data;
+    const char* end = data + size;
+    uint32_t dirty = 0;
+    uint16_t attr = (uint16_t)terminal_color << 8;
+
+    if (terminal_mirror) {
+        serial_write(data, size);
+    }
+
+    while (p < end) {
+        char c = *p;
+        if (c == '\n') {
+            terminal_column = 0;
+            if (++terminal_row == VGA_HEIGHT) {
+                terminal_mark_dirty(dirty); // Row bits move with the scroll
+                dirty = 0;
+                terminal_scroll();
+            }
+            p++;
+            continue;
+        }
+
+        if (c == '\b') {
+            if (terminal_column > 0) {
+                terminal_column--;
+            } else if (terminal_row > 0) { // Backspace to previous line if needed (optional)
+                terminal_row--;
+                terminal_column = VGA_WIDTH - 1;
+            }
+            terminal_line(terminal_row)[terminal_column] = ' ' | attr;
+            dirty |= 1u << terminal_row;
+            p++;
+            continue;
+        }
+
+        // Printable run, up to the end of the row or the next control char
+        size_t room = VGA_WIDTH - terminal_column;
+        const char* run_end = (size_t)(end - p) < room ? end : p + room;
+        uint16_t* cell = terminal_line(terminal_row) + terminal_column;
+        const char* q = p;
+        while (q < run_end && *q != '\n' && *q != '\b') {
+            *cell++ = (unsigned char)*q++ | attr;
+        }
+        dirty |= 1u << terminal_row;
+        terminal_column += q - p;
+        p = q;
+
+        if (terminal_column == VGA_WIDTH) {
+            terminal_column = 0;
+            if (++terminal_row == VGA_HEIGHT) {
+                terminal_mark_dirty(dirty); // Row bits move with the scroll
+                dirty = 0;
+                terminal_scroll();
+            }
         }
     }
+
+    terminal_mark_dirty(dirty);
     terminal_update_cursor();
+    preempt_enable();
+}
+
+void terminal_putchar(char c) 
+{
+    terminal_write(&c, 1);
 }
 
 void terminal_writestring(const char* data) 
 {
-    for (size_t i = 0; i < strlen(data); i++)
-        terminal_putchar(data[i]);
+    terminal_write(data, strlen(data));
 }
 
 void terminal_write_color(const char* data, enum vga_color fg) {
@@ -246,11 +316,12 @@ void terminal_write_color(const char* data, enum vga_color fg) {
 
 // Helper to print hex
 void print_hex(uint32_t n) {
-    terminal_writestring("0x");
-    char hex_chars[] = "0123456789ABCDEF";
-    for (int i = 28; i >= 0; i -= 4) {
-        terminal_putchar(hex_chars[(n >> i) & 0xF]);
-    }
+    kprintf("0x%08X", n);
+}
+
+// Helper to print unsigned decimal
+void print_dec(uint32_t n) {
+    kprintf("%u", n);
 }
 
 void panic(const char* message) {
@@ -258,15 +329,19 @@ void panic(const char* message) {
 }
 
 void panic_with_regs(const char* message, registers_t* regs) {
-    asm volatile("cli");
+    irq_disable();
+    klog(KLOG_ERR, "panic: %s", message);
     
     terminal_set_color(vga_entry_color(VGA_COLOR_WHITE, VGA_COLOR_RED));
     // Clear screen specifically for panic manually
+    sb_view = 0;
     for (size_t y = 0; y < VGA_HEIGHT; y++) {
+        uint16_t* line = terminal_line(y);
         for (size_t x = 0; x < VGA_WIDTH; x++) {
-            vga_buffer[y * VGA_WIDTH + x] = vga_entry(' ', terminal_color);
+            line[x] = vga_entry(' ', terminal_color);
         }
     }
+    terminal_mark_dirty(ALL_ROWS);
     terminal_row = 0; 
     terminal_column = 0;
     terminal_update_cursor();
@@ -277,26 +352,24 @@ void panic_with_regs(const char* message, registers_t* regs) {
     terminal_writestring("\n");
 
     if (regs) {
-        terminal_writestring("\n  EAX: "); print_hex(regs->eax);
-        terminal_writestring("  EBX: "); print_hex(regs->ebx);
-        terminal_writestring("  ECX: "); print_hex(regs->ecx);
-        terminal_writestring("  EDX: "); print_hex(regs->edx);
-        terminal_writestring("\n  ESI: "); print_hex(regs->esi);
-        terminal_writestring("  EDI: "); print_hex(regs->edi);
-        terminal_writestring("  EBP: "); print_hex(regs->ebp);
-        terminal_writestring("  ESP: "); print_hex(regs->esp);
-        terminal_writestring("\n  EIP: "); print_hex(regs->eip);
-        terminal_writestring("  CS:  "); print_hex(regs->cs);
-        terminal_writestring("  FLG: "); print_hex(regs->eflags);
-        terminal_writestring("\n");
+        kprintf("\n  EAX: 0x%08X  EBX: 0x%08X  ECX: 0x%08X  EDX: 0x%08X"
+                "\n  ESI: 0x%08X  EDI: 0x%08X  EBP: 0x%08X  ESP: 0x%08X"
+                "\n  EIP: 0x%08X  CS:  0x%08X  FLG: 0x%08X\n",
+                regs->eax, regs->ebx, regs->ecx, regs->edx,
+                regs->esi, regs->edi, regs->ebp, regs->esp,
+                regs->eip, regs->cs, regs->eflags);
         if (regs->int_no <= 32) {
-             terminal_writestring("  INT: "); print_hex(regs->int_no);
-             terminal_writestring("  ERR: "); print_hex(regs->err_code);
+             kprintf("  INT: 0x%08X  ERR: 0x%08X", regs->int_no, regs->err_code);
+             if (regs->int_no == 14) {
+                 kprintf("  CR2: 0x%08X", read_cr2());
+             }
              terminal_writestring("\n");
         }
     }
 
     terminal_writestring("\n  System halted.\n");
+    terminal_flush();
+    serial_flush();
 
     for (;;) {
         asm volatile("hlt");
@@ -319,12 +392,63 @@ char kb_buffer[KB_BUFFER_SIZE];
 volatile int kb_read_ptr = 0;
 volatile int kb_write_ptr = 0;
 
+static volatile int kb_shift = 0;
+
+wait_queue_t console_input = WAIT_QUEUE_INIT;
+
+static void kb_push(uint8_t scancode) {
+    int next_write = (kb_write_ptr + 1) % KB_BUFFER_SIZE;
+    if (next_write != kb_read_ptr) {
+        kb_buffer[kb_write_ptr] = (char)scancode; // Store raw scancode for now to handle arrows
+        kb_write_ptr = next_write;
+    } else {
+        klog(KLOG_WARN, "kbd: buffer full, dropped scancode 0x%02X", scancode);
+    }
+}
+
+// Scancodes as read by the IRQ, decoded by the bottom half
+#define KB_RAW_SIZE 64 // Power of two
+static uint8_t kb_raw[KB_RAW_SIZE];
+static volatile uint32_t kb_raw_head = 0;
+static volatile uint32_t kb_raw_tail = 0;
+static int kb_softirq = -1;
+
+// Top half: reading the port is the acknowledge, everything else waits
 void keyboard_callback(registers_t* regs) {
     (void)regs;
     uint8_t scancode = inb(0x60);
-    
+    if (kb_raw_head - kb_raw_tail < KB_RAW_SIZE) {
+        kb_raw[kb_raw_head & (KB_RAW_SIZE - 1)] = scancode;
+        __atomic_store_n(&kb_raw_head, kb_raw_head + 1, __ATOMIC_RELEASE);
+    } else {
+        klog(KLOG_WARN, "kbd: raw ring full, dropped scancode 0x%02X", scancode);
+    }
+    softirq_raise(kb_softirq);
+}
+
+static void keyboard_decode(uint8_t scancode) {
+    static int extended = 0;
+
+    if (scancode == 0xE0) {
+        extended = 1;
+        return;
+    }
+
+    // Shift state is tracked here since releases never reach the buffer.
+    // E0 2A / E0 AA are the fake shifts some keyboards wrap around the
+    // navigation keys, so they are skipped.
+    if (extended && ((scancode & 0x7F) == 0x2A || (scancode & 0x7F) == 0x36)) {
+        extended = 0;
+        return;
+    }
+    if (scancode == 0x2A || scancode == 0x36) kb_shift = 1;
+    else if (scancode == 0xAA || scancode == 0xB6) kb_shift = 0;
+
     // Ignore key release for now
-    if (scancode & 0x80) return;
+    if (scancode & 0x80) {
+        extended = 0;
+        return;
+    }
 
     // Up arrow: 0xE0 0x48 (Handle extended codes later properly, for now just simple scancodes)
     // Actually, scancodes are trickier.
@@ -337,14 +461,25 @@ void keyboard_callback(registers_t* regs) {
     
     // Let's assume standard set 1.
     
-    int next_write = (kb_write_ptr + 1) % KB_BUFFER_SIZE;
-    if (next_write != kb_read_ptr) {
-        kb_buffer[kb_write_ptr] = (char)scancode; // Store raw scancode for now to handle arrows
-        kb_write_ptr = next_write;
+    // The E0 prefix is only queued along with a make code
+    if (extended) {
+        extended = 0;
+        kb_push(0xE0);
     }
+    kb_push(scancode);
+}
+
+static void keyboard_bh(void) {
+    uint32_t head = __atomic_load_n(&kb_raw_head, __ATOMIC_ACQUIRE);
+    while (kb_raw_tail != head) {
+        keyboard_decode(kb_raw[kb_raw_tail & (KB_RAW_SIZE - 1)]);
+        __atomic_store_n(&kb_raw_tail, kb_raw_tail + 1, __ATOMIC_RELEASE);
+    }
+    wait_queue_wake_all(&console_input);
 }
 
 void keyboard_install() {
+    kb_softirq = softirq_register("kbd", keyboard_bh);
     register_interrupt_handler(33, keyboard_callback);
 }
 
@@ -365,9 +500,12 @@ typedef struct {
     const char* name;
     command_func_t func;
     const char* help;
+    int foreground;  // Owns the console or global state, refuses &
 } command_t;
 
 // Forward declarations
+void shell_prompt(void);
+void shell_handle_char(char ascii);
 void cmd_echo(const char* args);
 void cmd_help(const char* args);
 void cmd_about(const char* args);
@@ -379,23 +517,81 @@ void cmd_cat(const char* args);
 void cmd_color(const char* args);
 void cmd_matrix(const char* args);
 void cmd_meminfo(const char* args);
+void cmd_vmmap(const char* args);
+void cmd_membench(const char* args);
+void cmd_strbench(const char* args);
+void cmd_dmesg(const char* args);
+void cmd_clocksource(const char* args);
+void cmd_timers(const char* args);
+void cmd_apic(const char* args);
+void cmd_cpus(const char* args);
+void cmd_smpbench(const char* args);
+void cmd_ps(const char* args);
+void cmd_softirqs(const char* args);
+void cmd_irqbench(const char* args);
+void cmd_bench(const char* args);
+void cmd_irqstat(const char* args);
+void cmd_perf(const char* args);
+void cmd_trace(const char* args);
+void cmd_irqsoff(const char* args);
 
 command_t commands[] = {
-    {"echo", cmd_echo, "Prints text to console. Usage: echo <text>"},
-    {"help", cmd_help, "Shows this help message."},
-    {"about", cmd_about, "Information about Excien."},
-    {"clear", cmd_clear, "Clears the terminal."},
-    {"codetease", cmd_about, "Alias for about."},
-    {"panic", cmd_panic, "Triggers a kernel panic (BSOD test)."},
-    {"ping", cmd_ping, "Pings an IP address (Network test)."},
-    {"ls", cmd_ls, "List loaded modules (files)."},
-    {"cat", cmd_cat, "Print module content. Usage: cat <name>"},
-    {"color", cmd_color, "Change terminal theme. Usage: color <matrix|bsod|default>"},
-    {"matrix", cmd_matrix, "Enter the Matrix."},
-    {"meminfo", cmd_meminfo, "Display memory status (Heap blocks)."},
-    {0, 0, 0} 
+    {"echo", cmd_echo, "Prints text to console. Usage: echo <text>", 0},
+    {"help", cmd_help, "Shows this help message.", 0},
+    {"about", cmd_about, "Information about Excien.", 0},
+    {"clear", cmd_clear, "Clears the terminal.", 1},
+    {"codetease", cmd_about, "Alias for about.", 0},
+    {"panic", cmd_panic, "Triggers a kernel panic (BSOD test).", 0},
+    {"ping", cmd_ping, "Pings an IP address (Network test).", 0},
+    {"ls", cmd_ls, "List loaded modules (files).", 0},
+    {"cat", cmd_cat, "Print module content. Usage: cat <name>", 0},
+    {"color", cmd_color, "Change terminal theme. Usage: color <matrix|bsod|default>", 0},
+    {"matrix", cmd_matrix, "Enter the Matrix.", 1},
+    {"meminfo", cmd_meminfo, "Display memory status. Usage: meminfo [slab|phys]", 0},
+    {"vmmap", cmd_vmmap, "Show active page mappings and TLB flush counts.", 0},
+    {"membench", cmd_membench, "Benchmark memcpy/memset variants. Usage: membench [copy|set]", 0},
+    {"strbench", cmd_strbench, "Benchmark string scanning variants.", 0},
+    {"dmesg", cmd_dmesg, "Show the kernel log. Usage: dmesg [err|warn|info|debug]", 0},
+    {"clocksource", cmd_clocksource, "List or switch clocksources. Usage: clocksource [name]", 0},
+    {"timers", cmd_timers, "Timer wheel stats, 'timers test' measures sleep accuracy.", 0},
+    {"apic", cmd_apic, "Interrupt routing, 'apic latency' compares 8259 and APIC delivery.", 1},
+    {"cpus", cmd_cpus, "Per-CPU load since the last call and parallel work done.", 0},
+    {"smpbench", cmd_smpbench, "Time page zeroing and module checksums on 1 CPU vs all.", 0},
+    {"softirqs", cmd_softirqs, "Time spent in interrupt handlers and in their bottom halves.", 0},
+    {"irqstat", cmd_irqstat, "Interrupts per vector: counts, rate, spurious and handler cycles.", 0},
+    {"perf", cmd_perf, "Sampling profiler. Usage: perf [top [n]|start [hz]|stop|record [-F hz] <cmd>|raw]", 1},
+    {"trace", cmd_trace, "Function tracer ('make trace'). Usage: trace [start|stop|exclude <fn>|dump]", 1},
+    {"irqsoff", cmd_irqsoff, "Longest interrupts-off windows and where they start. Usage: irqsoff [n|reset]", 0},
+    {"bench", cmd_bench, "Run the benchmark suite: min/median/p99 cycles of the hot paths.", 1},
+    {"irqbench", cmd_irqbench, "Cycles per interrupt entry/exit, old stubs vs streamlined.", 1},
+    {"ps", cmd_ps, "List threads, 'ps bench' times a context switch. Append & to background a command.", 0},
+    {0, 0, 0, 0} 
 };
 
+// Splits off the command word once instead of rescanning per command
+static const command_t* find_command(const char* line, const char** args) {
+    size_t len = strlen(line);
+    const char* space = memchr(line, ' ', len);
+    size_t cmd_len = space ? (size_t)(space - line) : len;
+    *args = space ? space + 1 : "";
+
+    for (int i = 0; cmd_len > 0 && commands[i].name != 0; i++) {
+        if (strnlen(commands[i].name, cmd_len + 1) == cmd_len
+                && memcmp(line, commands[i].name, cmd_len) == 0) {
+            return &commands[i];
+        }
+    }
+    return 0;
+}
+
+// Decimal number at *p, moved past it and any spaces after
+static uint32_t parse_uint(const char** p) {
+    uint32_t n = 0;
+    while (**p >= '0' && **p <= '9') n = n * 10 + (uint32_t)(*(*p)++ - '0');
+    while (**p == ' ') (*p)++;
+    return n;
+}
+
 void cmd_echo(const char* args) {
     terminal_writestring(args);
     terminal_writestring("\n");
@@ -405,11 +601,11 @@ void cmd_help(const char* args) {
     (void)args;
     terminal_writestring("Available commands:\n");
     for (int i = 0; commands[i].name != 0; i++) {
-        terminal_write_color("  ", VGA_COLOR_DARK_GREY);
+        terminal_write("  ", 2);
         terminal_write_color(commands[i].name, VGA_COLOR_LIGHT_CYAN);
-        terminal_writestring(": ");
-        terminal_writestring(commands[i].help);
-        terminal_writestring("\n");
+        terminal_write(": ", 2);
+        terminal_write(commands[i].help, strlen(commands[i].help));
+        terminal_write("\n", 1);
     }
 }
 
@@ -424,7 +620,8 @@ void cmd_about(const char* args) {
 void cmd_clear(const char* args) {
     (void)args;
     terminal_initialize();
-    terminal_writestring("Excien Shell [v0.4.0]\nuser@excien:~$ ");
+    terminal_writestring("Excien Shell [v0.4.0]\n");
+    shell_prompt();
 }
 
 void cmd_panic(const char* args) {
@@ -442,9 +639,9 @@ void cmd_ping(const char* args) {
     terminal_writestring("Pinging ");
     terminal_writestring(args);
     terminal_writestring("...\n");
+    terminal_flush();
     
-    // Simple busy wait since we don't have sleep()
-    for (volatile int i = 0; i < 10000000; i++);
+    sleep(1000);
     
     terminal_write_color("Error: Network Unreachable.\n", VGA_COLOR_LIGHT_RED);
 }
@@ -453,13 +650,12 @@ void terminal_set_theme(enum vga_color fg, enum vga_color bg) {
     uint8_t new_color = vga_entry_color(fg, bg);
     terminal_set_color(new_color);
     
-    for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            uint16_t entry = vga_buffer[y * VGA_WIDTH + x];
-            unsigned char c = entry & 0xFF;
-            vga_buffer[y * VGA_WIDTH + x] = vga_entry(c, new_color);
-        }
+    // Scrollback included, so browsing back shows the same theme
+    for (size_t i = 0; i < SCROLLBACK_LINES * VGA_WIDTH; i++) {
+        unsigned char c = terminal_buffer[i] & 0xFF;
+        terminal_buffer[i] = vga_entry(c, new_color);
     }
+    terminal_mark_dirty(ALL_ROWS);
 }
 
 void cmd_color(const char* args) {
@@ -480,13 +676,16 @@ void cmd_color(const char* args) {
 void cmd_matrix(const char* args) {
     (void)args;
     // Clear screen first
+    terminal_scrollback(-SCROLLBACK_LINES);
     for (size_t y = 0; y < VGA_HEIGHT; y++) {
+        uint16_t* line = terminal_line(y);
         for (size_t x = 0; x < VGA_WIDTH; x++) {
-            vga_buffer[y * VGA_WIDTH + x] = vga_entry(' ', vga_entry_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK));
+            line[x] = vga_entry(' ', vga_entry_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK));
         }
     }
+    terminal_mark_dirty(ALL_ROWS);
     
-    int drops[80]; // VGA_WIDTH is 80
+    int drops[VGA_WIDTH];
     for (size_t i = 0; i < VGA_WIDTH; i++) drops[i] = -1;
     
     terminal_row = 0;
@@ -511,7 +710,7 @@ void cmd_matrix(const char* args) {
                 
                 // Draw tail (darker green) one step above
                 if (drops[x] > 0) {
-                     char tail_c = (vga_buffer[(drops[x]-1) * VGA_WIDTH + x]) & 0xFF;
+                     char tail_c = terminal_line(drops[x]-1)[x] & 0xFF;
                      terminal_putentryat(tail_c, vga_entry_color(VGA_COLOR_GREEN, VGA_COLOR_BLACK), x, drops[x]-1);
                 }
                 // Erase tail further up
@@ -526,60 +725,283 @@ void cmd_matrix(const char* args) {
             }
         }
         
-        // Delay
-        for (volatile int i = 0; i < 500000; i++);
+        terminal_flush();
+
+        // About 20 frames a second, the rest of the time is free for others
+        sleep(50);
     }
     
     // Restore
     terminal_initialize();
     terminal_writestring("Wake up, Neo...\n");
-    terminal_writestring("user@excien:~$ ");
+    shell_prompt();
 }
 
 void cmd_meminfo(const char* args) {
-    (void)args;
-    if (!head) {
-        terminal_writestring("Heap not initialized.\n");
+    if (strcmp(args, "phys") == 0) {
+        const pmm_region_t* regions;
+        int count = pmm_get_regions(&regions);
+        terminal_writestring("Usable RAM regions:\n");
+        for (int i = 0; i < count; i++) {
+            kprintf("  0x%08X - 0x%08X (%u KiB)\n", regions[i].base,
+                    regions[i].base + regions[i].frames * PAGE_SIZE - 1,
+                    regions[i].frames * (PAGE_SIZE / 1024));
+        }
+        kprintf("Frames: %u free of %u\n", pmm_free_count(), pmm_total_count());
         return;
     }
 
-    terminal_writestring("Heap Status:\n");
-    block_header_t* current = head;
-    while (current) {
-        terminal_writestring("  Addr: ");
-        print_hex((uint32_t)current);
-        terminal_writestring(" Size: ");
-        print_hex(current->size);
-        terminal_writestring(" Free: ");
-        if (current->is_free) {
-            terminal_write_color("YES", VGA_COLOR_LIGHT_GREEN);
-        } else {
-            terminal_write_color("NO", VGA_COLOR_LIGHT_RED);
+    if (strcmp(args, "slab") == 0) {
+        terminal_writestring("Slab classes:\n");
+        for (int i = 0; i < SLAB_CLASSES; i++) {
+            slab_class_stats_t st;
+            slab_get_stats(i, &st);
+            kprintf("  %4uB: pages %3u, objects %u/%u\n", st.object_size,
+                    st.pages, st.objects_in_use, st.objects_total);
+        }
+        kprintf("  Free arena pages: %u\n", slab_free_pages());
+        return;
+    }
+
+    heap_dump();
+
+    heap_stats_t hs;
+    heap_get_stats(&hs);
+    if (hs.total) {
+        kprintf("Free: %u KiB in %u blocks, largest %u KiB, fragmentation %u%%\n",
+                hs.free >> 10, hs.free_blocks, hs.largest_free >> 10, hs.fragmentation);
+    }
+}
+
+void cmd_vmmap(const char* args) {
+    (void)args;
+    terminal_writestring("Page mappings:\n");
+    paging_dump();
+
+    paging_stats_t st;
+    paging_get_stats(&st);
+    kprintf("4M pages: %u, 4K pages: %u, page tables: %u\n",
+            st.large_pages, st.small_pages, st.page_tables);
+    kprintf("TLB flushes: %u invlpg, %u full\n", st.page_flushes, st.full_flushes);
+    kprintf("Demand-zero faults: %u, pages committed: %u\n", st.demand_faults, st.pages_committed);
+}
+
+void cmd_membench(const char* args) {
+    bench_mem(args);
+}
+
+void cmd_strbench(const char* args) {
+    (void)args;
+    bench_str();
+}
+
+void cmd_dmesg(const char* args) {
+    int level = KLOG_DEBUG;
+    if (strlen(args) > 0) {
+        level = klog_parse_level(args);
+        if (level < 0) {
+            terminal_writestring("Usage: dmesg [err|warn|info|debug]\n");
+            return;
+        }
+    }
+    klog_dump(level);
+
+    klog_stats_t st;
+    klog_get_stats(&st);
+    if (st.overwritten) {
+        kprintf("(%u older records overwritten)\n", st.overwritten);
+    }
+}
+
+void cmd_clocksource(const char* args) {
+    if (strlen(args) > 0) {
+        if (clocksource_select(args) != 0) {
+            kprintf("Unknown clocksource '%s'.\n", args);
+            return;
+        }
+    }
+
+    uint32_t tsc_rate = tsc_khz();
+    const clocksource_t* cur = clocksource_current();
+    for (int i = 0; i < clocksource_count(); i++) {
+        const clocksource_t* cs = clocksource_get(i);
+        uint32_t khz = (uint32_t)udiv64(cs->freq_hz, 1000, 0);
+        kprintf("%c %-8s %5u.%03u MHz  %2u bits  rating %3d", cs == cur ? '*' : ' ', cs->name,
+                khz / 1000, khz % 1000, cs->mask == ~0ULL ? 64 : 32 - __builtin_clz((uint32_t)cs->mask),
+                cs->rating);
+        if (tsc_rate) {
+            kprintf("  read %4u cycles (%u ns)", cs->read_cycles,
+                    (uint32_t)udiv64((uint64_t)cs->read_cycles * 1000000, tsc_rate, 0));
         }
         terminal_writestring("\n");
-        current = current->next;
     }
+    if (!cur) {
+        terminal_writestring("No clocksource.\n");
+        return;
+    }
+
+    uint32_t us;
+    uint64_t ms = udiv64(ktime_get_ns(), 1000000, 0);
+    uint32_t sec = (uint32_t)udiv64(ms, 1000, &us);
+    kprintf("Uptime: %u.%03u s\n", sec, us);
 }
 
-/* --- INITRD / MODULES --- */
-typedef struct {
-    uint32_t mod_start;
-    uint32_t mod_end;
-    uint32_t string;
-    uint32_t reserved;
-} multiboot_module_t;
+void cmd_timers(const char* args) {
+    if (!timer_tickless()) {
+        terminal_writestring("Periodic tick, no timer wheel.\n");
+        return;
+    }
 
-typedef struct {
-    uint32_t flags;
-    uint32_t mem_lower;
-    uint32_t mem_upper;
-    uint32_t boot_device;
-    uint32_t cmdline;
-    uint32_t mods_count;
-    uint32_t mods_addr;
-    // ... we don't need the rest for now
-} multiboot_info_t;
+    if (strcmp(args, "test") == 0) {
+        static const uint32_t us[] = { 50, 100, 500, 1000, 5000 };
+        for (size_t i = 0; i < sizeof(us) / sizeof(us[0]); i++) {
+            uint64_t start = ktime_get_ns();
+            timer_sleep_ns((uint64_t)us[i] * 1000);
+            uint32_t took = (uint32_t)(ktime_get_ns() - start);
+            kprintf("sleep %5u us: took %5u.%03u us\n", us[i], took / 1000, took % 1000);
+        }
+        return;
+    }
+
+    // Rates since boot and since the previous call
+    static uint64_t last_ns = 0;
+    static uint32_t last_wakeups = 0;
+    timer_stats_t st;
+    timer_get_stats(&st);
+    uint64_t now = ktime_get_ns();
+    uint32_t uptime_ms = (uint32_t)udiv64(now, 1000000, 0);
+    uint32_t window_ms = (uint32_t)udiv64(now - last_ns, 1000000, 0);
+
+    kprintf("Clockevent: %s, %u pending\n", timer_get_clockevent()->name, st.pending);
+    kprintf("Wakeups: %u (%u/s since boot", st.wakeups, uptime_ms ? (uint32_t)udiv64((uint64_t)st.wakeups * 1000, uptime_ms, 0) : 0);
+    if (last_ns && window_ms) {
+        kprintf(", %u/s over the last %u ms", (uint32_t)udiv64((uint64_t)(st.wakeups - last_wakeups) * 1000, window_ms, 0), window_ms);
+    }
+    kprintf(")\nFired: %u, reprogrammed: %u\n", st.fired, st.programs);
+    if (st.fired) {
+        kprintf("Slack: avg %u ns, max %u ns\n", (uint32_t)udiv64(st.slack_total_ns, st.fired, 0), st.slack_max_ns);
+    }
+    last_ns = now;
+    last_wakeups = st.wakeups;
+}
+
+void cmd_apic(const char* args) {
+    if (strcmp(args, "latency") == 0) {
+        apic_latency();
+        return;
+    }
+    apic_dump();
+}
+
+void cmd_cpus(const char* args) {
+    (void)args;
+    smp_dump();
+}
+
+void cmd_smpbench(const char* args) {
+    (void)args;
+    bench_smp();
+}
+
+void cmd_ps(const char* args) {
+    if (strcmp(args, "bench") == 0) {
+        sched_bench();
+        return;
+    }
+    sched_dump();
+}
+
+void cmd_softirqs(const char* args) {
+    (void)args;
+    softirq_dump();
+}
+
+void cmd_irqstat(const char* args) {
+    (void)args;
+    irq_stats_dump();
+}
+
+void cmd_perf(const char* args) {
+    if (strncmp(args, "start", 5) == 0) {
+        const char* p = args + 5;
+        while (*p == ' ') p++;
+        if (perf_start(parse_uint(&p)) == 0) terminal_writestring("Profiling, 'perf stop' to end.\n");
+    } else if (strcmp(args, "stop") == 0) {
+        perf_stop();
+        perf_report(15);
+    } else if (strncmp(args, "record ", 7) == 0) {
+        const char* p = args + 7;
+        uint32_t hz = 0;
+        if (strncmp(p, "-F ", 3) == 0) {
+            p += 3;
+            hz = parse_uint(&p);
+        }
+        const char* cmd_args;
+        const command_t* cmd = find_command(p, &cmd_args);
+        if (!cmd) {
+            terminal_writestring("Usage: perf record [-F hz] <command>\n");
+            return;
+        }
+        if (perf_start(hz) != 0) return;
+        cmd->func(cmd_args);
+        perf_stop();
+        perf_report(15);
+    } else if (strcmp(args, "raw") == 0) {
+        perf_dump_raw();
+    } else if (strncmp(args, "top", 3) == 0) {
+        const char* p = args + 3;
+        while (*p == ' ') p++;
+        uint32_t n = parse_uint(&p);
+        perf_report(n ? (int)n : 15);
+    } else if (args[0] == 0) {
+        perf_report(15);
+    } else {
+        terminal_writestring("Usage: perf [top [n]|start [hz]|stop|record [-F hz] <cmd>|raw]\n");
+    }
+}
+
+void cmd_trace(const char* args) {
+    if (!trace_available()) {
+        terminal_writestring("Built without function tracing, use 'make trace'.\n");
+    } else if (strcmp(args, "start") == 0) {
+        if (trace_start() == 0) terminal_writestring("Tracing, 'trace dump' to stop and export.\n");
+        else terminal_writestring("Out of memory for the trace buffers.\n");
+    } else if (strcmp(args, "stop") == 0) {
+        trace_stop();
+        trace_dump_status();
+    } else if (strncmp(args, "exclude ", 8) == 0) {
+        uint32_t fn = ksym_find(args + 8);
+        if (!fn) kprintf("No function '%s'.\n", args + 8);
+        else if (trace_exclude(fn) != 0) terminal_writestring("Exclusion list is full.\n");
+    } else if (strcmp(args, "dump") == 0) {
+        trace_export_json();
+    } else if (args[0] == 0) {
+        trace_dump_status();
+    } else {
+        terminal_writestring("Usage: trace [start|stop|exclude <fn>|dump]\n");
+    }
+}
+
+void cmd_irqsoff(const char* args) {
+    if (strcmp(args, "reset") == 0) {
+        irqsoff_reset();
+        return;
+    }
+    uint32_t n = parse_uint(&args);
+    irqsoff_dump(n ? (int)n : 10);
+}
+
+void cmd_irqbench(const char* args) {
+    (void)args;
+    bench_irq_entry();
+}
+
+void cmd_bench(const char* args) {
+    (void)args;
+    bench_suite();
+}
 
+/* --- INITRD / MODULES --- */
 multiboot_info_t* mb_info = 0;
 
 void cmd_ls(const char* args) {
@@ -591,11 +1013,8 @@ void cmd_ls(const char* args) {
     
     multiboot_module_t* modules = (multiboot_module_t*)mb_info->mods_addr;
     for (uint32_t i = 0; i < mb_info->mods_count; i++) {
-        terminal_writestring((const char*)modules[i].string);
-        terminal_writestring(" (");
-        // Print size
-        // We lack printf with %d, so skip size for now or implement itoa
-        terminal_writestring("bytes)\n");
+        kprintf("%s (%u bytes)\n", (const char*)modules[i].string,
+                modules[i].mod_end - modules[i].mod_start);
     }
 }
 
@@ -613,12 +1032,8 @@ void cmd_cat(const char* args) {
     multiboot_module_t* modules = (multiboot_module_t*)mb_info->mods_addr;
     for (uint32_t i = 0; i < mb_info->mods_count; i++) {
         if (strcmp((const char*)modules[i].string, args) == 0) {
-            char* start = (char*)modules[i].mod_start;
-            char* end = (char*)modules[i].mod_end;
-            
-            for (char* p = start; p < end; p++) {
-                terminal_putchar(*p);
-            }
+            const char* start = (const char*)modules[i].mod_start;
+            terminal_write(start, modules[i].mod_end - modules[i].mod_start);
             terminal_writestring("\n");
             return;
         }
@@ -628,16 +1043,22 @@ void cmd_cat(const char* args) {
 
 /* --- SHELL --- */
 
+#define SHELL_PROMPT "user@excien:~$ "
+
+void shell_prompt(void) {
+    terminal_write(SHELL_PROMPT, sizeof(SHELL_PROMPT) - 1);
+}
+
 // History
 #define HISTORY_MAX 10
 char* history[HISTORY_MAX];
 int history_count = 0;
 int history_view_index = -1; // -1 means currently typing new command
 
-void history_add(const char* cmd) {
+void history_add(const char* cmd, size_t len) {
     if (history_count < HISTORY_MAX) {
-        history[history_count] = kmalloc(strlen(cmd) + 1);
-        strcpy(history[history_count], cmd);
+        history[history_count] = kmalloc(len + 1);
+        memcpy(history[history_count], cmd, len + 1);
         history_count++;
     } else {
         // Shift history
@@ -646,55 +1067,89 @@ void history_add(const char* cmd) {
         for (int i = 0; i < HISTORY_MAX - 1; i++) {
             history[i] = history[i+1];
         }
-        history[HISTORY_MAX-1] = kmalloc(strlen(cmd) + 1);
-        strcpy(history[HISTORY_MAX-1], cmd);
+        history[HISTORY_MAX-1] = kmalloc(len + 1);
+        memcpy(history[HISTORY_MAX-1], cmd, len + 1);
     }
 }
 
 char input_buffer[256];
 int buffer_index = 0;
 
+// Background commands get their own copy of the arguments, the input
+// buffer is reused as soon as the prompt is back
+typedef struct {
+    command_func_t func;
+    char args[sizeof(input_buffer)];
+} background_job_t;
+
+static void background_main(void* arg) {
+    background_job_t* job = arg;
+    job->func(job->args);
+    kprintf("[%u] done\n", thread_current()->id);
+    kfree(job);
+}
+
+static void run_background(const command_t* cmd, const char* args) {
+    background_job_t* job = kmalloc(sizeof(background_job_t));
+    if (!job) {
+        terminal_writestring("Out of memory.\n");
+        return;
+    }
+    job->func = cmd->func;
+    strcpy(job->args, args);
+    thread_t* t = thread_create(cmd->name, THREAD_PRIO_NORMAL, background_main, job);
+    if (!t) {
+        kfree(job);
+        terminal_writestring("Could not start a thread.\n");
+        return;
+    }
+    kprintf("[%u] %s\n", t->id, cmd->name);
+}
+
 void execute_command() 
 {
     terminal_writestring("\n");
     input_buffer[buffer_index] = 0; 
 
-    if (strlen(input_buffer) == 0) {
-        terminal_writestring("user@excien:~$ ");
+    size_t len = buffer_index;
+    if (len == 0) {
+        shell_prompt();
         return;
     }
     
     // Add to history
     if (history_count == 0 || strcmp(history[history_count-1], input_buffer) != 0) {
-        history_add(input_buffer);
+        history_add(input_buffer, len);
     }
     history_view_index = -1;
 
-    int found = 0;
-    for (int i = 0; commands[i].name != 0; i++) {
-        size_t cmd_len = strlen(commands[i].name);
-        
-        if (strncmp(input_buffer, commands[i].name, cmd_len) == 0) {
-            if (input_buffer[cmd_len] == 0 || input_buffer[cmd_len] == ' ') {
-                const char* args = "";
-                if (input_buffer[cmd_len] == ' ') {
-                    args = input_buffer + cmd_len + 1;
-                }
-                commands[i].func(args);
-                found = 1;
-                break;
-            }
-        }
+    // A trailing & runs the command in its own thread
+    int background = 0;
+    if (input_buffer[len - 1] == '&') {
+        background = 1;
+        len--;
+        while (len > 0 && input_buffer[len - 1] == ' ') len--;
+        input_buffer[len] = 0;
     }
 
-    if (!found) {
+    const char* args;
+    const command_t* cmd = find_command(input_buffer, &args);
+    if (cmd) {
+        if (background && cmd->foreground) {
+            kprintf("%s can't run in the background.\n", cmd->name);
+        } else if (background) {
+            run_background(cmd, args);
+        } else {
+            cmd->func(args);
+        }
+    } else {
         terminal_write_color("Unknown command: ", VGA_COLOR_LIGHT_RED);
         terminal_writestring(input_buffer);
         terminal_writestring("\n");
     }
 
     if (strcmp(input_buffer, "clear") != 0) {
-        terminal_writestring("user@excien:~$ ");
+        shell_prompt();
     }
     buffer_index = 0;
 }
@@ -733,18 +1188,44 @@ void shell_handle_tab() {
     }
 }
 
+// Erases the typed line in a single terminal write
+void shell_clear_line(void) {
+    char erase[sizeof(input_buffer)];
+    memset(erase, '\b', buffer_index);
+    terminal_write(erase, buffer_index);
+    buffer_index = 0;
+}
+
 void shell_load_history(int index) {
     // Clear current line
-    while(buffer_index > 0) {
-        terminal_putchar('\b');
-        buffer_index--;
-    }
+    shell_clear_line();
     
     if (index >= 0 && index < history_count) {
         const char* cmd = history[index];
-        strcpy(input_buffer, cmd);
         buffer_index = strlen(cmd);
-        terminal_writestring(input_buffer);
+        memcpy(input_buffer, cmd, buffer_index + 1);
+        terminal_write(input_buffer, buffer_index);
+    }
+}
+
+void shell_history_up(void) {
+    if (history_count > 0) {
+        if (history_view_index == -1) history_view_index = history_count - 1;
+        else if (history_view_index > 0) history_view_index--;
+        shell_load_history(history_view_index);
+    }
+}
+
+void shell_history_down(void) {
+    if (history_view_index != -1) {
+        if (history_view_index < history_count - 1) {
+            history_view_index++;
+            shell_load_history(history_view_index);
+        } else {
+            // Restore empty
+            history_view_index = -1;
+            shell_clear_line();
+        }
     }
 }
 
@@ -765,27 +1246,22 @@ void shell_handle_input(char scancode) {
         // Right: 0x4D
         state = 0;
 
+        // Shift+PgUp / Shift+PgDn browse the scrollback a page at a time
+        if (kb_shift && (uint8_t)scancode == 0x49) {
+            terminal_scrollback(VGA_HEIGHT - 1);
+            return;
+        }
+        if (kb_shift && (uint8_t)scancode == 0x51) {
+            terminal_scrollback(-(VGA_HEIGHT - 1));
+            return;
+        }
+        terminal_scrollback(-SCROLLBACK_LINES);
+
         if ((uint8_t)scancode == 0x48) { // UP
-            if (history_count > 0) {
-                if (history_view_index == -1) history_view_index = history_count - 1;
-                else if (history_view_index > 0) history_view_index--;
-                shell_load_history(history_view_index);
-            }
+            shell_history_up();
         }
         else if ((uint8_t)scancode == 0x50) { // DOWN
-             if (history_view_index != -1) {
-                if (history_view_index < history_count - 1) {
-                    history_view_index++;
-                    shell_load_history(history_view_index);
-                } else {
-                    // Restore empty
-                    history_view_index = -1;
-                    while(buffer_index > 0) {
-                        terminal_putchar('\b');
-                        buffer_index--;
-                    }
-                }
-             }
+            shell_history_down();
         }
         return;
     }
@@ -796,8 +1272,41 @@ void shell_handle_input(char scancode) {
     if ((uint8_t)scancode < 128) {
         ascii = kbd_US[(uint8_t)scancode];
     }
+    shell_handle_char(ascii);
+}
 
+// Bytes from the serial console. Enter arrives as CR (or CR LF),
+// backspace as DEL, and the arrows as ESC [ A / ESC [ B.
+void shell_handle_serial(char c) {
+    static int state = 0; // 0=normal, 1=seen ESC, 2=seen ESC [
+    static char last = 0;
+
+    if (state == 1) {
+        state = (c == '[') ? 2 : 0;
+        return;
+    }
+    if (state == 2) {
+        state = 0;
+        if (c == 'A') shell_history_up();
+        else if (c == 'B') shell_history_down();
+        return;
+    }
+
+    char prev = last;
+    last = c;
+    if (c == 0x1B) {
+        state = 1;
+        return;
+    }
+    if (c == '\n' && prev == '\r') return;
+    if (c == '\r') c = '\n';
+    if (c == 0x7F) c = '\b';
+    shell_handle_char(c);
+}
+
+void shell_handle_char(char ascii) {
     if (ascii > 0) {
+        terminal_scrollback(-SCROLLBACK_LINES); // Typing returns to the live screen
         if (ascii == '\n') {
             execute_command();
         }
@@ -821,16 +1330,22 @@ void shell_handle_input(char scancode) {
 
 void shell_loop() 
 {
-    terminal_writestring("user@excien:~$ ");
+    shell_prompt();
     
     while(1) {
-        // Polling loop but using our new keyboard_getchar which reads from interrupt buffer
+        // Checked with interrupts off so a key can't land between the check
+        // and going to sleep; the keyboard and serial IRQs wake us.
+        irq_disable();
         char scancode = keyboard_getchar();
-        if (scancode == 0) {
-             asm volatile("hlt"); // Save power
+        char serial = serial_getchar();
+        if (scancode == 0 && serial == 0) {
+             terminal_flush(); // Show everything before going idle
+             wait_queue_wait(&console_input);
              continue;
         }
-        shell_handle_input(scancode);
+        irq_enable();
+        if (scancode) shell_handle_input(scancode);
+        if (serial) shell_handle_serial(serial);
     }
 }
 
@@ -849,38 +1364,92 @@ void print_splash() {
     terminal_writestring("---------------------------------------\n\n");
 }
 
+// Whole-word match against the multiboot command line
+static int cmdline_has(const char* word) {
+    if (!mb_info || !(mb_info->flags & MULTIBOOT_FLAG_CMDLINE)) return 0;
+    const char* p = (const char*)mb_info->cmdline;
+    size_t len = strlen(word);
+    while (*p) {
+        while (*p == ' ') p++;
+        const char* start = p;
+        while (*p && *p != ' ') p++;
+        if ((size_t)(p - start) == len && memcmp(start, word, len) == 0) return 1;
+    }
+    return 0;
+}
+
 void __attribute__((__used__)) kernel_main(uint32_t magic, uint32_t addr) 
 {
     /* Initialize Hardware */
-    gdt_install();
+    cpu_detect_features();
+    gdt_install(); // First, memset and friends look at the per-CPU data
+    string_init();
     idt_install();
     isr_install();
     irq_install();
     
     // Enable interrupts
-    asm volatile("sti");
+    irq_enable();
     
     timer_install();
+    klog_init();
+    klog(KLOG_INFO, "cpu: pse=%u tsc=%u apic=%u sse2=%u erms=%u, mem ops: %s",
+         cpu_features.pse, cpu_features.tsc, cpu_features.apic, cpu_features.sse2,
+         cpu_features.erms, string_impl_name());
     keyboard_install();
+    serial_init();
+    klog(KLOG_INFO, "serial: COM1 %s", serial_present() ? "up at 115200" : "not found");
     
     terminal_initialize();
+    terminal_set_mirror(serial_present());
     
     if (magic == 0x2BADB002) {
         mb_info = (multiboot_info_t*)addr;
+    } else {
+        klog(KLOG_WARN, "boot: bad multiboot magic 0x%08X", magic);
+    }
+
+    /* Initialize Memory */
+    pmm_init(mb_info);
+    klog(KLOG_INFO, "pmm: %u of %u frames free", pmm_free_count(), pmm_total_count());
+    paging_init();
+    paging_stats_t ps;
+    paging_get_stats(&ps);
+    klog(KLOG_INFO, "paging: %u 4M pages, %u 4K pages", ps.large_pages, ps.small_pages);
+    heap_init();
+    heap_stats_t hs;
+    heap_get_stats(&hs);
+    klog(KLOG_INFO, "heap: %u KiB at 0x%08X", hs.total >> 10, HEAP_VIRT_BASE);
+
+    /* Firmware tables and clocks */
+    acpi_init();
+    clock_init();
+    timer_init();
+    if (cmdline_has("noapic")) {
+        klog(KLOG_INFO, "apic: disabled on the command line");
+    } else {
+        apic_init();
     }
+    smp_init();
+    irqsoff_init(); // Every CPU has its per-CPU data now
+    sched_init();
     
     print_splash();
     
     // Check modules
     if (mb_info && (mb_info->flags & (1<<3))) {
-        terminal_writestring("Modules loaded: ");
-        // We can print count manually since we don't have itoa
+        klog(KLOG_INFO, "multiboot: %u modules", mb_info->mods_count);
         if (mb_info->mods_count > 0) {
-            terminal_writestring("Yes\n");
+            kprintf("Modules loaded: %u\n", mb_info->mods_count);
         } else {
-             terminal_writestring("None\n");
+            terminal_writestring("Modules loaded: None\n");
         }
     }
+
+    // `make bench`: run the suite and quit QEMU, or drop to the shell
+    if (cmdline_has("bench")) {
+        bench_exit(bench_suite() == 0 ? 0 : 1);
+    }
     
     shell_loop();
 }
@@ -1,6 +1,7 @@
 #ifndef KERNEL_H
 #define KERNEL_H
 
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -25,18 +26,151 @@ static inline void outw(uint16_t port, uint16_t val) {
     asm volatile ( "outw %0, %1" : : "a"(val), "Nd"(port) );
 }
 
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    asm volatile ( "inl %1, %0" : "=a"(ret) : "Nd"(port) );
+    return ret;
+}
+
+static inline void outl(uint16_t port, uint32_t val) {
+    asm volatile ( "outl %0, %1" : : "a"(val), "Nd"(port) );
+}
+
 static inline void io_wait(void) {
     outb(0x80, 0);
 }
 
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    asm volatile ( "cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0) );
+}
+
+static inline uint64_t rdtsc(void) {
+    uint64_t ret;
+    asm volatile ( "rdtsc" : "=A"(ret) );
+    return ret;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint64_t ret;
+    asm volatile ( "rdmsr" : "=A"(ret) : "c"(msr) );
+    return ret;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    asm volatile ( "wrmsr" : : "c"(msr), "A"(val) );
+}
+
+// 64 by 32 bit division without libgcc: high half first, then one divl
+// whose quotient is known to fit
+static inline uint64_t udiv64(uint64_t n, uint32_t d, uint32_t* rem) {
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n;
+    uint32_t q_hi = hi / d;
+    uint32_t q_lo;
+    hi %= d;
+    asm ( "divl %4" : "=a"(q_lo), "=d"(hi) : "a"(lo), "d"(hi), "rm"(d) );
+    if (rem) *rem = hi;
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+// (a * mul) >> shift for shift <= 32, exact and without 64-bit overflow
+// in the intermediate product as long as the result fits
+static inline uint64_t mul_u64_u32_shr(uint64_t a, uint32_t mul, uint32_t shift) {
+    uint64_t ret = ((uint64_t)(uint32_t)a * mul) >> shift;
+    uint32_t hi = (uint32_t)(a >> 32);
+    if (hi) ret += ((uint64_t)hi * mul) << (32 - shift);
+    return ret;
+}
+
+#define EFLAGS_IF 0x200
+
+// Interrupts-off tracer hooks, see irqsoff.h. irqsoff_begin charges the
+// window to its caller; both run with interrupts off.
+extern volatile int irqsoff_tracking;
+void irqsoff_begin(void);
+void irqsoff_end(void);
+
+// Disables interrupts and returns the previous EFLAGS for irq_restore
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    asm volatile ( "pushf; pop %0; cli" : "=r"(flags) : : "memory" );
+    if ((flags & EFLAGS_IF) && irqsoff_tracking) irqsoff_begin();
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if ((flags & EFLAGS_IF) && irqsoff_tracking) irqsoff_end();
+    asm volatile ( "push %0; popf" : : "r"(flags) : "memory", "cc" );
+}
+
+// cli and sti, for sections that don't nest
+static inline void irq_disable(void) {
+    (void)irq_save();
+}
+
+static inline void irq_enable(void) {
+    if (irqsoff_tracking) irqsoff_end();
+    asm volatile ( "sti" : : : "memory" );
+}
+
+static inline uint32_t read_cr2(void) {
+    uint32_t ret;
+    asm volatile ( "mov %%cr2, %0" : "=r"(ret) );
+    return ret;
+}
+
 /* --- STRING FUNCTIONS --- */
 size_t strlen(const char* str);
+size_t strnlen(const char* str, size_t max);
 int strcmp(const char* s1, const char* s2);
 int strncmp(const char* s1, const char* s2, size_t n);
 void* memcpy(void* dest, const void* src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
 void* memset(void* s, int c, size_t n);
+void* memchr(const void* s, int c, size_t n);
+int memcmp(const void* s1, const void* s2, size_t n);
 char* strcpy(char* dest, const char* src);
 
+// Picks the memcpy/memset implementation from the CPU features
+void string_init(void);
+const char* string_impl_name(void);
+
+// Copies/fills at least this large use SSE2 non-temporal stores
+#define MEM_NT_THRESHOLD (256 * 1024)
+
+// Individual implementations, exposed for benchmarking
+void* memcpy_bytes(void* dest, const void* src, size_t n);
+void* memcpy_rep(void* dest, const void* src, size_t n);
+void* memcpy_erms(void* dest, const void* src, size_t n);
+void* memcpy_sse2_nt(void* dest, const void* src, size_t n);
+void* memset_bytes(void* s, int c, size_t n);
+void* memset_rep(void* s, int c, size_t n);
+void* memset_erms(void* s, int c, size_t n);
+void* memset_sse2_nt(void* s, int c, size_t n);
+size_t strlen_bytes(const char* str);
+size_t strlen_word(const char* str);
+size_t strlen_sse2(const char* str);
+int strcmp_bytes(const char* s1, const char* s2);
+int strcmp_word(const char* s1, const char* s2);
+int strcmp_sse2(const char* s1, const char* s2);
+void* memchr_bytes(const void* s, int c, size_t n);
+void* memchr_word(const void* s, int c, size_t n);
+void* memchr_sse2(const void* s, int c, size_t n);
+int memcmp_bytes(const void* s1, const void* s2, size_t n);
+int memcmp_word(const void* s1, const void* s2, size_t n);
+int memcmp_sse2(const void* s1, const void* s2, size_t n);
+
+/* --- FORMATTED OUTPUT --- */
+// %d %i %u %x %X %p %s %c and %%, with '-' and '0' flags, a width (or *),
+// a precision for %s, and "ll" for 64-bit integers. The snprintf forms
+// return the full length even when the output was cut short.
+#define KPRINTF_BUFFER 512
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list ap);
+int ksnprintf(char* buf, size_t size, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+// Formats on the stack and hands the terminal one write (at most
+// KPRINTF_BUFFER - 1 characters)
+int kvprintf(const char* fmt, va_list ap);
+int kprintf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
 /* --- VGA DRIVER --- */
 enum vga_color {
     VGA_COLOR_BLACK = 0,
@@ -58,11 +192,26 @@ enum vga_color {
 };
 
 void terminal_initialize(void);
+void terminal_write(const char* data, size_t size);
 void terminal_writestring(const char* data);
 void terminal_write_color(const char* data, enum vga_color fg);
 void terminal_putchar(char c);
 void terminal_putentryat(char c, uint8_t color, size_t x, size_t y);
 void terminal_set_color(uint8_t color);
+void terminal_flush(void);
+void terminal_flush_deferred(void);  // From handlers, flushes in a bottom half
+
+void terminal_scroll(void);
+
+// Also send all terminal output to the serial console. Returns the old
+// setting.
+int terminal_set_mirror(int enabled);
+
+// Moves the view through the scrollback, positive towards older lines.
+// Any amount past either end is clamped.
+void terminal_scrollback(int lines);
+void print_hex(uint32_t n);
+void print_dec(uint32_t n);
 
 /* --- KERNEL CORE --- */
 typedef struct {
@@ -75,8 +224,49 @@ typedef struct {
 void panic(const char* message);
 void panic_with_regs(const char* message, registers_t* regs);
 
+// Woken whenever a key or a serial byte arrives (see thread.h)
+struct wait_queue;
+extern struct wait_queue console_input;
+
+/* --- MULTIBOOT --- */
+#define MULTIBOOT_FLAG_MEM     (1<<0)
+#define MULTIBOOT_FLAG_CMDLINE (1<<2)
+#define MULTIBOOT_FLAG_MODS    (1<<3)
+#define MULTIBOOT_FLAG_MMAP    (1<<6)
+
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;
+    uint32_t reserved;
+} multiboot_module_t;
+
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+    // ... we don't need the rest for now
+} multiboot_info_t;
+
+// 'size' does not count itself, entries are walked by size + 4
+typedef struct {
+    uint32_t size;
+    uint64_t base_addr;
+    uint64_t length;
+    uint32_t type;  // 1 = available RAM
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+extern multiboot_info_t* mb_info;
+
 /* --- MEMORY MANAGEMENT --- */
 void* kmalloc(size_t size);
-void kfree(void* ptr); // Optional for bump allocator
+void kfree(void* ptr);
 
 #endif
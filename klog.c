@@ -0,0 +1,102 @@
+#include "klog.h"
+#include "cpu.h"
+#include "clock.h"
+#include "kernel.h"
+
+/* --- RING --- */
+
+// A record is published by storing seq = index + 1 last. Readers copy a
+// record and keep it only if seq matched before and after the copy, so a
+// writer overwriting the slot meanwhile is detected instead of locked out.
+typedef struct {
+    volatile uint32_t seq;
+    uint8_t level;
+    uint8_t len;
+    uint16_t reserved;
+    uint64_t tsc;
+    char text[KLOG_TEXT_MAX];
+} klog_record_t;
+
+static klog_record_t ring[KLOG_RECORDS] __attribute__((aligned(KLOG_RECORD_SIZE)));
+static volatile uint32_t head = 0; // Next index to hand out
+
+static uint64_t base_tsc = 0;
+static uint32_t base_ticks = 0;
+
+static const char* level_names[] = { "err", "warn", "info", "debug" };
+
+void klog_init(void) {
+    if (!cpu_features.tsc) return;
+    base_tsc = rdtsc();
+    base_ticks = get_tick_count();
+}
+
+void kvlog(int level, const char* fmt, va_list ap) {
+    uint32_t idx = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    klog_record_t* r = &ring[idx & (KLOG_RECORDS - 1)];
+
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->tsc = cpu_features.tsc ? rdtsc() : 0;
+    r->level = level;
+    int n = kvsnprintf(r->text, KLOG_TEXT_MAX, fmt, ap);
+    r->len = n < KLOG_TEXT_MAX ? n : KLOG_TEXT_MAX - 1;
+    __atomic_store_n(&r->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+void klog(int level, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    kvlog(level, fmt, ap);
+    va_end(ap);
+}
+
+static int klog_read(uint32_t idx, klog_record_t* out) {
+    klog_record_t* r = &ring[idx & (KLOG_RECORDS - 1)];
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != idx + 1) return 0;
+    memcpy(out, r, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->seq, __ATOMIC_RELAXED) == idx + 1;
+}
+
+/* --- READING --- */
+
+int klog_parse_level(const char* name) {
+    for (int i = 0; i <= KLOG_DEBUG; i++) {
+        if (strcmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void klog_dump(int max_level) {
+    // Calibrated TSC rate, or one measured against the PIT since klog_init
+    uint32_t khz = tsc_khz();
+    uint32_t ticks = get_tick_count() - base_ticks;
+    if (!khz && base_tsc && ticks >= 10) {
+        khz = (uint32_t)udiv64(rdtsc() - base_tsc, ticks * 10, 0); // 10 ms per tick
+    }
+
+    uint32_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint32_t start = end > KLOG_RECORDS ? end - KLOG_RECORDS : 0;
+    klog_record_t rec;
+
+    for (uint32_t idx = start; idx < end; idx++) {
+        if (!klog_read(idx, &rec) || rec.level > max_level) continue;
+
+        if (khz) {
+            uint32_t usec;
+            uint64_t since = rec.tsc > base_tsc ? rec.tsc - base_tsc : 0;
+            uint64_t us = udiv64(since * 1000, khz, 0);
+            uint32_t sec = (uint32_t)udiv64(us, 1000000, &usec);
+            kprintf("[%5u.%06u] %-5s %.*s\n", sec, usec, level_names[rec.level], rec.len, rec.text);
+        } else {
+            kprintf("[%16llu] %-5s %.*s\n", rec.tsc, level_names[rec.level], rec.len, rec.text);
+        }
+    }
+}
+
+void klog_get_stats(klog_stats_t* out) {
+    uint32_t written = head;
+    out->written = written;
+    out->overwritten = written > KLOG_RECORDS ? written - KLOG_RECORDS : 0;
+}
@@ -0,0 +1,40 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include "kernel.h"
+
+/* Kernel log: a fixed ring of records, written without locks so any
+   context (IRQ handlers included) can log. Nothing is printed until
+   someone reads the ring with dmesg. */
+
+#define KLOG_ERR   0
+#define KLOG_WARN  1
+#define KLOG_INFO  2
+#define KLOG_DEBUG 3
+
+#define KLOG_RECORDS 512     // Power of two
+#define KLOG_RECORD_SIZE 128
+#define KLOG_TEXT_MAX (KLOG_RECORD_SIZE - 16)
+
+// Remembers the TSC and tick count used to turn timestamps into time
+void klog_init(void);
+
+void klog(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void kvlog(int level, const char* fmt, va_list ap);
+
+// Prints the records at or below max_level, oldest first
+void klog_dump(int max_level);
+
+// Parses "err", "warn", "info" or "debug", -1 otherwise
+int klog_parse_level(const char* name);
+
+typedef struct {
+    uint32_t written;      // Records ever logged
+    uint32_t overwritten;  // Dropped off the ring by newer records
+} klog_stats_t;
+
+void klog_get_stats(klog_stats_t* out);
+
+#endif
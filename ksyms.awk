@@ -0,0 +1,24 @@
+# ksyms.awk - Turns `nm -n` output into the symbol table perf looks up.
+# Only code symbols are kept, minus assembler-local labels.
+
+BEGIN { n = 0 }
+
+$2 ~ /^[Tt]$/ && $3 !~ /^\./ {
+    addr[n] = $1
+    name[n] = $3
+    n++
+}
+
+END {
+    print "/* Generated by ksyms.awk, do not edit */"
+    print ".section .rodata"
+    print ".align 4"
+    print ".global ksyms_count"
+    print "ksyms_count:"
+    print "    .long " n
+    print ".global ksyms"
+    print "ksyms:"
+    for (i = 0; i < n; i++) print "    .long 0x" addr[i] ", .Lname" i
+    for (i = 0; i < n; i++) print ".Lname" i ": .asciz \"" name[i] "\""
+    print ".section .note.GNU-stack, \"\", @progbits"
+}
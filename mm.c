@@ -0,0 +1,539 @@
+#include "mm.h"
+#include "paging.h"
+#include "kernel.h"
+#include "thread.h"
+
+/* --- PHYSICAL FRAME ALLOCATOR --- */
+
+// One bit per 4 KiB frame below 4 GiB, set when the frame is in use.
+// Everything starts reserved and only RAM reported as available by the
+// bootloader is released.
+#define PMM_WORDS (PMM_MAX_FRAMES / 32)
+
+static uint32_t pmm_bitmap[PMM_WORDS];
+static uint32_t pmm_words = 0;       // Words covering the highest usable frame
+static uint32_t pmm_hint = 0;        // No free frame lives below this word
+static uint32_t pmm_total = 0;
+static uint32_t pmm_free = 0;
+
+static pmm_region_t pmm_regions[PMM_MAX_REGIONS];
+static int pmm_region_count = 0;
+
+extern uint8_t _kernel_start[];
+extern uint8_t _kernel_end[];
+
+static void pmm_mark(uint32_t first, uint32_t count, int used) {
+    for (uint32_t f = first; f < first + count; f++) {
+        uint32_t bit = 1u << (f % 32);
+        if (used && !(pmm_bitmap[f / 32] & bit)) {
+            pmm_bitmap[f / 32] |= bit;
+            pmm_free--;
+        } else if (!used && (pmm_bitmap[f / 32] & bit)) {
+            pmm_bitmap[f / 32] &= ~bit;
+            pmm_free++;
+        }
+    }
+    if (!used && first / 32 < pmm_hint) pmm_hint = first / 32;
+}
+
+static void pmm_add_region(uint64_t base, uint64_t length) {
+    // Ignore memory we cannot address without PAE
+    if (base >= 0x100000000ULL) return;
+    if (base + length > 0x100000000ULL) length = 0x100000000ULL - base;
+
+    uint32_t first = (uint32_t)((base + PAGE_SIZE - 1) / PAGE_SIZE);
+    uint32_t last = (uint32_t)((base + length) / PAGE_SIZE);
+    if (last <= first) return;
+
+    if (pmm_region_count < PMM_MAX_REGIONS) {
+        pmm_regions[pmm_region_count].base = first * PAGE_SIZE;
+        pmm_regions[pmm_region_count].frames = last - first;
+        pmm_region_count++;
+    }
+
+    pmm_total += last - first;
+    pmm_mark(first, last - first, 0);
+    if ((last + 31) / 32 > pmm_words) pmm_words = (last + 31) / 32;
+}
+
+void pmm_reserve(uint32_t start, uint32_t end) {
+    uint32_t first = start / PAGE_SIZE;
+    uint32_t last = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (last > PMM_MAX_FRAMES) last = PMM_MAX_FRAMES;
+    if (last > first) pmm_mark(first, last - first, 1);
+}
+
+void pmm_init(multiboot_info_t* mbi) {
+    memset(pmm_bitmap, 0xFF, sizeof(pmm_bitmap));
+
+    if (mbi && (mbi->flags & MULTIBOOT_FLAG_MMAP)) {
+        uint32_t p = mbi->mmap_addr;
+        while (p < mbi->mmap_addr + mbi->mmap_length) {
+            multiboot_mmap_entry_t* e = (multiboot_mmap_entry_t*)p;
+            if (e->type == 1) pmm_add_region(e->base_addr, e->length);
+            p += e->size + 4;
+        }
+    } else if (mbi && (mbi->flags & MULTIBOOT_FLAG_MEM)) {
+        // No map, trust mem_upper (KiB above 1 MiB)
+        pmm_add_region(0x100000, (uint64_t)mbi->mem_upper * 1024);
+    } else {
+        // No information at all, assume the old fixed 32 MiB machine
+        pmm_add_region(0x100000, 31 * 1024 * 1024);
+    }
+
+    // Low memory holds the BIOS data, the IVT and our future trampolines
+    pmm_reserve(0, 0x100000);
+    pmm_reserve((uint32_t)_kernel_start, (uint32_t)_kernel_end);
+
+    if (mbi) {
+        pmm_reserve((uint32_t)mbi, (uint32_t)mbi + sizeof(multiboot_info_t));
+        if (mbi->flags & MULTIBOOT_FLAG_MMAP) {
+            pmm_reserve(mbi->mmap_addr, mbi->mmap_addr + mbi->mmap_length);
+        }
+        if (mbi->flags & MULTIBOOT_FLAG_CMDLINE) {
+            pmm_reserve(mbi->cmdline, mbi->cmdline + strlen((const char*)mbi->cmdline) + 1);
+        }
+        if (mbi->flags & MULTIBOOT_FLAG_MODS) {
+            multiboot_module_t* mods = (multiboot_module_t*)mbi->mods_addr;
+            pmm_reserve(mbi->mods_addr, mbi->mods_addr + mbi->mods_count * sizeof(multiboot_module_t));
+            for (uint32_t i = 0; i < mbi->mods_count; i++) {
+                pmm_reserve(mods[i].mod_start, mods[i].mod_end);
+                pmm_reserve(mods[i].string, mods[i].string + strlen((const char*)mods[i].string) + 1);
+            }
+        }
+    }
+}
+
+uint32_t pmm_alloc_frame(void) {
+    for (uint32_t w = pmm_hint; w < pmm_words; w++) {
+        uint32_t bits = pmm_bitmap[w];
+        if (bits == 0xFFFFFFFF) continue;
+        pmm_hint = w;
+        uint32_t frame = w * 32 + __builtin_ctz(~bits);
+        pmm_bitmap[w] |= 1u << (frame % 32);
+        pmm_free--;
+        return frame * PAGE_SIZE;
+    }
+    pmm_hint = pmm_words;
+    return 0; // Out of memory
+}
+
+uint32_t pmm_alloc_frames(uint32_t count) {
+    if (count == 1) return pmm_alloc_frame();
+
+    uint32_t run = 0;
+    uint32_t start = 0;
+    for (uint32_t w = pmm_hint; w < pmm_words; w++) {
+        uint32_t bits = pmm_bitmap[w];
+
+        // Skip whole words at once, most of the map is all-used or all-free
+        if (bits == 0xFFFFFFFF) {
+            run = 0;
+            continue;
+        }
+        if (bits == 0) {
+            if (!run) start = w * 32;
+            run += 32;
+        } else {
+            for (uint32_t b = 0; b < 32 && run < count; b++) {
+                if (bits & (1u << b)) {
+                    run = 0;
+                } else {
+                    if (!run) start = w * 32 + b;
+                    run++;
+                }
+            }
+        }
+
+        if (run >= count) {
+            pmm_mark(start, count, 1);
+            return start * PAGE_SIZE;
+        }
+    }
+    return 0;
+}
+
+void pmm_free_frames(uint32_t addr, uint32_t count) {
+    pmm_mark(addr / PAGE_SIZE, count, 0);
+}
+
+void pmm_free_frame(uint32_t addr) {
+    pmm_free_frames(addr, 1);
+}
+
+uint32_t pmm_free_count(void) {
+    return pmm_free;
+}
+
+uint32_t pmm_total_count(void) {
+    return pmm_total;
+}
+
+int pmm_get_regions(const pmm_region_t** out) {
+    *out = pmm_regions;
+    return pmm_region_count;
+}
+
+/* --- BOUNDARY TAG ALLOCATOR --- */
+
+// Every block carries the same tag at both ends, so kfree can find the
+// neighbour on either side in O(1). Free blocks additionally hold links
+// into a segregated free list (one bin per power of two).
+typedef struct {
+    uint32_t size;     // Whole block, tags included, multiple of 8
+    uint32_t is_free;
+} block_tag_t;
+
+typedef struct free_block {
+    block_tag_t tag;
+    struct free_block* prev;
+    struct free_block* next;
+} free_block_t;
+
+#define TAG_SIZE sizeof(block_tag_t)
+#define BLOCK_OVERHEAD (2 * TAG_SIZE)
+#define BLOCK_MIN 32
+#define BIN_MIN_SHIFT 5
+#define HEAP_BINS 24
+
+static uint8_t* heap_base = NULL;
+static uint8_t* heap_end = NULL;
+static free_block_t* bins[HEAP_BINS];
+static uint32_t bin_map = 0;  // Bit n set when bins[n] is non-empty
+
+static inline int bin_of(uint32_t size) {
+    int bin = (31 - __builtin_clz(size)) - BIN_MIN_SHIFT;
+    return bin < HEAP_BINS ? bin : HEAP_BINS - 1;
+}
+
+static inline block_tag_t* block_footer(void* block) {
+    return (block_tag_t*)((uint8_t*)block + ((block_tag_t*)block)->size - TAG_SIZE);
+}
+
+static inline void block_set(void* block, uint32_t size, uint32_t is_free) {
+    block_tag_t* header = (block_tag_t*)block;
+    header->size = size;
+    header->is_free = is_free;
+    *block_footer(block) = *header;
+}
+
+static void bin_insert(free_block_t* block) {
+    int bin = bin_of(block->tag.size);
+    block->prev = NULL;
+    block->next = bins[bin];
+    if (bins[bin]) bins[bin]->prev = block;
+    bins[bin] = block;
+    bin_map |= 1u << bin;
+}
+
+static void bin_remove(free_block_t* block) {
+    int bin = bin_of(block->tag.size);
+    if (block->prev) block->prev->next = block->next;
+    else bins[bin] = block->next;
+    if (block->next) block->next->prev = block->prev;
+    if (!bins[bin]) bin_map &= ~(1u << bin);
+}
+
+static void list_init(uint8_t* base, uint32_t size) {
+    heap_base = base;
+    heap_end = base + size;
+    block_set(heap_base, size, 1);
+    bin_insert((free_block_t*)heap_base);
+}
+
+static void* list_alloc(size_t size) {
+    // More than the heap holds, and the rounding below would wrap
+    if (size > (uint32_t)(heap_end - heap_base)) return NULL;
+
+    // Round up to 8 bytes and add room for both tags
+    uint32_t need = ((size + 7) & ~7u) + BLOCK_OVERHEAD;
+    if (need < BLOCK_MIN) need = BLOCK_MIN;
+
+    // First fit inside the starting bin, since it mixes sizes
+    int bin = bin_of(need);
+    free_block_t* block = bins[bin];
+    while (block && block->tag.size < need) {
+        block = block->next;
+    }
+
+    // Any block of a larger bin is big enough
+    if (!block) {
+        uint32_t mask = bin + 1 < HEAP_BINS ? bin_map & ~((2u << bin) - 1) : 0;
+        if (!mask) return NULL; // Out of memory
+        block = bins[__builtin_ctz(mask)];
+    }
+
+    bin_remove(block);
+    uint32_t total = block->tag.size;
+    if (total - need >= BLOCK_MIN) {
+        // Split, the tail stays free
+        free_block_t* rest = (free_block_t*)((uint8_t*)block + need);
+        block_set(rest, total - need, 1);
+        bin_insert(rest);
+        total = need;
+    }
+    block_set(block, total, 0);
+    return (uint8_t*)block + TAG_SIZE;
+}
+
+static void list_free(void* ptr) {
+    uint8_t* block = (uint8_t*)ptr - TAG_SIZE;
+    uint32_t size = ((block_tag_t*)block)->size;
+
+    // Merge with the following block
+    uint8_t* next = block + size;
+    if (next < heap_end && ((block_tag_t*)next)->is_free) {
+        bin_remove((free_block_t*)next);
+        size += ((block_tag_t*)next)->size;
+    }
+
+    // Merge with the preceding block, found through its footer
+    if (block > heap_base) {
+        block_tag_t* prev_footer = (block_tag_t*)(block - TAG_SIZE);
+        if (prev_footer->is_free) {
+            block -= prev_footer->size;
+            bin_remove((free_block_t*)block);
+            size += prev_footer->size;
+        }
+    }
+
+    block_set(block, size, 1);
+    bin_insert((free_block_t*)block);
+}
+
+void heap_get_stats(heap_stats_t* out) {
+    memset(out, 0, sizeof(*out));
+    if (!heap_base) return;
+
+    for (uint8_t* p = heap_base; p < heap_end; p += ((block_tag_t*)p)->size) {
+        block_tag_t* tag = (block_tag_t*)p;
+        out->total += tag->size;
+        if (tag->is_free) {
+            out->free += tag->size;
+            out->free_blocks++;
+            if (tag->size > out->largest_free) out->largest_free = tag->size;
+        } else {
+            out->used_blocks++;
+        }
+    }
+
+    // Share of free memory not usable by a single allocation
+    if (out->free) {
+        uint32_t free_kb = out->free >> 10;
+        uint32_t largest_kb = out->largest_free >> 10;
+        if (free_kb) {
+            out->fragmentation = 100 - (largest_kb * 100) / free_kb;
+        } else {
+            out->fragmentation = 100 - (out->largest_free * 100) / out->free;
+        }
+    }
+}
+
+void heap_dump(void) {
+    if (!heap_base) {
+        terminal_writestring("Heap not initialized.\n");
+        return;
+    }
+
+    terminal_writestring("Heap Status:\n");
+    for (uint8_t* p = heap_base; p < heap_end; p += ((block_tag_t*)p)->size) {
+        block_tag_t* tag = (block_tag_t*)p;
+        kprintf("  Addr: 0x%08X Size: 0x%08X Free: ", (uint32_t)p, tag->size);
+        if (tag->is_free) {
+            terminal_write_color("YES", VGA_COLOR_LIGHT_GREEN);
+        } else {
+            terminal_write_color("NO", VGA_COLOR_LIGHT_RED);
+        }
+        terminal_writestring("\n");
+    }
+}
+
+/* --- SLAB ALLOCATOR --- */
+
+// One descriptor per arena page, kept out of line so that objects can use
+// the whole page and kfree can find the owner with a shift.
+typedef struct slab_page {
+    uint8_t cls;             // Size class, SLAB_NO_CLASS when the page is unused
+    uint16_t in_use;
+    void* freelist;          // Free objects, linked through their first word
+    struct slab_page* prev;  // Partial list (or empty page list) links
+    struct slab_page* next;
+} slab_page_t;
+
+#define SLAB_NO_CLASS 0xFF
+
+typedef struct {
+    slab_page_t* partial;    // Pages with at least one free object
+    uint32_t pages;
+    uint32_t in_use;
+} slab_class_t;
+
+static slab_page_t slab_pages[SLAB_ARENA_PAGES];
+static slab_class_t slab_classes[SLAB_CLASSES];
+static uint8_t* slab_base = NULL;
+static slab_page_t* slab_empty = NULL;  // Released pages, ready for any class
+static uint32_t slab_next_page = 0;     // Arena pages never handed out yet
+
+static inline uint8_t* slab_page_addr(slab_page_t* page) {
+    return slab_base + (uint32_t)(page - slab_pages) * SLAB_PAGE_SIZE;
+}
+
+static inline int slab_owns(void* ptr) {
+    return (uint8_t*)ptr >= slab_base && (uint8_t*)ptr < slab_base + SLAB_ARENA_SIZE;
+}
+
+static inline int slab_class_of(size_t size) {
+    if (size <= (1u << SLAB_MIN_SHIFT)) return 0;
+    // Round up to the next power of two
+    return (32 - __builtin_clz(size - 1)) - SLAB_MIN_SHIFT;
+}
+
+static void slab_list_push(slab_page_t** list, slab_page_t* page) {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list) (*list)->prev = page;
+    *list = page;
+}
+
+static void slab_list_remove(slab_page_t** list, slab_page_t* page) {
+    if (page->prev) page->prev->next = page->next;
+    else *list = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->prev = page->next = NULL;
+}
+
+static slab_page_t* slab_grow(int cls) {
+    slab_page_t* page;
+    if (slab_empty) {
+        page = slab_empty;
+        slab_list_remove(&slab_empty, page);
+    } else if (slab_next_page < SLAB_ARENA_PAGES) {
+        page = &slab_pages[slab_next_page++];
+    } else {
+        return NULL; // Arena exhausted
+    }
+
+    // Thread every object of the page onto its free list
+    uint32_t obj_size = 1u << (cls + SLAB_MIN_SHIFT);
+    uint8_t* base = slab_page_addr(page);
+    void* list = NULL;
+    for (uint32_t off = SLAB_PAGE_SIZE; off >= obj_size; off -= obj_size) {
+        void** obj = (void**)(base + off - obj_size);
+        *obj = list;
+        list = obj;
+    }
+
+    page->cls = (uint8_t)cls;
+    page->in_use = 0;
+    page->freelist = list;
+    slab_classes[cls].pages++;
+    slab_list_push(&slab_classes[cls].partial, page);
+    return page;
+}
+
+static void* slab_alloc(size_t size) {
+    int cls = slab_class_of(size);
+    slab_class_t* c = &slab_classes[cls];
+
+    slab_page_t* page = c->partial;
+    if (!page) {
+        page = slab_grow(cls);
+        if (!page) return NULL;
+    }
+
+    void** obj = (void**)page->freelist;
+    page->freelist = *obj;
+    page->in_use++;
+    c->in_use++;
+    if (!page->freelist) {
+        slab_list_remove(&c->partial, page); // Page is now full
+    }
+    return obj;
+}
+
+static void slab_free(void* ptr) {
+    slab_page_t* page = &slab_pages[((uint8_t*)ptr - slab_base) / SLAB_PAGE_SIZE];
+    if (page->cls == SLAB_NO_CLASS) return; // Not a live slab object
+    slab_class_t* c = &slab_classes[page->cls];
+
+    int was_full = (page->freelist == NULL);
+    *(void**)ptr = page->freelist;
+    page->freelist = ptr;
+    page->in_use--;
+    c->in_use--;
+
+    if (was_full) {
+        slab_list_push(&c->partial, page);
+    }
+
+    // Give fully free pages back to the arena, but keep one around per
+    // class so an alloc/free pair on an empty class doesn't thrash.
+    if (page->in_use == 0 && (page->prev || page->next)) {
+        slab_list_remove(&c->partial, page);
+        c->pages--;
+        page->cls = SLAB_NO_CLASS;
+        page->freelist = NULL;
+        slab_list_push(&slab_empty, page);
+    }
+}
+
+void slab_get_stats(int cls, slab_class_stats_t* out) {
+    uint32_t obj_size = 1u << (cls + SLAB_MIN_SHIFT);
+    out->object_size = obj_size;
+    out->pages = slab_classes[cls].pages;
+    out->objects_in_use = slab_classes[cls].in_use;
+    out->objects_total = slab_classes[cls].pages * (SLAB_PAGE_SIZE / obj_size);
+}
+
+uint32_t slab_free_pages(void) {
+    uint32_t count = SLAB_ARENA_PAGES - slab_next_page;
+    for (slab_page_t* p = slab_empty; p; p = p->next) count++;
+    return count;
+}
+
+/* --- KMALLOC / KFREE --- */
+
+void heap_init(void) {
+    // Only reserve address space here. Frames are committed one page at a
+    // time by the page-fault handler when the heap first touches them.
+    uint32_t size = pmm_free_count();
+    if (size > HEAP_VIRT_MAX / PAGE_SIZE) size = HEAP_VIRT_MAX / PAGE_SIZE;
+    size *= PAGE_SIZE;
+    if (size < SLAB_ARENA_SIZE + HEAP_MIN_LIST_SIZE) {
+        panic("Not enough memory for the kernel heap.");
+    }
+    paging_reserve_demand_zero(HEAP_VIRT_BASE, HEAP_VIRT_BASE + size);
+
+    for (uint32_t i = 0; i < SLAB_ARENA_PAGES; i++) {
+        slab_pages[i].cls = SLAB_NO_CLASS;
+    }
+    slab_base = (uint8_t*)HEAP_VIRT_BASE;
+    list_init(slab_base + SLAB_ARENA_SIZE, size - SLAB_ARENA_SIZE);
+}
+
+// Threads share the heap, so neither allocator may be preempted midway
+void* kmalloc(size_t size) {
+    if (size == 0 || !heap_base) return NULL;
+
+    void* ptr = NULL;
+    preempt_disable();
+    if (size <= (1u << SLAB_MAX_SHIFT)) {
+        ptr = slab_alloc(size);
+        // NULL when the arena is full, fall back to the list allocator
+    }
+    if (!ptr) ptr = list_alloc(size);
+    preempt_enable();
+    return ptr;
+}
+
+void kfree(void* ptr) {
+    if (!ptr) return;
+
+    preempt_disable();
+    if (slab_owns(ptr)) {
+        slab_free(ptr);
+    } else {
+        list_free(ptr);
+    }
+    preempt_enable();
+}
@@ -0,0 +1,69 @@
+#ifndef MM_H
+#define MM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kernel.h"
+
+#define PAGE_SIZE 4096
+
+/* Physical frame allocator */
+#define PMM_MAX_FRAMES (1024 * 1024)  // 4 GiB worth of frames
+#define PMM_MAX_REGIONS 32
+
+typedef struct {
+    uint32_t base;
+    uint32_t frames;
+} pmm_region_t;
+
+void pmm_init(multiboot_info_t* mbi);
+void pmm_reserve(uint32_t start, uint32_t end);
+uint32_t pmm_alloc_frame(void);                // Returns 0 when out of memory
+uint32_t pmm_alloc_frames(uint32_t count);     // Physically contiguous
+void pmm_free_frame(uint32_t addr);
+void pmm_free_frames(uint32_t addr, uint32_t count);
+uint32_t pmm_free_count(void);
+uint32_t pmm_total_count(void);
+int pmm_get_regions(const pmm_region_t** out);
+
+/* Heap, a demand-zero virtual range sized from the frames left after pmm_init */
+#define HEAP_VIRT_BASE 0xD0000000
+#define HEAP_VIRT_MAX (256 * 1024 * 1024)
+#define HEAP_MIN_LIST_SIZE (1024 * 1024)
+
+void heap_init(void);
+
+/* Slab layer (small size classes, carved from the start of the heap) */
+#define SLAB_PAGE_SIZE PAGE_SIZE
+#define SLAB_MIN_SHIFT 4   // 16 bytes
+#define SLAB_MAX_SHIFT 11  // 2048 bytes
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_ARENA_SIZE (2 * 1024 * 1024)
+#define SLAB_ARENA_PAGES (SLAB_ARENA_SIZE / SLAB_PAGE_SIZE)
+
+typedef struct {
+    uint32_t object_size;
+    uint32_t pages;          // Slab pages currently owned by the class
+    uint32_t objects_in_use;
+    uint32_t objects_total;  // Capacity of the owned pages
+} slab_class_stats_t;
+
+void slab_get_stats(int cls, slab_class_stats_t* out);
+uint32_t slab_free_pages(void);
+
+/* Boundary tag heap (everything the slab layer doesn't serve) */
+typedef struct {
+    uint32_t total;
+    uint32_t free;
+    uint32_t free_blocks;
+    uint32_t used_blocks;
+    uint32_t largest_free;
+    uint32_t fragmentation;  // Percent of free memory outside the largest block
+} heap_stats_t;
+
+void heap_get_stats(heap_stats_t* out);
+
+/* Dumps the heap blocks to the terminal */
+void heap_dump(void);
+
+#endif
@@ -0,0 +1,276 @@
+#include "paging.h"
+#include "mm.h"
+#include "kernel.h"
+#include "cpu.h"
+
+/* --- PAGE DIRECTORY --- */
+
+static uint32_t page_directory[1024] __attribute__((aligned(4096)));
+static int paging_on = 0;
+static int pse_supported = 0;
+static paging_stats_t stats;
+
+static inline uint32_t pd_index(uint32_t virt) { return virt >> 22; }
+static inline uint32_t pt_index(uint32_t virt) { return (virt >> 12) & 0x3FF; }
+
+// Before paging is enabled the tables are reached through their physical
+// address, afterwards through the recursive slot.
+static inline uint32_t* page_table(uint32_t pdi) {
+    if (paging_on) {
+        return (uint32_t*)(PAGE_TABLES_BASE + pdi * PAGE_SIZE);
+    }
+    return (uint32_t*)(page_directory[pdi] & ~0xFFF);
+}
+
+void tlb_flush_page(uint32_t virt) {
+    if (!paging_on) return;
+    asm volatile ( "invlpg (%0)" : : "r"(virt) : "memory" );
+    stats.page_flushes++;
+}
+
+void tlb_flush_all(void) {
+    if (!paging_on) return;
+    uint32_t cr3;
+    asm volatile ( "mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory" );
+    stats.full_flushes++;
+}
+
+static uint32_t* page_table_get(uint32_t pdi, uint32_t flags) {
+    uint32_t pde = page_directory[pdi];
+    if (pde & PAGE_PRESENT) {
+        if (pde & PAGE_LARGE) return NULL;
+        return page_table(pdi);
+    }
+
+    uint32_t frame = pmm_alloc_frame();
+    if (!frame) return NULL;
+    page_directory[pdi] = frame | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+    stats.page_tables++;
+
+    uint32_t* table = page_table(pdi);
+    tlb_flush_page((uint32_t)table);
+    memset(table, 0, PAGE_SIZE);
+    return table;
+}
+
+int map_page(uint32_t virt, uint32_t phys, uint32_t flags) {
+    uint32_t* table = page_table_get(pd_index(virt), flags);
+    if (!table) return -1;
+
+    uint32_t old = table[pt_index(virt)];
+    table[pt_index(virt)] = (phys & ~0xFFF) | (flags & 0xFFF) | PAGE_PRESENT;
+    if (old & PAGE_PRESENT) {
+        tlb_flush_page(virt);
+    } else {
+        stats.small_pages++;
+    }
+    return 0;
+}
+
+void unmap_page(uint32_t virt) {
+    uint32_t pde = page_directory[pd_index(virt)];
+    if (!(pde & PAGE_PRESENT) || (pde & PAGE_LARGE)) return;
+
+    uint32_t* table = page_table(pd_index(virt));
+    if (table[pt_index(virt)] & PAGE_PRESENT) {
+        table[pt_index(virt)] = 0;
+        stats.small_pages--;
+        tlb_flush_page(virt);
+    }
+}
+
+int virt_to_phys(uint32_t virt, uint32_t* phys) {
+    uint32_t pde = page_directory[pd_index(virt)];
+    if (!(pde & PAGE_PRESENT)) return -1;
+    if (pde & PAGE_LARGE) {
+        *phys = (pde & ~(LARGE_PAGE_SIZE - 1)) | (virt & (LARGE_PAGE_SIZE - 1));
+        return 0;
+    }
+
+    uint32_t pte = page_table(pd_index(virt))[pt_index(virt)];
+    if (!(pte & PAGE_PRESENT)) return -1;
+    *phys = (pte & ~0xFFF) | (virt & 0xFFF);
+    return 0;
+}
+
+void paging_identity_map(uint32_t start, uint32_t end, uint32_t flags) {
+    uint32_t addr = start & ~0xFFF;
+    while (addr < end && addr >= (start & ~0xFFF)) {
+        uint32_t pdi = pd_index(addr);
+
+        // Whole 4 MiB slot still empty: one large page covers it
+        if (pse_supported && !(addr & (LARGE_PAGE_SIZE - 1)) && end - addr >= LARGE_PAGE_SIZE
+                && !(page_directory[pdi] & PAGE_PRESENT)) {
+            page_directory[pdi] = addr | flags | PAGE_PRESENT | PAGE_LARGE;
+            stats.large_pages++;
+            addr += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        if (page_directory[pdi] & PAGE_LARGE) {
+            addr = (addr & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        uint32_t phys;
+        if (virt_to_phys(addr, &phys) != 0) {
+            map_page(addr, addr, flags);
+        }
+        addr += PAGE_SIZE;
+    }
+}
+
+/* --- DEMAND ZERO --- */
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} dz_region_t;
+
+#define DZ_MAX_REGIONS 8
+
+static dz_region_t dz_regions[DZ_MAX_REGIONS];
+static int dz_count = 0;
+
+void paging_reserve_demand_zero(uint32_t start, uint32_t end) {
+    if (dz_count == DZ_MAX_REGIONS) {
+        panic("Too many demand-zero regions.");
+    }
+    dz_regions[dz_count].start = start & ~0xFFF;
+    dz_regions[dz_count].end = (end + PAGE_SIZE - 1) & ~0xFFF;
+    dz_count++;
+}
+
+static void page_fault_handler(registers_t* regs) {
+    uint32_t addr = read_cr2();
+
+    // Only not-present faults inside a reserved region are ours to fix
+    if (!(regs->err_code & 0x1)) {
+        for (int i = 0; i < dz_count; i++) {
+            if (addr < dz_regions[i].start || addr >= dz_regions[i].end) continue;
+
+            stats.demand_faults++;
+            uint32_t frame = pmm_alloc_frame();
+            if (!frame || map_page(addr & ~0xFFF, frame, PAGE_WRITE) != 0) {
+                panic_with_regs("Out of memory committing a demand-zero page", regs);
+            }
+            memset((void*)(addr & ~0xFFF), 0, PAGE_SIZE);
+            stats.pages_committed++;
+            return;
+        }
+    }
+
+    panic_with_regs("Page Fault", regs);
+}
+
+void paging_init(void) {
+    pse_supported = cpu_features.pse;
+
+    memset(page_directory, 0, sizeof(page_directory));
+    page_directory[1023] = (uint32_t)page_directory | PAGE_PRESENT | PAGE_WRITE;
+
+    // Low memory and the kernel image with 4 KiB pages, leaving page 0
+    // unmapped so NULL dereferences fault
+    extern uint8_t _kernel_end[];
+    uint32_t kernel_end = ((uint32_t)_kernel_end + PAGE_SIZE - 1) & ~0xFFF;
+    for (uint32_t addr = PAGE_SIZE; addr < kernel_end || addr < LARGE_PAGE_SIZE; addr += PAGE_SIZE) {
+        map_page(addr, addr, PAGE_WRITE);
+    }
+
+    // Multiboot structures and modules, wherever the bootloader left them
+    if (mb_info) {
+        paging_identity_map((uint32_t)mb_info, (uint32_t)mb_info + sizeof(multiboot_info_t), PAGE_WRITE);
+        if (mb_info->flags & MULTIBOOT_FLAG_MMAP) {
+            paging_identity_map(mb_info->mmap_addr, mb_info->mmap_addr + mb_info->mmap_length, PAGE_WRITE);
+        }
+        if (mb_info->flags & MULTIBOOT_FLAG_CMDLINE) {
+            paging_identity_map(mb_info->cmdline, mb_info->cmdline + strlen((const char*)mb_info->cmdline) + 1, PAGE_WRITE);
+        }
+        if (mb_info->flags & MULTIBOOT_FLAG_MODS) {
+            multiboot_module_t* mods = (multiboot_module_t*)mb_info->mods_addr;
+            paging_identity_map(mb_info->mods_addr, mb_info->mods_addr + mb_info->mods_count * sizeof(multiboot_module_t), PAGE_WRITE);
+            for (uint32_t i = 0; i < mb_info->mods_count; i++) {
+                paging_identity_map(mods[i].mod_start, mods[i].mod_end, PAGE_WRITE);
+                paging_identity_map(mods[i].string, mods[i].string + strlen((const char*)mods[i].string) + 1, PAGE_WRITE);
+            }
+        }
+    }
+
+    // VGA text memory lives in the low 4 MiB already mapped above
+
+    uint32_t cr0, cr4;
+    if (pse_supported) {
+        asm volatile ( "mov %%cr4, %0" : "=r"(cr4) );
+        cr4 |= 1 << 4; // PSE
+        asm volatile ( "mov %0, %%cr4" : : "r"(cr4) );
+    }
+    register_interrupt_handler(14, page_fault_handler);
+    asm volatile ( "mov %0, %%cr3" : : "r"(page_directory) );
+    asm volatile ( "mov %%cr0, %0" : "=r"(cr0) );
+    cr0 |= (1u << 31) | (1 << 16); // PG, WP
+    asm volatile ( "mov %0, %%cr0" : : "r"(cr0) );
+    paging_on = 1;
+}
+
+void paging_get_stats(paging_stats_t* out) {
+    *out = stats;
+}
+
+/* --- DUMP --- */
+
+static void print_range(uint32_t start, uint32_t end, uint32_t phys, uint32_t entry, int large) {
+    kprintf("  0x%08X-0x%08X -> 0x%08X %s %s%s\n", start, end - 1, phys,
+            large ? "4M" : "4K", (entry & PAGE_WRITE) ? "RW" : "RO",
+            (entry & PAGE_PCD) ? " UC" : "");
+}
+
+void paging_dump(void) {
+    if (!paging_on) {
+        terminal_writestring("Paging disabled.\n");
+        return;
+    }
+
+    // Coalesce runs that are contiguous in both spaces and share flags
+    uint32_t run_start = 0, run_end = 0, run_phys = 0, run_entry = 0;
+    int run_large = 0, in_run = 0;
+
+    for (uint32_t pdi = 0; pdi < 1023; pdi++) {
+        uint32_t pde = page_directory[pdi];
+        if (!(pde & PAGE_PRESENT)) {
+            if (in_run) print_range(run_start, run_end, run_phys, run_entry, run_large);
+            in_run = 0;
+            continue;
+        }
+
+        uint32_t count = (pde & PAGE_LARGE) ? 1 : 1024;
+        uint32_t* table = (pde & PAGE_LARGE) ? NULL : page_table(pdi);
+        for (uint32_t pti = 0; pti < count; pti++) {
+            uint32_t entry = table ? table[pti] : pde;
+            uint32_t virt = (pdi << 22) | (pti << 12);
+            uint32_t size = table ? PAGE_SIZE : LARGE_PAGE_SIZE;
+            int large = !table;
+
+            if (!(entry & PAGE_PRESENT)) {
+                if (in_run) print_range(run_start, run_end, run_phys, run_entry, run_large);
+                in_run = 0;
+                continue;
+            }
+
+            uint32_t phys = entry & (large ? ~(uint32_t)(LARGE_PAGE_SIZE - 1) : ~0xFFFu);
+            if (in_run && virt == run_end && phys == run_phys + (run_end - run_start)
+                    && large == run_large && (entry & 0x1F) == (run_entry & 0x1F)) {
+                run_end += size;
+                continue;
+            }
+
+            if (in_run) print_range(run_start, run_end, run_phys, run_entry, run_large);
+            run_start = virt;
+            run_end = virt + size;
+            run_phys = phys;
+            run_entry = entry;
+            run_large = large;
+            in_run = 1;
+        }
+    }
+    if (in_run) print_range(run_start, run_end, run_phys, run_entry, run_large);
+}
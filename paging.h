@@ -0,0 +1,56 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+/* Page directory / table entry flags */
+#define PAGE_PRESENT  0x001
+#define PAGE_WRITE    0x002
+#define PAGE_USER     0x004
+#define PAGE_PWT      0x008
+#define PAGE_PCD      0x010  // Cache disable, for MMIO
+#define PAGE_ACCESSED 0x020
+#define PAGE_DIRTY    0x040
+#define PAGE_LARGE    0x080  // PDE only: 4 MiB page (needs PSE)
+
+#define LARGE_PAGE_SIZE 0x400000
+
+// The last directory slot maps the directory itself, so every page table
+// is reachable at PAGE_TABLES_BASE + index * 4 KiB once paging is on.
+#define PAGE_TABLES_BASE 0xFFC00000
+
+void paging_init(void);
+
+// 4 KiB mappings. map_page returns -1 when no page table could be allocated
+// or the range is already covered by a 4 MiB page.
+int map_page(uint32_t virt, uint32_t phys, uint32_t flags);
+void unmap_page(uint32_t virt);
+int virt_to_phys(uint32_t virt, uint32_t* phys);
+
+// Identity maps [start, end), using 4 MiB pages for aligned chunks when the
+// CPU supports PSE. Already mapped pages are left alone.
+void paging_identity_map(uint32_t start, uint32_t end, uint32_t flags);
+
+// Pages in [start, end) get a zeroed frame on first touch
+void paging_reserve_demand_zero(uint32_t start, uint32_t end);
+
+void tlb_flush_page(uint32_t virt);
+void tlb_flush_all(void);
+
+typedef struct {
+    uint32_t large_pages;
+    uint32_t small_pages;
+    uint32_t page_tables;
+    uint32_t page_flushes;  // invlpg
+    uint32_t full_flushes;  // CR3 reloads
+    uint32_t demand_faults;
+    uint32_t pages_committed;
+} paging_stats_t;
+
+void paging_get_stats(paging_stats_t* out);
+
+/* Prints the active mappings as contiguous ranges */
+void paging_dump(void);
+
+#endif
@@ -0,0 +1,202 @@
+#include "perf.h"
+#include "cpu.h"
+#include "clock.h"
+#include "timer.h"
+#include "serial.h"
+#include "klog.h"
+#include "mm.h"
+#include "kernel.h"
+
+/* --- SYMBOLS --- */
+
+typedef struct {
+    uint32_t addr;
+    const char* name;
+} ksym_t;
+
+// From ksyms.s, generated at build time. Weak so the first link, whose
+// addresses the table is made from, goes through without it.
+extern const ksym_t ksyms[] __attribute__((weak));
+extern const uint32_t ksyms_count __attribute__((weak));
+
+static uint32_t ksym_total(void) {
+    return &ksyms_count ? ksyms_count : 0;
+}
+
+// Index of the last symbol at or below addr, -1 if there is none
+static int ksym_index(uint32_t addr) {
+    uint32_t n = ksym_total();
+    if (!n || addr < ksyms[0].addr) return -1;
+    uint32_t lo = 0, hi = n;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (ksyms[mid].addr <= addr) lo = mid;
+        else hi = mid;
+    }
+    return (int)lo;
+}
+
+const char* ksym_lookup(uint32_t addr, uint32_t* offset) {
+    int i = ksym_index(addr);
+    if (i < 0) return 0;
+    if (offset) *offset = addr - ksyms[i].addr;
+    return ksyms[i].name;
+}
+
+uint32_t ksym_find(const char* name) {
+    for (uint32_t i = 0; i < ksym_total(); i++) {
+        if (strcmp(ksyms[i].name, name) == 0) return ksyms[i].addr;
+    }
+    return 0;
+}
+
+/* --- SAMPLING --- */
+
+static uint32_t* samples;
+static volatile uint32_t sample_count;
+static uint32_t dropped;
+static uint32_t rate_hz;
+static uint32_t period_ns;
+static uint64_t next_deadline;
+static uint64_t start_ns, stop_ns;
+static volatile int running;
+static ktimer_t* sample_timer;
+
+static void perf_sample(void* arg) {
+    (void)arg;
+    sample_timer = 0;
+    if (!running) return;
+
+    registers_t* r = cpu_self()->irq_regs;
+    if (sample_count < PERF_MAX_SAMPLES) {
+        samples[sample_count++] = r ? r->eip : 0;
+    } else {
+        dropped++;
+    }
+
+    // Stay on the original grid unless a whole period was missed
+    uint64_t now = ktime_get_ns();
+    next_deadline += period_ns;
+    if (next_deadline <= now) next_deadline = now + period_ns;
+    sample_timer = timer_add(next_deadline, perf_sample, 0);
+}
+
+int perf_start(uint32_t hz) {
+    if (!timer_tickless()) {
+        terminal_writestring("perf: needs the tickless timer\n");
+        return -1;
+    }
+    if (hz == 0) hz = PERF_DEFAULT_HZ;
+    if (hz > PERF_MAX_HZ) hz = PERF_MAX_HZ;
+
+    perf_stop();
+    if (!samples) {
+        samples = kmalloc(PERF_MAX_SAMPLES * sizeof(uint32_t));
+        if (!samples) {
+            terminal_writestring("perf: out of memory for the sample buffer\n");
+            return -1;
+        }
+    }
+
+    uint32_t flags = irq_save();
+    sample_count = 0;
+    dropped = 0;
+    rate_hz = hz;
+    period_ns = 1000000000u / hz;
+    start_ns = ktime_get_ns();
+    next_deadline = start_ns + period_ns;
+    running = 1;
+    sample_timer = timer_add(next_deadline, perf_sample, 0);
+    if (!sample_timer) running = 0;
+    irq_restore(flags);
+
+    if (!running) {
+        terminal_writestring("perf: no free timer\n");
+        return -1;
+    }
+    klog(KLOG_INFO, "perf: sampling at %u Hz", hz);
+    return 0;
+}
+
+void perf_stop(void) {
+    uint32_t flags = irq_save();
+    if (running) {
+        running = 0;
+        stop_ns = ktime_get_ns();
+        if (sample_timer) timer_cancel(sample_timer);
+        sample_timer = 0;
+    }
+    irq_restore(flags);
+}
+
+int perf_running(void) {
+    return running;
+}
+
+/* --- REPORTS --- */
+
+void perf_report(int top) {
+    uint32_t n = sample_count;
+    if (!n) {
+        terminal_writestring("No samples. Start with 'perf start [hz]' or 'perf record <command>'.\n");
+        return;
+    }
+    uint32_t nsyms = ksym_total();
+    if (!nsyms) {
+        terminal_writestring("No symbol table linked in, use 'perf raw'.\n");
+        return;
+    }
+
+    // One extra slot for samples outside the code
+    uint32_t* hits = kmalloc((nsyms + 1) * sizeof(uint32_t));
+    if (!hits) {
+        terminal_writestring("Out of memory.\n");
+        return;
+    }
+    memset(hits, 0, (nsyms + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) {
+        int s = ksym_index(samples[i]);
+        hits[s < 0 ? nsyms : (uint32_t)s]++;
+    }
+
+    uint64_t end = running ? ktime_get_ns() : stop_ns;
+    kprintf("%u samples at %u Hz over %u ms%s", n, rate_hz,
+            (uint32_t)udiv64(end - start_ns, 1000000, 0), running ? " (still running)" : "");
+    if (dropped) kprintf(", %u dropped (buffer full)", dropped);
+    terminal_writestring("\n  samples      %  function\n");
+
+    // Repeatedly pick the largest, the table is small and top is short
+    for (int row = 0; row < top; row++) {
+        uint32_t best = 0, best_hits = 0;
+        for (uint32_t s = 0; s <= nsyms; s++) {
+            if (hits[s] > best_hits) {
+                best_hits = hits[s];
+                best = s;
+            }
+        }
+        if (!best_hits) break;
+        uint32_t pct = (uint32_t)udiv64((uint64_t)best_hits * 10000, n, 0);
+        kprintf("  %7u  %2u.%02u  %s\n", best_hits, pct / 100, pct % 100,
+                best == nsyms ? "[outside kernel text]" : ksyms[best].name);
+        hits[best] = 0;
+    }
+    kfree(hits);
+}
+
+void perf_dump_raw(void) {
+    uint32_t n = sample_count;
+    if (!serial_present()) {
+        terminal_writestring("No serial port.\n");
+        return;
+    }
+
+    char line[32];
+    int len = ksnprintf(line, sizeof(line), "# perf %u samples %u Hz\n", n, rate_hz);
+    serial_write(line, len);
+    for (uint32_t i = 0; i < n; i++) {
+        len = ksnprintf(line, sizeof(line), "%08x\n", samples[i]);
+        serial_write(line, len);
+    }
+    serial_write("# end\n", 6);
+    kprintf("%u samples written to the serial port.\n", n);
+}
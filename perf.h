@@ -0,0 +1,34 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+/* Sampling profiler. A wheel timer fires at the sampling rate, which
+   runs the one-shot clockevent (PIT or local APIC timer) that fast, and
+   records the EIP its interrupt landed on. Code that runs with interrupts
+   off is charged to wherever it turns them back on. */
+
+#define PERF_MAX_SAMPLES 65536
+#define PERF_DEFAULT_HZ 1000
+#define PERF_MAX_HZ 20000
+
+// Starts a new profile, dropping the previous samples. 0 on success,
+// -1 without the tickless timer or the memory for the buffer.
+int perf_start(uint32_t hz);
+void perf_stop(void);
+int perf_running(void);
+
+// The functions with the most samples, resolved through the symbol table
+// the Makefile links in (ksyms.awk)
+void perf_report(int top);
+
+// Every sample as a hex EIP per line on the serial port, for tools on the
+// host (addr2line -f -e excien.bin)
+void perf_dump_raw(void);
+
+// Function containing addr and its offset, NULL when it's outside the code
+const char* ksym_lookup(uint32_t addr, uint32_t* offset);
+uint32_t ksym_find(const char* name);  // 0 if there is no such function
+
+#endif
@@ -0,0 +1,242 @@
+#include <stdarg.h>
+#include "kernel.h"
+
+/* --- INTEGER CONVERSION --- */
+
+// Two decimal digits per lookup, so a 32-bit value needs at most five
+// divisions by 100, which the compiler turns into multiplies
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+// The converters write backwards from `end` and return the first digit
+static char* fmt_dec32(char* end, uint32_t n) {
+    char* p = end;
+    while (n >= 100) {
+        uint32_t q = n / 100;
+        const char* pair = &digit_pairs[(n - q * 100) * 2];
+        p -= 2;
+        p[0] = pair[0];
+        p[1] = pair[1];
+        n = q;
+    }
+    if (n >= 10) {
+        p -= 2;
+        p[0] = digit_pairs[n * 2];
+        p[1] = digit_pairs[n * 2 + 1];
+    } else {
+        *--p = '0' + n;
+    }
+    return p;
+}
+
+static char* fmt_dec64(char* end, uint64_t n) {
+    // Nine digit chunks, one 64/32 division each
+    while (n >> 32) {
+        uint32_t chunk;
+        n = udiv64(n, 1000000000, &chunk);
+        char* p = fmt_dec32(end, chunk);
+        end -= 9;
+        while (p > end) *--p = '0';
+    }
+    return fmt_dec32(end, (uint32_t)n);
+}
+
+static char* fmt_hex(char* end, uint64_t n, const char* digits) {
+    char* p = end;
+    uint32_t lo = (uint32_t)n, hi = (uint32_t)(n >> 32);
+    if (hi) {
+        for (int i = 0; i < 8; i++, lo >>= 4) *--p = digits[lo & 0xF];
+        lo = hi;
+    }
+    do {
+        *--p = digits[lo & 0xF];
+        lo >>= 4;
+    } while (lo);
+    return p;
+}
+
+/* --- FORMATTING --- */
+
+typedef struct {
+    char* buf;
+    size_t cap;  // Characters that fit, not counting the terminator
+    size_t len;  // Characters produced, may exceed cap
+} fmt_out_t;
+
+static void out_write(fmt_out_t* o, const char* s, size_t n) {
+    if (o->len < o->cap) {
+        size_t room = o->cap - o->len;
+        memcpy(o->buf + o->len, s, n < room ? n : room);
+    }
+    o->len += n;
+}
+
+static void out_fill(fmt_out_t* o, char c, size_t n) {
+    if (o->len < o->cap) {
+        size_t room = o->cap - o->len;
+        memset(o->buf + o->len, c, n < room ? n : room);
+    }
+    o->len += n;
+}
+
+// One field: sign or prefix, then padding, then the digits or text
+static void out_field(fmt_out_t* o, const char* prefix, size_t prefix_len,
+                      const char* body, size_t body_len, size_t width, int left, int zero) {
+    size_t total = prefix_len + body_len;
+    size_t pad = width > total ? width - total : 0;
+
+    if (!left && !zero) out_fill(o, ' ', pad);
+    out_write(o, prefix, prefix_len);
+    if (!left && zero) out_fill(o, '0', pad);
+    out_write(o, body, body_len);
+    if (left) out_fill(o, ' ', pad);
+}
+
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list ap) {
+    fmt_out_t o = { buf, size ? size - 1 : 0, 0 };
+    char num[24];
+    char* num_end = num + sizeof(num);
+
+    while (*fmt) {
+        // Literal run up to the next conversion
+        const char* run = fmt;
+        while (*fmt && *fmt != '%') fmt++;
+        if (fmt != run) out_write(&o, run, fmt - run);
+        if (!*fmt) break;
+        fmt++;
+
+        int left = 0, zero = 0;
+        for (;; fmt++) {
+            if (*fmt == '-') left = 1;
+            else if (*fmt == '0') zero = 1;
+            else break;
+        }
+
+        size_t width = 0;
+        if (*fmt == '*') {
+            int w = va_arg(ap, int);
+            if (w < 0) {
+                left = 1;
+                w = -w;
+            }
+            width = w;
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') width = width * 10 + (*fmt++ - '0');
+        }
+
+        size_t precision = (size_t)-1;
+        if (*fmt == '.') {
+            fmt++;
+            precision = 0;
+            if (*fmt == '*') {
+                int p = va_arg(ap, int);
+                precision = p < 0 ? (size_t)-1 : (size_t)p;
+                fmt++;
+            } else {
+                while (*fmt >= '0' && *fmt <= '9') precision = precision * 10 + (*fmt++ - '0');
+            }
+        }
+
+        // int, long and size_t are all 32 bits here; "ll" is 64
+        int longlong = 0;
+        while (*fmt == 'l' || *fmt == 'z') {
+            if (fmt[0] == 'l' && fmt[1] == 'l') {
+                longlong = 1;
+                fmt++;
+            }
+            fmt++;
+        }
+
+        char conv = *fmt;
+        if (!conv) break;
+        fmt++;
+
+        switch (conv) {
+        case 'd':
+        case 'i': {
+            int64_t v = longlong ? va_arg(ap, int64_t) : va_arg(ap, int32_t);
+            uint64_t mag = v < 0 ? -(uint64_t)v : (uint64_t)v;
+            char* p = longlong ? fmt_dec64(num_end, mag) : fmt_dec32(num_end, (uint32_t)mag);
+            out_field(&o, "-", v < 0, p, num_end - p, width, left, zero);
+            break;
+        }
+        case 'u': {
+            char* p = longlong ? fmt_dec64(num_end, va_arg(ap, uint64_t))
+                               : fmt_dec32(num_end, va_arg(ap, uint32_t));
+            out_field(&o, "", 0, p, num_end - p, width, left, zero);
+            break;
+        }
+        case 'x':
+        case 'X': {
+            uint64_t v = longlong ? va_arg(ap, uint64_t) : va_arg(ap, uint32_t);
+            char* p = fmt_hex(num_end, v, conv == 'x' ? hex_lower : hex_upper);
+            out_field(&o, "", 0, p, num_end - p, width, left, zero);
+            break;
+        }
+        case 'p': {
+            char* p = fmt_hex(num_end, (uint32_t)va_arg(ap, void*), hex_lower);
+            while (p > num_end - 8) *--p = '0';
+            out_field(&o, "0x", 2, p, num_end - p, width, left, 0);
+            break;
+        }
+        case 's': {
+            const char* s = va_arg(ap, const char*);
+            if (!s) s = "(null)";
+            out_field(&o, "", 0, s, strnlen(s, precision), width, left, 0);
+            break;
+        }
+        case 'c': {
+            char c = (char)va_arg(ap, int);
+            out_field(&o, "", 0, &c, 1, width, left, 0);
+            break;
+        }
+        case '%':
+            out_write(&o, "%", 1);
+            break;
+        default:
+            // Unknown conversion, print it as written
+            out_write(&o, "%", 1);
+            out_write(&o, &conv, 1);
+            break;
+        }
+    }
+
+    if (size) buf[o.len < o.cap ? o.len : o.cap] = 0;
+    return (int)o.len;
+}
+
+int ksnprintf(char* buf, size_t size, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = kvsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+int kvprintf(const char* fmt, va_list ap) {
+    char buf[KPRINTF_BUFFER];
+    int n = kvsnprintf(buf, sizeof(buf), fmt, ap);
+    terminal_write(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+    return n;
+}
+
+int kprintf(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = kvprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
@@ -0,0 +1,175 @@
+#include "serial.h"
+#include "cpu.h"
+#include "kernel.h"
+#include "klog.h"
+#include "thread.h"
+#include "softirq.h"
+
+/* --- UART REGISTERS --- */
+
+#define UART_DATA 0  // RBR/THR, divisor low with DLAB
+#define UART_IER  1  // Divisor high with DLAB
+#define UART_FCR  2  // IIR on read
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+#define UART_SCR  7
+
+#define IER_RX 0x01
+#define IER_TX 0x02  // THR empty
+#define LSR_DATA_READY 0x01
+#define LSR_THR_EMPTY  0x20
+
+/* --- RINGS --- */
+
+// Single producer, single consumer, with free running indices. The
+// terminal layer produces TX bytes and the IRQ handler consumes them;
+// for RX the roles swap.
+static char tx_ring[SERIAL_TX_SIZE];
+static volatile uint32_t tx_head = 0;
+static volatile uint32_t tx_tail = 0;
+static volatile int tx_irq_on = 0;
+
+static char rx_ring[SERIAL_RX_SIZE];
+static volatile uint32_t rx_head = 0;
+static volatile uint32_t rx_tail = 0;
+
+static int present = 0;
+static int fifo_size = 1;
+static serial_stats_t stats;
+
+int serial_present(void) {
+    return present;
+}
+
+// Moves up to one FIFO load from the TX ring into the UART. The caller
+// must own the consumer side: the IRQ handler, or anyone with IF clear.
+static void serial_tx_fill(void) {
+    uint32_t tail = tx_tail;
+    uint32_t head = __atomic_load_n(&tx_head, __ATOMIC_ACQUIRE);
+    for (int n = 0; n < fifo_size && tail != head; n++) {
+        outb(SERIAL_COM1 + UART_DATA, tx_ring[tail++ & (SERIAL_TX_SIZE - 1)]);
+    }
+    stats.tx_bytes += tail - tx_tail;
+    __atomic_store_n(&tx_tail, tail, __ATOMIC_RELEASE);
+
+    if (tail == head) {
+        tx_irq_on = 0;
+        outb(SERIAL_COM1 + UART_IER, IER_RX);
+    }
+}
+
+static int rx_softirq = -1;
+
+static void serial_rx_bh(void) {
+    wait_queue_wake_all(&console_input);
+}
+
+// Top half: the FIFOs have to be drained here, waking the reader can wait
+static void serial_callback(registers_t* regs) {
+    (void)regs;
+    stats.irqs++;
+
+    uint8_t lsr;
+    int received = 0;
+    while ((lsr = inb(SERIAL_COM1 + UART_LSR)) & LSR_DATA_READY) {
+        received = 1;
+        char c = inb(SERIAL_COM1 + UART_DATA);
+        if (rx_head - rx_tail < SERIAL_RX_SIZE) {
+            rx_ring[rx_head & (SERIAL_RX_SIZE - 1)] = c;
+            __atomic_store_n(&rx_head, rx_head + 1, __ATOMIC_RELEASE);
+            stats.rx_bytes++;
+        } else {
+            if (!stats.rx_dropped++) klog(KLOG_WARN, "serial: RX ring full, dropping input");
+        }
+    }
+
+    if (lsr & LSR_THR_EMPTY) {
+        serial_tx_fill();
+    }
+    if (received) softirq_raise(rx_softirq);
+}
+
+// Drains the ring by polling the UART until at least `room` bytes are free
+static void serial_tx_poll(uint32_t room) {
+    uint32_t flags = irq_save();
+    while (SERIAL_TX_SIZE - (tx_head - tx_tail) < room) {
+        while (!(inb(SERIAL_COM1 + UART_LSR) & LSR_THR_EMPTY));
+        serial_tx_fill();
+    }
+    irq_restore(flags);
+}
+
+void serial_init(void) {
+    outb(SERIAL_COM1 + UART_IER, 0);
+
+    // Nothing decoded at the port reads back 0xFF
+    outb(SERIAL_COM1 + UART_SCR, 0x5A);
+    if (inb(SERIAL_COM1 + UART_SCR) != 0x5A) return;
+
+    outb(SERIAL_COM1 + UART_LCR, 0x80); // DLAB
+    outb(SERIAL_COM1 + UART_DATA, 1);   // Divisor 1: 115200 baud
+    outb(SERIAL_COM1 + UART_IER, 0);
+    outb(SERIAL_COM1 + UART_LCR, 0x03); // 8N1
+    outb(SERIAL_COM1 + UART_FCR, 0xC7); // Enable and clear FIFOs, RX trigger at 14
+    outb(SERIAL_COM1 + UART_MCR, 0x0B); // DTR, RTS, OUT2 (gates IRQ4)
+
+    // An 8250/16450 has no FIFO and leaves the IIR top bits clear
+    fifo_size = ((inb(SERIAL_COM1 + UART_FCR) & 0xC0) == 0xC0) ? 16 : 1;
+    present = 1;
+
+    rx_softirq = softirq_register("serial", serial_rx_bh);
+    register_interrupt_handler(36, serial_callback);
+    outb(SERIAL_COM1 + UART_IER, IER_RX);
+}
+
+void serial_write(const char* data, size_t size) {
+    if (!present) return;
+
+    // One writer at a time: a thread switched in halfway would append at
+    // the same head
+    preempt_disable();
+    uint32_t head = tx_head;
+    for (size_t i = 0; i < size; i++) {
+        char c = data[i];
+        uint32_t need = (c == '\n') ? 2 : (c == '\b') ? 3 : 1;
+        if (SERIAL_TX_SIZE - (head - __atomic_load_n(&tx_tail, __ATOMIC_ACQUIRE)) < need) {
+            // Publish what we have and make room
+            __atomic_store_n(&tx_head, head, __ATOMIC_RELEASE);
+            stats.tx_stalls++;
+            serial_tx_poll(need);
+        }
+        if (c == '\n') {
+            tx_ring[head++ & (SERIAL_TX_SIZE - 1)] = '\r';
+        } else if (c == '\b') {
+            // Rub the character out like the VGA console does
+            tx_ring[head++ & (SERIAL_TX_SIZE - 1)] = '\b';
+            tx_ring[head++ & (SERIAL_TX_SIZE - 1)] = ' ';
+        }
+        tx_ring[head++ & (SERIAL_TX_SIZE - 1)] = c;
+    }
+    __atomic_store_n(&tx_head, head, __ATOMIC_RELEASE);
+
+    // THR empty raises the interrupt as soon as it is enabled
+    if (!tx_irq_on) {
+        tx_irq_on = 1;
+        outb(SERIAL_COM1 + UART_IER, IER_RX | IER_TX);
+    }
+    preempt_enable();
+}
+
+void serial_flush(void) {
+    if (!present) return;
+    serial_tx_poll(SERIAL_TX_SIZE);
+}
+
+char serial_getchar(void) {
+    if (rx_tail == __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE)) return 0;
+    char c = rx_ring[rx_tail & (SERIAL_RX_SIZE - 1)];
+    __atomic_store_n(&rx_tail, rx_tail + 1, __ATOMIC_RELEASE);
+    return c;
+}
+
+void serial_get_stats(serial_stats_t* out) {
+    *out = stats;
+}
@@ -0,0 +1,39 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kernel.h"
+
+/* COM1, 16550 UART at 115200 8N1 */
+#define SERIAL_COM1 0x3F8
+#define SERIAL_TX_SIZE 4096  // Power of two
+#define SERIAL_RX_SIZE 256   // Power of two
+
+// Probes and programs the UART, then hooks IRQ4. Does nothing further
+// when no UART answers.
+void serial_init(void);
+int serial_present(void);
+
+// Queues bytes for the IRQ handler to send, '\n' going out as "\r\n" and
+// '\b' as "\b \b". Only waits when the ring is full. Not reentrant, the
+// terminal layer is the one producer.
+void serial_write(const char* data, size_t size);
+
+// Sends everything queued by polling, for when interrupts are off
+void serial_flush(void);
+
+// Non-blocking read of a received byte, returns 0 if none
+char serial_getchar(void);
+
+typedef struct {
+    uint32_t irqs;
+    uint32_t tx_bytes;
+    uint32_t rx_bytes;
+    uint32_t rx_dropped;  // RX ring full
+    uint32_t tx_stalls;   // Writes that found the TX ring full
+} serial_stats_t;
+
+void serial_get_stats(serial_stats_t* out);
+
+#endif
@@ -0,0 +1,221 @@
+#include "smp.h"
+#include "apic.h"
+#include "clock.h"
+#include "cpu.h"
+#include "klog.h"
+#include "thread.h"
+#include "kernel.h"
+
+/* --- BRING-UP --- */
+
+// Layout of trampoline_args in trampoline.s
+typedef struct {
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t entry;
+} trampoline_args_t;
+
+extern uint8_t trampoline_start[];
+extern uint8_t trampoline_end[];
+extern uint8_t trampoline_args[];
+
+static uint8_t ap_stacks[MAX_CPUS][SMP_STACK_SIZE] __attribute__((aligned(16)));
+static volatile uint32_t ap_booting;  // Index of the CPU the trampoline is set up for
+static int online_count = 1;
+
+static void ap_loop(percpu_t* self);
+
+static void ap_entry(void) {
+    uint32_t index = ap_booting;
+    cpu_init_ap(index, (uint32_t)&ap_stacks[index][SMP_STACK_SIZE]);
+    apic_init_ap();
+
+    percpu_t* self = cpu_self();
+    __atomic_store_n(&self->online, 1, __ATOMIC_RELEASE);
+    ap_loop(self);
+}
+
+// INIT, then up to two STARTUP IPIs as the MP spec asks. A CPU that is
+// already running ignores the second one.
+static int smp_start_ap(percpu_t* cpu) {
+    apic_send_init(cpu->apic_id);
+    udelay(10000);
+    for (int sipi = 0; sipi < 2; sipi++) {
+        apic_send_startup(cpu->apic_id, SMP_TRAMPOLINE >> 12);
+        int polls = sipi ? 10000 : 20; // 100 ms, then 200 us
+        for (int i = 0; i < polls; i++) {
+            if (__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) return 1;
+            udelay(10);
+        }
+    }
+    return 0;
+}
+
+void smp_init(void) {
+    percpu_t* bsp = cpu_self();
+    bsp->online = 1;
+    if (!apic_active()) {
+        klog(KLOG_INFO, "smp: no APIC, boot CPU only");
+        return;
+    }
+    bsp->apic_id = apic_cpu_id(0);
+    if (apic_cpu_count() < 2) {
+        klog(KLOG_INFO, "smp: 1 CPU");
+        return;
+    }
+
+    memcpy((void*)SMP_TRAMPOLINE, trampoline_start, trampoline_end - trampoline_start);
+    trampoline_args_t* args = (trampoline_args_t*)(SMP_TRAMPOLINE + (trampoline_args - trampoline_start));
+    asm volatile ( "mov %%cr0, %0" : "=r"(args->cr0) );
+    asm volatile ( "mov %%cr3, %0" : "=r"(args->cr3) );
+    asm volatile ( "mov %%cr4, %0" : "=r"(args->cr4) );
+    args->entry = (uint32_t)ap_entry;
+
+    // One at a time, they share the trampoline
+    for (int i = 1; i < apic_cpu_count(); i++) {
+        uint32_t index = online_count;
+        percpu_t* cpu = &percpu[index];
+        cpu->apic_id = apic_cpu_id(i);
+        args->stack = (uint32_t)&ap_stacks[index][SMP_STACK_SIZE];
+        ap_booting = index;
+        if (!smp_start_ap(cpu)) {
+            // It might still come up late, on the stack the next one gets
+            klog(KLOG_WARN, "smp: CPU %u did not start, giving up on the rest", cpu->apic_id);
+            break;
+        }
+        online_count++;
+    }
+    klog(KLOG_INFO, "smp: %d CPUs online", online_count);
+}
+
+int smp_cpu_count(void) {
+    return online_count;
+}
+
+/* --- PARALLEL FOR --- */
+
+// One job at a time. CPUs claim `grain` items per fetch_add on `next`.
+// `open` and `workers` form a handshake: the boot CPU closes the job and
+// then waits for workers to drain, a worker registers first and then
+// checks it is open, so nobody can still be inside when the next job's
+// fields are written.
+static struct {
+    parallel_fn_t fn;
+    void* arg;
+    uint32_t count;
+    uint32_t grain;
+    volatile uint32_t next;
+    volatile uint32_t done;
+    volatile uint32_t generation;
+    volatile uint32_t open;
+    volatile uint32_t workers;
+} job;
+
+// Held for a whole job. Threads on the boot CPU can be preempted while
+// they spin on one, so a second caller sleeps here instead of rewriting it.
+static int job_busy;
+static wait_queue_t job_waiters = WAIT_QUEUE_INIT;
+
+static void job_run(percpu_t* self, uint32_t generation) {
+    __atomic_add_fetch(&job.workers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&job.open, __ATOMIC_SEQ_CST)
+            && __atomic_load_n(&job.generation, __ATOMIC_ACQUIRE) == generation) {
+        for (;;) {
+            uint32_t start = __atomic_fetch_add(&job.next, job.grain, __ATOMIC_RELAXED);
+            if (start >= job.count) break;
+            uint32_t end = job.count - start > job.grain ? start + job.grain : job.count;
+            job.fn(start, end, job.arg);
+            self->chunks++;
+            self->items += end - start;
+            __atomic_add_fetch(&job.done, end - start, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_sub_fetch(&job.workers, 1, __ATOMIC_SEQ_CST);
+}
+
+// Checked with interrupts off so the wakeup IPI can't land between the
+// check and hlt
+static void ap_loop(percpu_t* self) {
+    uint32_t seen = 0;
+    for (;;) {
+        irq_disable();
+        uint32_t generation = __atomic_load_n(&job.generation, __ATOMIC_ACQUIRE);
+        if (generation == seen) {
+            cpu_idle();
+            continue;
+        }
+        seen = generation;
+        irq_enable();
+        job_run(self, generation);
+    }
+}
+
+void parallel_for(uint32_t count, parallel_fn_t fn, void* arg) {
+    if (!count) return;
+    percpu_t* self = cpu_self();
+    if (online_count == 1) {
+        fn(0, count, arg);
+        self->chunks++;
+        self->items += count;
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    while (job_busy) wait_queue_wait(&job_waiters);
+    job_busy = 1;
+    irq_restore(flags);
+
+    // About four chunks per CPU, so a slow one doesn't hold up the rest
+    uint32_t grain = count / (online_count * 4);
+    job.fn = fn;
+    job.arg = arg;
+    job.count = count;
+    job.grain = grain ? grain : 1;
+    job.next = 0;
+    job.done = 0;
+    uint32_t generation = job.generation + 1;
+    __atomic_store_n(&job.open, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&job.generation, generation, __ATOMIC_RELEASE);
+    apic_send_ipi_others(APIC_WAKE_VECTOR);
+
+    job_run(self, generation);
+    while (__atomic_load_n(&job.done, __ATOMIC_ACQUIRE) < count) asm volatile ( "pause" );
+    __atomic_store_n(&job.open, 0, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&job.workers, __ATOMIC_SEQ_CST)) asm volatile ( "pause" );
+
+    job_busy = 0;
+    wait_queue_wake_all(&job_waiters);
+}
+
+/* --- LOAD --- */
+
+// Other CPUs' counters are read without synchronisation, a torn value
+// only skews one sample
+void smp_dump(void) {
+    static uint64_t last_tsc = 0;
+    static uint64_t last_idle[MAX_CPUS];
+
+    uint64_t now = rdtsc();
+    uint64_t window = now - last_tsc;
+    uint32_t khz = tsc_khz();
+    if (khz) {
+        kprintf("Load over the last %u ms:\n", (uint32_t)udiv64(window, khz, 0));
+    }
+
+    terminal_writestring("CPU  APIC  load  chunks     items\n");
+    for (int i = 0; i < online_count; i++) {
+        percpu_t* cpu = &percpu[i];
+        uint64_t idle = cpu->idle_cycles;
+        uint64_t idle_start = cpu->idle_start;
+        if (idle_start && idle_start < now) idle += now - idle_start;
+
+        uint64_t idle_delta = idle - last_idle[i];
+        if (idle_delta > window) idle_delta = window;
+        kprintf("%3d  %4u  %3u%%  %6u  %8u\n", i, cpu->apic_id, percent(window - idle_delta, window),
+                cpu->chunks, cpu->items);
+        last_idle[i] = idle;
+    }
+    last_tsc = now;
+}
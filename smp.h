@@ -0,0 +1,29 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+/* Application processors. They only take wakeup IPIs and run
+   parallel_for chunks; device IRQs, the timer wheel and the shell stay on
+   the boot CPU. */
+
+#define SMP_TRAMPOLINE 0x8000  // Below 1 MiB, never handed out by the pmm
+#define SMP_STACK_SIZE 16384
+
+// Starts every CPU the MADT lists with INIT-SIPI-SIPI. Needs apic_init.
+void smp_init(void);
+int smp_cpu_count(void);  // CPUs online, the boot CPU included
+
+// Runs fn over [0, count) in chunks spread across every online CPU and
+// returns when all of them are done. Only threads on the boot CPU may call
+// it, outside interrupt handlers; concurrent callers take turns. fn runs
+// with interrupts on and must not print, allocate or fault in demand-zero
+// pages: none of that is SMP safe.
+typedef void (*parallel_fn_t)(uint32_t start, uint32_t end, void* arg);
+void parallel_for(uint32_t count, parallel_fn_t fn, void* arg);
+
+/* Per-CPU busy time since the previous call and parallel_for work */
+void smp_dump(void);
+
+#endif
@@ -0,0 +1,76 @@
+#include "softirq.h"
+#include "clock.h"
+#include "kernel.h"
+
+typedef struct {
+    const char* name;
+    softirq_fn_t fn;
+    uint32_t raised;
+    uint32_t runs;
+    uint32_t max_cycles;
+    uint64_t cycles;
+} softirq_t;
+
+static softirq_t softirqs[SOFTIRQ_MAX];
+static int softirq_count;
+
+int softirq_register(const char* name, softirq_fn_t fn) {
+    if (softirq_count == SOFTIRQ_MAX) return -1;
+    softirqs[softirq_count].name = name;
+    softirqs[softirq_count].fn = fn;
+    return softirq_count++;
+}
+
+void softirq_raise(int id) {
+    softirqs[id].raised++;
+    __atomic_or_fetch(&cpu_self()->softirq_pending, 1u << id, __ATOMIC_RELAXED);
+}
+
+void softirq_run(void) {
+    percpu_t* self = cpu_self();
+    if (self->softirq_active) return;
+    self->softirq_active = 1;
+    self->preempt_count++;
+
+    // Raised again while running means another round, up to a limit so a
+    // busy device can't keep the interrupted thread off the CPU for good
+    for (int round = 0; round < SOFTIRQ_ROUNDS; round++) {
+        uint32_t pending = __atomic_exchange_n(&self->softirq_pending, 0, __ATOMIC_RELAXED);
+        if (!pending) break;
+        irq_enable();
+        while (pending) {
+            softirq_t* s = &softirqs[__builtin_ctz(pending)];
+            pending &= pending - 1;
+            uint64_t start = rdtsc();
+            s->fn();
+            uint32_t cycles = (uint32_t)(rdtsc() - start);
+            s->runs++;
+            s->cycles += cycles;
+            if (cycles > s->max_cycles) s->max_cycles = cycles;
+        }
+        irq_disable();
+    }
+
+    self->preempt_count--;
+    self->softirq_active = 0;
+}
+
+void softirq_dump(void) {
+    terminal_writestring("Top halves (interrupts off):\n");
+    terminal_writestring("  vector      calls  avg cyc  max cyc   total us\n");
+    for (int v = 0; v < 256; v++) {
+        irq_stat_t t = irq_stats[v];
+        if (!t.count) continue;
+        kprintf("  %6d  %9u  %7u  %7u  %9llu\n", v, t.count,
+                (uint32_t)udiv64(t.cycles, t.count, 0), t.max_cycles, cycles_to_us(t.cycles));
+    }
+
+    terminal_writestring("Bottom halves (interrupts on):\n");
+    terminal_writestring("  name       raised       runs  avg cyc  max cyc   total us\n");
+    for (int i = 0; i < softirq_count; i++) {
+        softirq_t* s = &softirqs[i];
+        kprintf("  %-8s  %7u  %9u  %7u  %7u  %9llu\n", s->name, s->raised, s->runs,
+                s->runs ? (uint32_t)udiv64(s->cycles, s->runs, 0) : 0, s->max_cycles,
+                cycles_to_us(s->cycles));
+    }
+}
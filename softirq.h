@@ -0,0 +1,34 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stdint.h>
+#include "kernel.h"
+#include "cpu.h"
+
+/* Bottom halves. Interrupt handlers (top halves) only acknowledge the
+   device, queue what they read and raise a softirq; the registered
+   function does the rest with interrupts on, on the way out of the
+   outermost handler or from the idle thread. */
+
+#define SOFTIRQ_MAX 16
+#define SOFTIRQ_ROUNDS 8  // Rounds per interrupt exit before idle takes over
+
+typedef void (*softirq_fn_t)(void);
+
+// Returns the id to raise, -1 when every slot is taken
+int softirq_register(const char* name, softirq_fn_t fn);
+
+// Runs fn once soon on this CPU, however often it was raised. Safe from
+// any context; raised outside a handler it waits for the next interrupt
+// or the idle thread.
+void softirq_raise(int id);
+
+// Runs whatever is pending with interrupts on. Call with interrupts off
+// and outside handlers; returns with them off. Holds off preemption, and
+// does nothing if bottom halves are already running further up the stack.
+void softirq_run(void);
+
+/* Time spent in each handler and each bottom half */
+void softirq_dump(void);
+
+#endif
@@ -0,0 +1,458 @@
+#include "kernel.h"
+#include "cpu.h"
+
+/* --- MEMORY COPY / FILL VARIANTS --- */
+
+// Reference byte loops, kept around for the benchmark. GCC would happily
+// turn them back into memcpy/memset calls without the attribute.
+#define NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+NO_LIBCALL void* memcpy_bytes(void* dest, const void* src, size_t n) {
+    char* d = (char*)dest;
+    const char* s = (const char*)src;
+    while(n--) *d++ = *s++;
+    return dest;
+}
+
+NO_LIBCALL void* memset_bytes(void* s, int c, size_t n) {
+    unsigned char* p = (unsigned char*)s;
+    while(n--) *p++ = (unsigned char)c;
+    return s;
+}
+
+void* memcpy_rep(void* dest, const void* src, size_t n) {
+    void* d = dest;
+    size_t dwords = n >> 2;
+    size_t bytes = n & 3;
+    asm volatile ( "rep movsl" : "+D"(d), "+S"(src), "+c"(dwords) : : "memory" );
+    asm volatile ( "rep movsb" : "+D"(d), "+S"(src), "+c"(bytes) : : "memory" );
+    return dest;
+}
+
+void* memset_rep(void* s, int c, size_t n) {
+    void* d = s;
+    uint32_t pattern = (uint8_t)c * 0x01010101u;
+    size_t dwords = n >> 2;
+    size_t bytes = n & 3;
+    asm volatile ( "rep stosl" : "+D"(d), "+c"(dwords) : "a"(pattern) : "memory" );
+    asm volatile ( "rep stosb" : "+D"(d), "+c"(bytes) : "a"(pattern) : "memory" );
+    return s;
+}
+
+// Enhanced REP MOVSB/STOSB: microcode picks the widest moves itself
+void* memcpy_erms(void* dest, const void* src, size_t n) {
+    void* d = dest;
+    asm volatile ( "rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory" );
+    return dest;
+}
+
+void* memset_erms(void* s, int c, size_t n) {
+    void* d = s;
+    asm volatile ( "rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory" );
+    return s;
+}
+
+// SSE2 non-temporal stores bypass the cache, which pays off once the
+// destination is much larger than what would stay cached anyway. The kernel
+// is built without -msse, so GCC never keeps anything in XMM registers and
+// the asm blocks need not (and cannot) declare them clobbered.
+void* memcpy_sse2_nt(void* dest, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+
+    size_t head = (16 - ((uint32_t)d & 15)) & 15;
+    if (head > n) head = n;
+    memcpy_rep(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t blocks = n >> 6;
+    if (blocks) {
+        asm volatile (
+            "1:\n\t"
+            "movdqu   (%1), %%xmm0\n\t"
+            "movdqu 16(%1), %%xmm1\n\t"
+            "movdqu 32(%1), %%xmm2\n\t"
+            "movdqu 48(%1), %%xmm3\n\t"
+            "movntdq %%xmm0,   (%0)\n\t"
+            "movntdq %%xmm1, 16(%0)\n\t"
+            "movntdq %%xmm2, 32(%0)\n\t"
+            "movntdq %%xmm3, 48(%0)\n\t"
+            "add $64, %0\n\t"
+            "add $64, %1\n\t"
+            "dec %2\n\t"
+            "jnz 1b\n\t"
+            "sfence"
+            : "+r"(d), "+r"(s), "+r"(blocks) : : "memory" );
+    }
+
+    memcpy_rep(d, s, n & 63);
+    return dest;
+}
+
+void* memset_sse2_nt(void* s, int c, size_t n) {
+    uint8_t* d = (uint8_t*)s;
+
+    size_t head = (16 - ((uint32_t)d & 15)) & 15;
+    if (head > n) head = n;
+    memset_rep(d, c, head);
+    d += head;
+    n -= head;
+
+    uint32_t pattern = (uint8_t)c * 0x01010101u;
+    size_t blocks = n >> 6;
+    if (blocks) {
+        asm volatile (
+            "movd %2, %%xmm0\n\t"
+            "pshufd $0, %%xmm0, %%xmm0\n\t"
+            "1:\n\t"
+            "movntdq %%xmm0,   (%0)\n\t"
+            "movntdq %%xmm0, 16(%0)\n\t"
+            "movntdq %%xmm0, 32(%0)\n\t"
+            "movntdq %%xmm0, 48(%0)\n\t"
+            "add $64, %0\n\t"
+            "dec %1\n\t"
+            "jnz 1b\n\t"
+            "sfence"
+            : "+r"(d), "+r"(blocks) : "r"(pattern) : "memory" );
+    }
+
+    memset_rep(d, c, n & 63);
+    return s;
+}
+
+/* --- DISPATCH --- */
+
+// Defaults are safe on any i386, string_init upgrades them from CPUID
+static void* (*memcpy_impl)(void*, const void*, size_t) = memcpy_rep;
+static void* (*memset_impl)(void*, int, size_t) = memset_rep;
+static int use_sse2_nt = 0;
+
+void string_init(void) {
+    if (cpu_features.erms) {
+        memcpy_impl = memcpy_erms;
+        memset_impl = memset_erms;
+    }
+    use_sse2_nt = cpu_features.sse2;
+}
+
+const char* string_impl_name(void) {
+    if (use_sse2_nt) {
+        return cpu_features.erms ? "erms + sse2-nt" : "rep movsd + sse2-nt";
+    }
+    return cpu_features.erms ? "erms" : "rep movsd";
+}
+
+// XMM registers are not saved on interrupt entry, so the SSE2 paths
+// (copies here, string scans below) are only taken outside of interrupt
+// handlers.
+static inline int sse2_nt_ok(size_t n) {
+    return use_sse2_nt && n >= MEM_NT_THRESHOLD && !in_interrupt();
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+    if (sse2_nt_ok(n)) return memcpy_sse2_nt(dest, src, n);
+    return memcpy_impl(dest, src, n);
+}
+
+void* memset(void* s, int c, size_t n) {
+    if (sse2_nt_ok(n)) return memset_sse2_nt(s, c, n);
+    return memset_impl(s, c, n);
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    uint32_t d = (uint32_t)dest;
+    uint32_t s = (uint32_t)src;
+
+    // Forward copy is fine unless dest overlaps the tail of src
+    if (d <= s || d >= s + n) {
+        return memcpy(dest, src, n);
+    }
+
+    // Copy backwards: trailing bytes first, then whole dwords. One asm
+    // statement, the compiler assumes DF is clear between any two.
+    uint32_t dp = d + n - 1;
+    uint32_t sp = s + n - 1;
+    size_t bytes = n & 3;
+    size_t dwords = n >> 2;
+    asm volatile ( "std\n\t"
+                   "rep movsb\n\t"
+                   "sub $3, %%edi\n\t"
+                   "sub $3, %%esi\n\t"
+                   "mov %%eax, %%ecx\n\t"
+                   "rep movsl\n\t"
+                   "cld"
+                   : "+D"(dp), "+S"(sp), "+c"(bytes), "+a"(dwords) : : "memory", "cc" );
+    return dest;
+}
+
+/* --- STRING SCANNING VARIANTS --- */
+
+// Word-at-a-time helpers. Aligned loads never cross a page boundary, so
+// reading a few bytes past the terminator is safe.
+typedef uint32_t __attribute__((may_alias)) word_t;
+typedef uint32_t __attribute__((may_alias, aligned(1))) uword_t;
+
+#define ONES  0x01010101u
+#define HIGHS 0x80808080u
+#define HAS_ZERO(x) (((x) - ONES) & ~(x) & HIGHS)
+
+// Unaligned loads of this width are only done away from the page end
+#define PAGE_OFFSET(p) ((uint32_t)(p) & 0xFFF)
+
+size_t strlen_bytes(const char* str) {
+    size_t len = 0;
+    while (str[len]) len++;
+    return len;
+}
+
+size_t strlen_word(const char* str) {
+    const char* p = str;
+    while ((uint32_t)p & 3) {
+        if (!*p) return p - str;
+        p++;
+    }
+
+    const word_t* w = (const word_t*)p;
+    while (!HAS_ZERO(*w)) w++;
+
+    p = (const char*)w;
+    while (*p) p++;
+    return p - str;
+}
+
+size_t strlen_sse2(const char* str) {
+    uint32_t addr = (uint32_t)str;
+    const char* p = (const char*)(addr & ~15u);
+    uint32_t mask;
+
+    // First aligned block may start before the string, drop those bytes
+    asm volatile (
+        "pxor %%xmm0, %%xmm0\n\t"
+        "movdqa (%1), %%xmm1\n\t"
+        "pcmpeqb %%xmm0, %%xmm1\n\t"
+        "pmovmskb %%xmm1, %0"
+        : "=r"(mask) : "r"(p) : "memory" );
+    mask >>= addr & 15;
+    if (mask) return __builtin_ctz(mask);
+
+    for (;;) {
+        p += 16;
+        asm volatile (
+            "pxor %%xmm0, %%xmm0\n\t"
+            "movdqa (%1), %%xmm1\n\t"
+            "pcmpeqb %%xmm0, %%xmm1\n\t"
+            "pmovmskb %%xmm1, %0"
+            : "=r"(mask) : "r"(p) : "memory" );
+        if (mask) return (p - str) + __builtin_ctz(mask);
+    }
+}
+
+int strcmp_bytes(const char* s1, const char* s2) {
+    while (*s1 && (*s1 == *s2)) {
+        s1++;
+        s2++;
+    }
+    return *(const unsigned char*)s1 - *(const unsigned char*)s2;
+}
+
+// Compares up to count bytes one at a time, *done is set when a difference
+// or the terminator was found.
+static inline int strcmp_step(const char** s1, const char** s2, int count, int* done) {
+    for (int i = 0; i < count; i++) {
+        unsigned char c1 = *(*s1)++;
+        unsigned char c2 = *(*s2)++;
+        if (c1 != c2 || !c1) {
+            *done = 1;
+            return c1 - c2;
+        }
+    }
+    *done = 0;
+    return 0;
+}
+
+int strcmp_word(const char* s1, const char* s2) {
+    int done, ret;
+    for (;;) {
+        if (PAGE_OFFSET(s1) <= 0x1000 - 4 && PAGE_OFFSET(s2) <= 0x1000 - 4) {
+            uint32_t a = *(const uword_t*)s1;
+            uint32_t b = *(const uword_t*)s2;
+            if (a == b && !HAS_ZERO(a)) {
+                s1 += 4;
+                s2 += 4;
+                continue;
+            }
+        }
+        ret = strcmp_step(&s1, &s2, 4, &done);
+        if (done) return ret;
+    }
+}
+
+int strcmp_sse2(const char* s1, const char* s2) {
+    int done, ret;
+    for (;;) {
+        if (PAGE_OFFSET(s1) <= 0x1000 - 16 && PAGE_OFFSET(s2) <= 0x1000 - 16) {
+            uint32_t eq, zero;
+            asm volatile (
+                "movdqu (%2), %%xmm0\n\t"
+                "movdqu (%3), %%xmm1\n\t"
+                "pxor %%xmm2, %%xmm2\n\t"
+                "pcmpeqb %%xmm0, %%xmm2\n\t"
+                "pcmpeqb %%xmm0, %%xmm1\n\t"
+                "pmovmskb %%xmm1, %0\n\t"
+                "pmovmskb %%xmm2, %1"
+                : "=r"(eq), "=r"(zero) : "r"(s1), "r"(s2) : "memory" );
+            if (eq == 0xFFFF && !zero) {
+                s1 += 16;
+                s2 += 16;
+                continue;
+            }
+        }
+        ret = strcmp_step(&s1, &s2, 16, &done);
+        if (done) return ret;
+    }
+}
+
+void* memchr_bytes(const void* s, int c, size_t n) {
+    const uint8_t* p = (const uint8_t*)s;
+    while (n--) {
+        if (*p == (uint8_t)c) return (void*)p;
+        p++;
+    }
+    return NULL;
+}
+
+void* memchr_word(const void* s, int c, size_t n) {
+    const uint8_t* p = (const uint8_t*)s;
+    uint8_t ch = (uint8_t)c;
+    while (n && ((uint32_t)p & 3)) {
+        if (*p == ch) return (void*)p;
+        p++;
+        n--;
+    }
+
+    uint32_t pattern = ch * ONES;
+    while (n >= 4) {
+        uint32_t x = *(const word_t*)p ^ pattern;
+        if (HAS_ZERO(x)) break;
+        p += 4;
+        n -= 4;
+    }
+    return memchr_bytes(p, c, n);
+}
+
+void* memchr_sse2(const void* s, int c, size_t n) {
+    const uint8_t* p = (const uint8_t*)s;
+    uint8_t ch = (uint8_t)c;
+    while (n && ((uint32_t)p & 15)) {
+        if (*p == ch) return (void*)p;
+        p++;
+        n--;
+    }
+
+    uint32_t pattern = ch * ONES;
+    while (n >= 16) {
+        uint32_t mask;
+        asm volatile (
+            "movd %2, %%xmm0\n\t"
+            "pshufd $0, %%xmm0, %%xmm0\n\t"
+            "pcmpeqb (%1), %%xmm0\n\t"
+            "pmovmskb %%xmm0, %0"
+            : "=r"(mask) : "r"(p), "r"(pattern) : "memory" );
+        if (mask) return (void*)(p + __builtin_ctz(mask));
+        p += 16;
+        n -= 16;
+    }
+    return memchr_bytes(p, c, n);
+}
+
+int memcmp_bytes(const void* s1, const void* s2, size_t n) {
+    const uint8_t* a = (const uint8_t*)s1;
+    const uint8_t* b = (const uint8_t*)s2;
+    while (n--) {
+        if (*a != *b) return *a - *b;
+        a++;
+        b++;
+    }
+    return 0;
+}
+
+// Both buffers are valid for n bytes, so unaligned loads inside that range
+// are always safe here.
+int memcmp_word(const void* s1, const void* s2, size_t n) {
+    const uint8_t* a = (const uint8_t*)s1;
+    const uint8_t* b = (const uint8_t*)s2;
+    while (n >= 4 && *(const uword_t*)a == *(const uword_t*)b) {
+        a += 4;
+        b += 4;
+        n -= 4;
+    }
+    return memcmp_bytes(a, b, n);
+}
+
+int memcmp_sse2(const void* s1, const void* s2, size_t n) {
+    const uint8_t* a = (const uint8_t*)s1;
+    const uint8_t* b = (const uint8_t*)s2;
+    while (n >= 16) {
+        uint32_t mask;
+        asm volatile (
+            "movdqu (%1), %%xmm0\n\t"
+            "movdqu (%2), %%xmm1\n\t"
+            "pcmpeqb %%xmm1, %%xmm0\n\t"
+            "pmovmskb %%xmm0, %0"
+            : "=r"(mask) : "r"(a), "r"(b) : "memory" );
+        if (mask != 0xFFFF) {
+            int i = __builtin_ctz(~mask);
+            return a[i] - b[i];
+        }
+        a += 16;
+        b += 16;
+        n -= 16;
+    }
+    return memcmp_word(a, b, n);
+}
+
+/* --- STRING FUNCTIONS --- */
+
+static inline int sse2_ok(void) {
+    return use_sse2_nt && !in_interrupt();
+}
+
+size_t strlen(const char* str)
+{
+    return sse2_ok() ? strlen_sse2(str) : strlen_word(str);
+}
+
+size_t strnlen(const char* str, size_t max) {
+    const char* end = memchr(str, 0, max);
+    return end ? (size_t)(end - str) : max;
+}
+
+int strcmp(const char* s1, const char* s2) {
+    return sse2_ok() ? strcmp_sse2(s1, s2) : strcmp_word(s1, s2);
+}
+
+void* memchr(const void* s, int c, size_t n) {
+    return sse2_ok() ? memchr_sse2(s, c, n) : memchr_word(s, c, n);
+}
+
+int memcmp(const void* s1, const void* s2, size_t n) {
+    return sse2_ok() ? memcmp_sse2(s1, s2, n) : memcmp_word(s1, s2, n);
+}
+
+char* strcpy(char* dest, const char* src) {
+    size_t len = strlen(src);
+    memcpy(dest, src, len + 1);
+    return dest;
+}
+
+int strncmp(const char* s1, const char* s2, size_t n) {
+    while (n && *s1 && (*s1 == *s2)) {
+        ++s1;
+        ++s2;
+        --n;
+    }
+    if (n == 0) return 0;
+    return *(const unsigned char*)s1 - *(const unsigned char*)s2;
+}
@@ -0,0 +1,480 @@
+#include "thread.h"
+#include "clock.h"
+#include "timer.h"
+#include "klog.h"
+#include "mm.h"
+#include "softirq.h"
+#include "kernel.h"
+
+// In boot.s: pushes the callee-saved registers, stores esp in *old_esp and
+// pops the registers of the thread that saved new_esp
+extern void switch_context(uint32_t* old_esp, uint32_t new_esp);
+
+static thread_t threads[THREAD_MAX];
+static thread_t* current;
+static thread_t* idle_thread;
+static thread_t* zombies;       // Exited, stacks not freed yet
+static uint32_t next_id = 1;
+static int running;
+
+// FIFO per priority, the idle thread is what runs when all are empty
+static wait_queue_t run_queue[THREAD_PRIO_IDLE];
+
+static ktimer_t* slice_timer;   // Pending while equal priorities compete
+static uint64_t switch_tsc;     // When current was switched in
+
+// FPU/SSE state for new threads, taken right after fninit
+static uint8_t fpu_initial[512] __attribute__((aligned(16)));
+
+/* --- QUEUES --- */
+
+static void queue_push(wait_queue_t* q, thread_t* t) {
+    t->next = 0;
+    if (q->tail) {
+        q->tail->next = t;
+    } else {
+        q->head = t;
+    }
+    q->tail = t;
+}
+
+static thread_t* queue_pop(wait_queue_t* q) {
+    thread_t* t = q->head;
+    if (t) {
+        q->head = t->next;
+        if (!q->head) q->tail = 0;
+    }
+    return t;
+}
+
+/* --- SCHEDULER --- */
+
+static void slice_expired(void* arg) {
+    (void)arg;
+    slice_timer = 0;
+    cpu_self()->need_resched = 1;
+}
+
+// Without a periodic tick the slice is a one-shot timer, and only armed
+// while somebody of the running thread's priority is waiting
+static void slice_arm(void) {
+    if (!slice_timer && timer_tickless()) {
+        slice_timer = timer_add(ktime_get_ns() + THREAD_SLICE_NS, slice_expired, 0);
+    }
+}
+
+// Interrupts off
+static void make_ready(thread_t* t) {
+    t->state = THREAD_READY;
+    queue_push(&run_queue[t->priority], t);
+    if (t->priority < current->priority) {
+        cpu_self()->need_resched = 1;
+    } else if (t->priority == current->priority) {
+        slice_arm();
+    }
+}
+
+// Threads can be preempted inside the SSE2 memcpy/memset, so the XMM
+// registers are part of the context
+static inline void fpu_save(thread_t* t) {
+    if (cpu_features.sse2) asm volatile ( "fxsave (%0)" : : "r"(t->fpu) : "memory" );
+}
+
+static inline void fpu_restore(thread_t* t) {
+    if (cpu_features.sse2) asm volatile ( "fxrstor (%0)" : : "r"(t->fpu) : "memory" );
+}
+
+void schedule(void) {
+    cpu_self()->need_resched = 0;
+    thread_t* prev = current;
+
+    // A running thread goes to the back of its own queue, so it only
+    // keeps the CPU if nobody of its priority or higher is waiting
+    if (prev->state == THREAD_RUNNING) {
+        prev->state = THREAD_READY;
+        if (prev != idle_thread) queue_push(&run_queue[prev->priority], prev);
+    }
+
+    thread_t* next = idle_thread;
+    for (int p = 0; p < THREAD_PRIO_IDLE; p++) {
+        if (run_queue[p].head) {
+            next = queue_pop(&run_queue[p]);
+            break;
+        }
+    }
+    next->state = THREAD_RUNNING;
+
+    if (next != prev && slice_timer) {
+        timer_cancel(slice_timer);
+        slice_timer = 0;
+    }
+    if (next != idle_thread && run_queue[next->priority].head) slice_arm();
+    if (next == prev) return;
+
+    uint64_t now = rdtsc();
+    prev->runtime += now - switch_tsc;
+    switch_tsc = now;
+    next->switches++;
+
+    fpu_save(prev);
+    current = next;
+    switch_context(&prev->esp, next->esp);
+    // Back in prev, switched to by some later schedule()
+    fpu_restore(prev);
+}
+
+void preempt_check(void) {
+    percpu_t* self = cpu_self();
+    if (!running || self->preempt_count || self->irq_nesting) return;
+    uint32_t flags = irq_save();
+    // With interrupts already off the caller has a critical section of its own
+    if ((flags & 0x200) && self->need_resched) schedule();
+    irq_restore(flags);
+}
+
+void sched_tick(void) {
+    if (running && current != idle_thread && run_queue[current->priority].head) {
+        cpu_self()->need_resched = 1;
+    }
+}
+
+int sched_running(void) {
+    return running;
+}
+
+/* --- THREADS --- */
+
+static void thread_start(void) {
+    thread_t* self = current;
+    fpu_restore(self);
+    irq_enable();
+    self->fn(self->arg);
+    thread_exit();
+}
+
+// Frees the stacks of exited threads. Never called by one of them, and a
+// zombie has switched away for good before anyone else runs.
+static void thread_reap(void) {
+    uint32_t flags = irq_save();
+    thread_t* list = zombies;
+    zombies = 0;
+    irq_restore(flags);
+
+    while (list) {
+        thread_t* t = list;
+        list = t->next;
+        kfree(t->stack);
+        t->stack = 0;
+        __atomic_store_n(&t->state, THREAD_UNUSED, __ATOMIC_RELEASE);
+    }
+}
+
+// A slot and a stack whose first switch_context lands in thread_start
+static thread_t* thread_alloc(const char* name, int priority, thread_fn_t fn, void* arg) {
+    uint8_t* stack = kmalloc(THREAD_STACK_SIZE);
+    if (!stack) return 0;
+    // Faulted in now rather than a page at a time on first use
+    memset(stack, 0, THREAD_STACK_SIZE);
+
+    thread_t* t = 0;
+    uint32_t flags = irq_save();
+    for (int i = 0; i < THREAD_MAX; i++) {
+        if (threads[i].state == THREAD_UNUSED) {
+            t = &threads[i];
+            t->state = THREAD_BLOCKED; // Claimed
+            t->id = next_id++;
+            break;
+        }
+    }
+    irq_restore(flags);
+    if (!t) {
+        kfree(stack);
+        return 0;
+    }
+
+    size_t len = strnlen(name, THREAD_NAME_LEN - 1);
+    memcpy(t->name, name, len);
+    t->name[len] = 0;
+    t->priority = priority;
+    t->stack = stack;
+    t->fn = fn;
+    t->arg = arg;
+    t->runtime = 0;
+    t->switches = 0;
+    memcpy(t->fpu, fpu_initial, sizeof(t->fpu));
+
+    uint32_t* sp = (uint32_t*)(stack + THREAD_STACK_SIZE);
+    *--sp = 0;                       // Return address, thread_start never returns
+    *--sp = (uint32_t)thread_start;  // Popped by switch_context's ret
+    *--sp = 0;                       // ebp
+    *--sp = 0;                       // ebx
+    *--sp = 0;                       // esi
+    *--sp = 0;                       // edi
+    t->esp = (uint32_t)sp;
+    return t;
+}
+
+thread_t* thread_create(const char* name, int priority, thread_fn_t fn, void* arg) {
+    if (!running) return 0;
+    if (priority < THREAD_PRIO_SHELL) priority = THREAD_PRIO_SHELL;
+    if (priority > THREAD_PRIO_LOW) priority = THREAD_PRIO_LOW;
+
+    thread_reap();
+    thread_t* t = thread_alloc(name, priority, fn, arg);
+    if (!t) return 0;
+
+    uint32_t flags = irq_save();
+    make_ready(t);
+    irq_restore(flags);
+    preempt_check();
+    return t;
+}
+
+thread_t* thread_current(void) {
+    return current;
+}
+
+void thread_yield(void) {
+    if (!running) return;
+    uint32_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+void thread_exit(void) {
+    irq_disable();
+    current->state = THREAD_DEAD;
+    current->next = zombies;
+    zombies = current;
+    schedule();
+    panic("thread_exit: dead thread scheduled");
+    for (;;);
+}
+
+static void thread_wake(void* arg) {
+    thread_t* t = arg;
+    if (t->state == THREAD_BLOCKED) make_ready(t);
+}
+
+void thread_sleep_ns(uint64_t ns) {
+    if (!running || in_interrupt()) {
+        timer_sleep_ns(ns);
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    if (!(flags & 0x200) || !timer_add(ktime_get_ns() + ns, thread_wake, current)) {
+        irq_restore(flags);
+        timer_sleep_ns(ns);
+        return;
+    }
+    current->state = THREAD_BLOCKED;
+    schedule();
+    irq_restore(flags);
+}
+
+/* --- WAIT QUEUES --- */
+
+void wait_queue_wait(wait_queue_t* q) {
+    if (!running) {
+        cpu_idle();
+        irq_disable();
+        return;
+    }
+    current->state = THREAD_BLOCKED;
+    queue_push(q, current);
+    schedule();
+}
+
+void wait_queue_wake_all(wait_queue_t* q) {
+    uint32_t flags = irq_save();
+    thread_t* t;
+    while ((t = queue_pop(q))) {
+        make_ready(t);
+    }
+    irq_restore(flags);
+    preempt_check();
+}
+
+/* --- IDLE --- */
+
+// Checked with interrupts off so a wakeup can't land between the check
+// and hlt. The interrupt that readies a thread switches to it on the way
+// out, and hlt returns here once idle is picked again. Bottom halves left
+// over by an interrupt exit, or raised from a thread, run here.
+static void idle_loop(void* arg) {
+    (void)arg;
+    for (;;) {
+        thread_reap();
+        irq_disable();
+        if (cpu_self()->softirq_pending) {
+            softirq_run();
+            irq_enable();
+            continue;
+        }
+        if (cpu_self()->need_resched) {
+            schedule();
+            irq_enable();
+            continue;
+        }
+        cpu_idle();
+    }
+}
+
+void sched_init(void) {
+    if (cpu_features.sse2) {
+        asm volatile ( "fninit; fxsave (%0)" : : "r"(fpu_initial) : "memory" );
+    }
+
+    thread_t* boot = &threads[0];
+    memcpy(boot->name, "shell", 6);
+    boot->id = next_id++;
+    boot->priority = THREAD_PRIO_SHELL;
+    boot->state = THREAD_RUNNING;
+    current = boot;
+
+    idle_thread = thread_alloc("idle", THREAD_PRIO_IDLE, idle_loop, 0);
+    if (!idle_thread) panic("sched_init: no memory for the idle thread");
+    idle_thread->state = THREAD_READY;
+
+    switch_tsc = rdtsc();
+    running = 1;
+    klog(KLOG_INFO, "sched: %u threads max, %u KiB stacks, %u ms slices",
+         THREAD_MAX, THREAD_STACK_SIZE / 1024, THREAD_SLICE_NS / 1000000);
+}
+
+/* --- PS --- */
+
+static const char* state_name(thread_state_t state) {
+    switch (state) {
+        case THREAD_RUNNING: return "run";
+        case THREAD_READY:   return "ready";
+        case THREAD_BLOCKED: return "wait";
+        case THREAD_DEAD:    return "dead";
+        default:             return "?";
+    }
+}
+
+// CPU share since the previous call, matched up by thread id since slots
+// get reused
+void sched_dump(void) {
+    static uint64_t last_tsc = 0;
+    static uint64_t last_runtime[THREAD_MAX];
+    static uint32_t last_id[THREAD_MAX];
+
+    struct {
+        uint32_t id;
+        char name[THREAD_NAME_LEN];
+        int priority;
+        thread_state_t state;
+        uint64_t runtime;
+        uint32_t switches;
+    } snap[THREAD_MAX];
+
+    uint32_t flags = irq_save();
+    uint64_t now = rdtsc();
+    for (int i = 0; i < THREAD_MAX; i++) {
+        thread_t* t = &threads[i];
+        snap[i].id = t->id;
+        memcpy(snap[i].name, t->name, THREAD_NAME_LEN);
+        snap[i].priority = t->priority;
+        snap[i].state = t->state;
+        snap[i].runtime = t->runtime + (t == current ? now - switch_tsc : 0);
+        snap[i].switches = t->switches;
+    }
+    irq_restore(flags);
+
+    if (!running) {
+        terminal_writestring("Scheduler not running.\n");
+        return;
+    }
+
+    uint64_t window = now - last_tsc;
+    uint32_t khz = tsc_khz();
+    if (khz) {
+        kprintf("CPU share over the last %u ms:\n", (uint32_t)udiv64(window, khz, 0));
+    }
+    terminal_writestring(" ID  NAME             PRI  STATE   CPU   TIME ms  SWITCHES\n");
+    for (int i = 0; i < THREAD_MAX; i++) {
+        if (snap[i].state == THREAD_UNUSED) continue;
+        uint64_t since = snap[i].runtime - (last_id[i] == snap[i].id ? last_runtime[i] : 0);
+        uint32_t ms = khz ? (uint32_t)udiv64(snap[i].runtime, khz, 0) : 0;
+        kprintf("%3u  %-15s  %3d  %-5s  %3u%%  %8u  %8u\n", snap[i].id, snap[i].name,
+                snap[i].priority, state_name(snap[i].state), percent(since, window), ms,
+                snap[i].switches);
+        last_id[i] = snap[i].id;
+        last_runtime[i] = snap[i].runtime;
+    }
+    last_tsc = now;
+}
+
+/* --- BENCHMARK --- */
+
+#define BENCH_ROUNDS 10000
+
+static volatile int bench_stop;
+static volatile int bench_done;
+
+static void bench_partner(void* arg) {
+    (void)arg;
+    while (!bench_stop) thread_yield();
+    bench_done = 1;
+}
+
+// Ping-pongs with a thread of the same priority: every round trip is two
+// switches. Then the same yield with nobody to switch to, and what the
+// FPU/SSE save and restore add to each switch.
+void sched_bench(void) {
+    if (!running) {
+        terminal_writestring("Scheduler not running.\n");
+        return;
+    }
+
+    bench_stop = 0;
+    bench_done = 0;
+    if (!thread_create("yield", current->priority, bench_partner, 0)) {
+        terminal_writestring("Could not start the partner thread.\n");
+        return;
+    }
+    thread_yield(); // Let it start
+
+    uint64_t min = ~0ULL, total = 0;
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        uint64_t start = rdtsc();
+        thread_yield();
+        uint64_t cycles = rdtsc() - start;
+        total += cycles;
+        if (cycles < min) min = cycles;
+    }
+    bench_stop = 1;
+    while (!bench_done) thread_yield();
+    thread_yield(); // Let it exit
+
+    uint64_t alone_min = ~0ULL;
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        uint64_t start = rdtsc();
+        thread_yield();
+        uint64_t cycles = rdtsc() - start;
+        if (cycles < alone_min) alone_min = cycles;
+    }
+
+    kprintf("Context switch: %u cycles avg, %u min (%u round trips)\n",
+            (uint32_t)udiv64(total, BENCH_ROUNDS * 2, 0), (uint32_t)(min / 2), BENCH_ROUNDS);
+    kprintf("Yield with nothing else ready: %u cycles\n", (uint32_t)alone_min);
+
+    if (cpu_features.sse2) {
+        uint64_t fpu_min = ~0ULL;
+        for (int i = 0; i < 1000; i++) {
+            uint64_t start = rdtsc();
+            fpu_save(current);
+            fpu_restore(current);
+            uint64_t cycles = rdtsc() - start;
+            if (cycles < fpu_min) fpu_min = cycles;
+        }
+        kprintf("  of which fxsave + fxrstor: %u cycles\n", (uint32_t)fpu_min);
+    }
+    uint32_t khz = tsc_khz();
+    if (khz) {
+        kprintf("  (%u ns per switch)\n", (uint32_t)udiv64(udiv64(total, BENCH_ROUNDS * 2, 0) * 1000000, khz, 0));
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stdint.h>
+#include "kernel.h"
+#include "cpu.h"
+
+/* Preemptive kernel threads on the boot CPU. Higher priorities always run
+   first, threads of equal priority share the CPU in time slices. */
+
+#define THREAD_MAX 32
+#define THREAD_STACK_SIZE 16384
+#define THREAD_NAME_LEN 16
+#define THREAD_SLICE_NS 10000000  // 10 ms
+
+enum {
+    THREAD_PRIO_SHELL,
+    THREAD_PRIO_NORMAL,  // Background commands
+    THREAD_PRIO_LOW,
+    THREAD_PRIO_IDLE,    // Only the idle thread, never queued
+};
+
+typedef enum {
+    THREAD_UNUSED,
+    THREAD_RUNNING,
+    THREAD_READY,
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+} thread_state_t;
+
+typedef void (*thread_fn_t)(void* arg);
+
+typedef struct thread {
+    uint8_t fpu[512];         // fxsave area, first so it stays 16-byte aligned
+    uint32_t esp;             // Saved by switch_context
+    struct thread* next;      // Run queue, wait queue or zombie list
+    uint32_t id;
+    char name[THREAD_NAME_LEN];
+    int priority;
+    thread_state_t state;
+    uint8_t* stack;           // NULL for the boot thread
+    thread_fn_t fn;
+    void* arg;
+    uint64_t runtime;         // TSC cycles on the CPU
+    uint32_t switches;        // Times switched in
+} __attribute__((aligned(16))) thread_t;
+
+// Turns the boot context into the "shell" thread and starts the idle
+// thread. Needs heap_init and timer_init.
+void sched_init(void);
+int sched_running(void);
+
+// The thread starts with interrupts on and exits when fn returns. NULL
+// when every slot is taken or the stack can't be allocated.
+thread_t* thread_create(const char* name, int priority, thread_fn_t fn, void* arg);
+thread_t* thread_current(void);
+void thread_yield(void);
+void thread_exit(void) __attribute__((noreturn));
+
+// Blocks for at least ns. Falls back to timer_sleep_ns before sched_init,
+// in interrupt context and with interrupts off.
+void thread_sleep_ns(uint64_t ns);
+
+// Picks the next thread and switches to it. Call with interrupts off; the
+// current thread must already be queued or blocked unless it is RUNNING.
+void schedule(void);
+
+// Periodic tick, for when the timer wheel is not running
+void sched_tick(void);
+
+/* Wait queues */
+typedef struct wait_queue {
+    thread_t* head;
+    thread_t* tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { 0, 0 }
+
+// Blocks until the next wake. Call with interrupts off after checking the
+// condition, so a wakeup can't slip in between; returns with them off.
+// Before sched_init it halts instead.
+void wait_queue_wait(wait_queue_t* q);
+void wait_queue_wake_all(wait_queue_t* q);  // Safe from interrupt handlers
+
+/* Preemption. Sections that touch shared state without interrupts off
+   (the terminal, the heap) hold it off. They nest. */
+void preempt_check(void);
+
+static inline void preempt_disable(void) {
+    cpu_self()->preempt_count++;
+    asm volatile ( "" : : : "memory" );
+}
+
+static inline void preempt_enable(void) {
+    asm volatile ( "" : : : "memory" );
+    percpu_t* self = cpu_self();
+    if (--self->preempt_count == 0 && self->need_resched) preempt_check();
+}
+
+/* Thread list for ps, and the cost of a switch */
+void sched_dump(void);
+void sched_bench(void);
+
+#endif
@@ -0,0 +1,349 @@
+#include "timer.h"
+#include "clock.h"
+#include "cpu.h"
+#include "klog.h"
+#include "kernel.h"
+
+/* --- WHEEL --- */
+
+// Level 0 slots are 2^16 ns (65.5 us) wide and every level is 64 times
+// coarser than the one below, so four levels reach about 18 minutes.
+// Timers further out wait in the last level and are re-filed when it
+// cascades. Exact deadlines are kept, the slots only order them.
+#define WHEEL_UNIT_SHIFT 16
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct ktimer {
+    struct ktimer* next;
+    struct ktimer** pprev;  // NULL once off the wheel
+    uint8_t level;
+    uint8_t slot;
+    uint64_t deadline;
+    timer_fn_t fn;
+    void* arg;
+};
+
+static ktimer_t* wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t occupied[WHEEL_LEVELS]; // One bit per non-empty slot
+static uint64_t wheel_clk = 0;          // Units handled so far
+
+static ktimer_t pool[TIMER_POOL_SIZE];
+static ktimer_t* free_timers = NULL;
+
+static const clockevent_t* clockevent = NULL;
+static uint64_t programmed = ~0ULL;  // Deadline the device is armed for
+static int tickless = 0;
+static timer_stats_t stats;
+
+// __builtin_ctzll would need libgcc on i386
+static inline int ctz64(uint64_t x) {
+    uint32_t lo = (uint32_t)x;
+    return lo ? __builtin_ctz(lo) : 32 + __builtin_ctz((uint32_t)(x >> 32));
+}
+
+static inline uint32_t slot_index(uint64_t units, int level) {
+    return (uint32_t)(units >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+}
+
+static void wheel_insert(ktimer_t* t) {
+    uint64_t e = t->deadline >> WHEEL_UNIT_SHIFT;
+    if (e < wheel_clk) e = wheel_clk;
+    if (e - wheel_clk >= WHEEL_RANGE) e = wheel_clk + WHEEL_RANGE - 1;
+
+    uint64_t delta = e - wheel_clk;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) level++;
+
+    uint32_t idx = slot_index(e, level);
+    t->level = level;
+    t->slot = idx;
+    t->next = wheel[level][idx];
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = &wheel[level][idx];
+    wheel[level][idx] = t;
+    occupied[level] |= 1ULL << idx;
+}
+
+static void wheel_unlink(ktimer_t* t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->pprev = NULL;
+    if (!wheel[t->level][t->slot]) occupied[t->level] &= ~(1ULL << t->slot);
+}
+
+// Re-files the slot of each level whose turn starts at wheel_clk
+static void wheel_cascade(void) {
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (wheel_clk & ((1ULL << (WHEEL_BITS * level)) - 1)) break;
+
+        uint32_t idx = slot_index(wheel_clk, level);
+        ktimer_t* t = wheel[level][idx];
+        wheel[level][idx] = NULL;
+        occupied[level] &= ~(1ULL << idx);
+        while (t) {
+            ktimer_t* next = t->next;
+            wheel_insert(t);
+            t = next;
+        }
+    }
+}
+
+// Moves the due timers of a level 0 slot onto the expired list
+static void wheel_expire(uint32_t idx, uint64_t now, ktimer_t** expired) {
+    ktimer_t* t = wheel[0][idx];
+    while (t) {
+        ktimer_t* next = t->next;
+        if (t->deadline <= now) {
+            wheel_unlink(t);
+            t->next = *expired;
+            *expired = t;
+        }
+        t = next;
+    }
+}
+
+static ktimer_t* wheel_run(uint64_t now) {
+    ktimer_t* expired = NULL;
+    uint64_t now_units = now >> WHEEL_UNIT_SHIFT;
+
+    while (wheel_clk < now_units) {
+        // The levels below the lowest one with timers are empty, so jump
+        // to its next occupied slot, the next turn of the level above it
+        // or now. At level 0 that is one slot at a time.
+        int level = 0;
+        while (level < WHEEL_LEVELS && !occupied[level]) level++;
+        uint64_t next = now_units;
+        if (level < WHEEL_LEVELS) {
+            int shift = WHEEL_BITS * level;
+            uint32_t idx = slot_index(wheel_clk, level);
+            if (level == 0 && (occupied[0] & (1ULL << idx))) wheel_expire(idx, ~0ULL, &expired);
+
+            uint64_t turn = (wheel_clk >> shift) & ~(uint64_t)(WHEEL_SIZE - 1);
+            next = (turn + WHEEL_SIZE) << shift;
+            uint64_t later = idx == WHEEL_SIZE - 1 ? 0 : occupied[level] & (~0ULL << (idx + 1));
+            if (later) next = (turn + ctz64(later)) << shift;
+        }
+        if (next > now_units) next = now_units;
+
+        wheel_clk = next;
+        if (!(wheel_clk & (WHEEL_SIZE - 1))) wheel_cascade();
+    }
+
+    // The current slot may hold deadlines later in this unit
+    wheel_expire(slot_index(wheel_clk, 0), now, &expired);
+    return expired;
+}
+
+static uint64_t slot_min(ktimer_t* t, uint64_t best) {
+    for (; t; t = t->next) {
+        if (t->deadline < best) best = t->deadline;
+    }
+    return best;
+}
+
+// Earliest deadline: per level, the current slot and the next occupied
+// one. The current slot of an upper level can hold timers a whole turn
+// away, so it never hides the slots after it. The last level also holds
+// the clamped far-off timers out of order, so all of it is searched.
+static uint64_t wheel_next_deadline(void) {
+    uint64_t best = ~0ULL;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t bits = occupied[level];
+        if (!bits) continue;
+
+        if (level == WHEEL_LEVELS - 1) {
+            for (uint32_t idx = 0; idx < WHEEL_SIZE; idx++) {
+                if (bits & (1ULL << idx)) best = slot_min(wheel[level][idx], best);
+            }
+            continue;
+        }
+
+        uint32_t cur = slot_index(wheel_clk, level);
+        if (bits & (1ULL << cur)) best = slot_min(wheel[level][cur], best);
+
+        uint64_t rest = bits & ~(1ULL << cur);
+        if (!rest) continue;
+        uint64_t rotated = cur ? (rest >> cur) | (rest << (64 - cur)) : rest;
+        uint32_t idx = (cur + ctz64(rotated)) & (WHEEL_SIZE - 1);
+        best = slot_min(wheel[level][idx], best);
+    }
+    return best;
+}
+
+/* --- CLOCKEVENT --- */
+
+// Arms the device for the earliest deadline, but never past its range or
+// the point where a narrow clocksource would wrap unseen. With nothing
+// pending and a 64-bit clocksource the device stays quiet.
+static void timer_reprogram(uint64_t now) {
+    uint64_t deadline = wheel_next_deadline();
+    uint64_t limit = clock_max_idle_ns();
+    if (limit != ~0ULL && (deadline == ~0ULL || (deadline > now && deadline - now > limit))) {
+        deadline = now + limit;
+    }
+    programmed = deadline;
+    if (deadline == ~0ULL) return;
+
+    uint64_t delta = deadline > now ? deadline - now : 0;
+    if (delta > clockevent->max_ns) {
+        delta = clockevent->max_ns;
+        programmed = now + delta;
+    }
+    if (delta < clockevent->min_ns) delta = clockevent->min_ns;
+    clockevent->program(delta);
+    stats.programs++;
+}
+
+/* PIT channel 0 in mode 0: one interrupt when the count runs out */
+
+#define PIT_HZ 1193182
+#define PIT_NS_MULT 5124677  // PIT_HZ * 2^32 / 1e9
+
+static void pit_program(uint64_t delta_ns) {
+    uint32_t count = (uint32_t)mul_u64_u32_shr(delta_ns, PIT_NS_MULT, 32) + 1;
+    if (count > 0xFFFF) count = 0xFFFF;
+    outb(0x43, 0x30); // Channel 0, lobyte/hibyte, mode 0
+    outb(0x40, count & 0xFF);
+    outb(0x40, count >> 8);
+}
+
+static const clockevent_t pit_clockevent = {
+    .name = "pit",
+    .min_ns = 2000,
+    .max_ns = 0xFFFFULL * 1000000000 / PIT_HZ,
+    .program = pit_program,
+};
+
+void timer_interrupt(void) {
+    stats.wakeups++;
+    clock_tick();
+
+    uint64_t now = ktime_get_ns();
+    ktimer_t* t = wheel_run(now);
+    while (t) {
+        ktimer_t* next = t->next;
+        uint64_t slack = now - t->deadline;
+        stats.slack_total_ns += slack;
+        if (slack > stats.slack_max_ns) stats.slack_max_ns = slack > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)slack;
+        stats.fired++;
+        stats.pending--;
+
+        // Back to the pool first, the callback may add a timer
+        timer_fn_t fn = t->fn;
+        void* arg = t->arg;
+        t->next = free_timers;
+        free_timers = t;
+        fn(arg);
+        t = next;
+    }
+
+    timer_reprogram(ktime_get_ns());
+}
+
+/* --- API --- */
+
+void timer_init(void) {
+    if (!clocksource_current()) {
+        klog(KLOG_WARN, "timer: no clocksource, keeping the periodic tick");
+        return;
+    }
+
+    for (int i = 0; i < TIMER_POOL_SIZE; i++) {
+        pool[i].next = free_timers;
+        free_timers = &pool[i];
+    }
+
+    uint32_t flags = irq_save();
+    outb(0x43, 0x30); // Mode 0 waits for a count, which ends the periodic tick
+    uint64_t now = ktime_get_ns();
+    wheel_clk = now >> WHEEL_UNIT_SHIFT;
+    clockevent = &pit_clockevent;
+    tickless = 1;
+    timer_reprogram(now);
+    irq_restore(flags);
+    klog(KLOG_INFO, "timer: tickless, one-shot %s", clockevent->name);
+}
+
+int timer_tickless(void) {
+    return tickless;
+}
+
+void timer_set_clockevent(const clockevent_t* ce) {
+    uint32_t flags = irq_save();
+    clockevent = ce;
+    timer_reprogram(ktime_get_ns());
+    irq_restore(flags);
+    klog(KLOG_INFO, "timer: clockevent %s", ce->name);
+}
+
+const clockevent_t* timer_get_clockevent(void) {
+    return clockevent;
+}
+
+ktimer_t* timer_add(uint64_t deadline_ns, timer_fn_t fn, void* arg) {
+    if (!tickless) return NULL;
+
+    uint32_t flags = irq_save();
+    ktimer_t* t = free_timers;
+    if (t) {
+        free_timers = t->next;
+        t->deadline = deadline_ns;
+        t->fn = fn;
+        t->arg = arg;
+        // An empty wheel gets no interrupts to move it along; catch up
+        // here instead of stepping through the idle time in wheel_run
+        if (!stats.pending) {
+            uint64_t units = ktime_get_ns() >> WHEEL_UNIT_SHIFT;
+            if (units > wheel_clk) wheel_clk = units;
+        }
+        wheel_insert(t);
+        stats.pending++;
+        if (deadline_ns < programmed) timer_reprogram(ktime_get_ns());
+    }
+    irq_restore(flags);
+    return t;
+}
+
+int timer_cancel(ktimer_t* t) {
+    uint32_t flags = irq_save();
+    int ret = -1;
+    if (t->pprev) {
+        wheel_unlink(t);
+        t->next = free_timers;
+        free_timers = t;
+        stats.pending--;
+        ret = 0;
+    }
+    irq_restore(flags);
+    return ret;
+}
+
+static void sleep_wake(void* arg) {
+    *(volatile int*)arg = 1;
+}
+
+void timer_sleep_ns(uint64_t ns) {
+    uint64_t deadline = ktime_get_ns() + ns;
+    volatile int done = 0;
+
+    uint32_t flags = irq_save();
+    if (!(flags & 0x200) || !timer_add(deadline, sleep_wake, (void*)&done)) {
+        while (ktime_get_ns() < deadline) asm volatile ( "pause" );
+    } else {
+        // sti only takes effect after hlt, so a wakeup can't slip in between
+        while (!done) {
+            cpu_idle();
+            irq_disable();
+        }
+    }
+    irq_restore(flags);
+}
+
+void timer_get_stats(timer_stats_t* out) {
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
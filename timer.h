@@ -0,0 +1,55 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+/* Tickless timers: pending deadlines sit in a hierarchical timer wheel and
+   the clockevent device is programmed one-shot for the earliest one. */
+
+typedef void (*timer_fn_t)(void* arg);
+typedef struct ktimer ktimer_t;
+
+// One-shot event device
+typedef struct {
+    const char* name;
+    uint64_t min_ns;
+    uint64_t max_ns;  // Longest delta a single programming covers
+    void (*program)(uint64_t delta_ns);
+} clockevent_t;
+
+#define TIMER_POOL_SIZE 128
+
+// Stops the periodic PIT tick and switches to one-shot PIT mode 0.
+// Needs clock_init.
+void timer_init(void);
+int timer_tickless(void);
+
+// Hands the wheel to another device, e.g. the local APIC timer
+void timer_set_clockevent(const clockevent_t* ce);
+const clockevent_t* timer_get_clockevent(void);
+
+// Called from the clockevent's interrupt handler
+void timer_interrupt(void);
+
+// Runs fn(arg) from interrupt context once ktime_get_ns() >= deadline_ns.
+// Returns NULL when the pool is exhausted or timer_init has not run. A
+// handle is only valid until its callback starts.
+ktimer_t* timer_add(uint64_t deadline_ns, timer_fn_t fn, void* arg);
+int timer_cancel(ktimer_t* t); // 0 if the timer was still pending
+
+// Halts until the deadline passes (busy waits with interrupts off)
+void timer_sleep_ns(uint64_t ns);
+
+typedef struct {
+    uint32_t pending;
+    uint32_t wakeups;         // Clockevent interrupts
+    uint32_t fired;           // Callbacks run
+    uint32_t programs;        // Clockevent reprogrammings
+    uint64_t slack_total_ns;  // Sum of (run time - deadline)
+    uint32_t slack_max_ns;
+} timer_stats_t;
+
+void timer_get_stats(timer_stats_t* out);
+
+#endif
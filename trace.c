@@ -0,0 +1,164 @@
+#include "trace.h"
+#include "cpu.h"
+#include "clock.h"
+#include "thread.h"
+#include "smp.h"
+#include "perf.h"
+#include "serial.h"
+#include "klog.h"
+#include "mm.h"
+#include "kernel.h"
+
+/* Nothing here may be instrumented, or the hooks would call themselves.
+   This file is never built with -finstrument-functions, the attribute
+   covers the header inlines it uses too. */
+#define NOTRACE __attribute__((no_instrument_function))
+
+typedef struct {
+    uint64_t tsc;
+    uint32_t fn;
+    uint32_t info;  // Thread id << 1 | 1 for an exit
+} trace_rec_t;
+
+typedef struct {
+    uint32_t head;  // Records written, the ring keeps the newest
+    trace_rec_t rec[TRACE_RING_RECORDS];
+} trace_ring_t;
+
+static trace_ring_t* rings[MAX_CPUS];
+static int ring_count;
+static volatile int tracing;
+static uint64_t start_tsc;
+
+static uint32_t excluded[TRACE_MAX_EXCLUDE];
+static volatile int exclude_count;
+
+static inline NOTRACE void trace_record(void* fn, uint32_t exit) {
+    if (!tracing) return;
+    for (int i = 0; i < exclude_count; i++) {
+        if (excluded[i] == (uint32_t)fn) return;
+    }
+
+    percpu_t* self = cpu_self();
+    trace_ring_t* ring = rings[self->index];
+    if (!ring) return;
+    uint32_t tid = 0;
+    if (self->index == 0) {
+        thread_t* t = thread_current();
+        if (t) tid = t->id;
+    }
+
+    // An interrupt could log on this CPU between claiming and filling a slot
+    uint32_t flags = irq_save();
+    trace_rec_t* r = &ring->rec[ring->head++ & (TRACE_RING_RECORDS - 1)];
+    r->tsc = rdtsc();
+    r->fn = (uint32_t)fn;
+    r->info = tid << 1 | exit;
+    irq_restore(flags);
+}
+
+void NOTRACE __cyg_profile_func_enter(void* fn, void* call_site) {
+    (void)call_site;
+    trace_record(fn, 0);
+}
+
+void NOTRACE __cyg_profile_func_exit(void* fn, void* call_site) {
+    (void)call_site;
+    trace_record(fn, 1);
+}
+
+int trace_available(void) {
+#ifdef CONFIG_TRACE
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+int trace_start(void) {
+    if (!trace_available()) return -1;
+    trace_stop();
+
+    ring_count = smp_cpu_count();
+    for (int i = 0; i < ring_count; i++) {
+        if (!rings[i]) {
+            trace_ring_t* ring = kmalloc(sizeof(trace_ring_t));
+            if (!ring) return -1;
+            rings[i] = ring;
+        }
+        rings[i]->head = 0;
+    }
+    start_tsc = rdtsc();
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+    klog(KLOG_INFO, "trace: recording on %d CPUs", ring_count);
+    return 0;
+}
+
+void trace_stop(void) {
+    __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+}
+
+int trace_exclude(uint32_t fn) {
+    if (exclude_count == TRACE_MAX_EXCLUDE) return -1;
+    excluded[exclude_count] = fn;
+    __atomic_store_n(&exclude_count, exclude_count + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void trace_dump_status(void) {
+    if (!trace_available()) {
+        terminal_writestring("Built without function tracing, use 'make trace'.\n");
+        return;
+    }
+    kprintf("Tracing %s, %u records per CPU\n", tracing ? "on" : "off", TRACE_RING_RECORDS);
+    for (int i = 0; i < ring_count; i++) {
+        if (rings[i]) kprintf("  CPU %d: %u records\n", i, rings[i]->head);
+    }
+    for (int i = 0; i < exclude_count; i++) {
+        const char* name = ksym_lookup(excluded[i], 0);
+        kprintf("  excluded: %s\n", name ? name : "?");
+    }
+}
+
+void trace_export_json(void) {
+    if (!trace_available()) {
+        terminal_writestring("Built without function tracing, use 'make trace'.\n");
+        return;
+    }
+    if (!serial_present()) {
+        terminal_writestring("No serial port.\n");
+        return;
+    }
+    trace_stop();
+
+    uint32_t khz = tsc_khz();
+    if (!khz) {
+        terminal_writestring("TSC not calibrated.\n");
+        return;
+    }
+
+    char line[160];
+    uint32_t events = 0;
+    serial_write("{\"traceEvents\":[\n", 17);
+    for (int cpu = 0; cpu < ring_count; cpu++) {
+        trace_ring_t* ring = rings[cpu];
+        if (!ring) continue;
+        uint32_t head = ring->head;
+        uint32_t first = head > TRACE_RING_RECORDS ? head - TRACE_RING_RECORDS : 0;
+        for (uint32_t i = first; i < head; i++) {
+            trace_rec_t* r = &ring->rec[i & (TRACE_RING_RECORDS - 1)];
+            uint64_t ns = r->tsc > start_tsc ? udiv64((r->tsc - start_tsc) * 1000000, khz, 0) : 0;
+            uint32_t rem;
+            uint64_t us = udiv64(ns, 1000, &rem);
+            const char* name = ksym_lookup(r->fn, 0);
+            int len = ksnprintf(line, sizeof(line),
+                                "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%u}\n",
+                                events ? "," : "", name ? name : "?", (r->info & 1) ? 'E' : 'B',
+                                us, rem, cpu, r->info >> 1);
+            serial_write(line, len < (int)sizeof(line) ? (size_t)len : sizeof(line) - 1);
+            events++;
+        }
+    }
+    serial_write("],\"displayTimeUnit\":\"ns\"}\n", 26);
+    kprintf("%u trace events written to the serial port.\n", events);
+}
@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+/* Function tracer. `make trace` builds kernel.c and cpu.c with
+   -finstrument-functions; the hooks then log every entry and exit with
+   its TSC into a ring per CPU, keeping the newest records. Inlines from
+   headers and the hottest leaves are left out at compile time (see the
+   Makefile), more can be excluded at run time. */
+
+#define TRACE_RING_RECORDS 16384  // Per CPU, power of two
+#define TRACE_MAX_EXCLUDE 16
+
+// 0 when the kernel was built without instrumentation
+int trace_available(void);
+
+// Allocates the rings on first use and starts recording from scratch
+int trace_start(void);
+void trace_stop(void);
+
+// Stops recording, e.g. when the hooks of a hot function drown the rest.
+// -1 when the list is full.
+int trace_exclude(uint32_t fn);
+
+/* Records per CPU and the exclusions */
+void trace_dump_status(void);
+
+// Stops tracing and writes the rings to the serial port as Chrome
+// trace-event JSON (chrome://tracing, Perfetto): B/E events with pid the
+// CPU and tid the thread
+void trace_export_json(void);
+
+#endif
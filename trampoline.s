@@ -0,0 +1,70 @@
+/* trampoline.s - Application processor startup
+   smp_init copies this to TRAMPOLINE_BASE and points the STARTUP IPI at
+   it. The AP arrives in real mode, so everything below is addressed
+   through its copy, not where the kernel image was linked. */
+
+.set TRAMPOLINE_BASE, 0x8000
+
+.section .text
+.code16
+.global trampoline_start
+trampoline_start:
+    cli
+    cld
+    xor %ax, %ax
+    mov %ax, %ds
+    lgdtl tramp_gdt_ptr - trampoline_start + TRAMPOLINE_BASE
+    mov %cr0, %eax
+    or $1, %eax
+    mov %eax, %cr0
+    ljmpl $0x08, $(tramp_protected - trampoline_start + TRAMPOLINE_BASE)
+
+.code32
+tramp_protected:
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+    mov %ax, %ss
+
+    /* The boot CPU's control registers: its page directory, PSE and SSE
+       bits, and CR0 with paging on and the caches enabled */
+    mov tramp_cr4 - trampoline_start + TRAMPOLINE_BASE, %eax
+    mov %eax, %cr4
+    mov tramp_cr3 - trampoline_start + TRAMPOLINE_BASE, %eax
+    mov %eax, %cr3
+    mov tramp_cr0 - trampoline_start + TRAMPOLINE_BASE, %eax
+    mov %eax, %cr0
+
+    mov tramp_stack - trampoline_start + TRAMPOLINE_BASE, %esp
+    mov tramp_entry - trampoline_start + TRAMPOLINE_BASE, %eax
+    call *%eax
+    cli
+1:  hlt
+    jmp 1b
+
+/* Flat code and data, replaced by the CPU's own GDT in cpu_init_ap */
+.align 8
+tramp_gdt:
+    .quad 0
+    .quad 0x00CF9A000000FFFF
+    .quad 0x00CF92000000FFFF
+tramp_gdt_ptr:
+    .word tramp_gdt_ptr - tramp_gdt - 1
+    .long tramp_gdt - trampoline_start + TRAMPOLINE_BASE
+
+/* Filled in by smp_init, see trampoline_args_t */
+.align 4
+.global trampoline_args
+trampoline_args:
+tramp_cr0:   .long 0
+tramp_cr3:   .long 0
+tramp_cr4:   .long 0
+tramp_stack: .long 0
+tramp_entry: .long 0
+
+.global trampoline_end
+trampoline_end:
+
+.section .note.GNU-stack,"",@progbits